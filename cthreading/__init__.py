@@ -4,13 +4,32 @@
 # modify, copy, or redistribute it subject to the terms and conditions
 # of the GNU General Public License v2 or (at your option) any later version.
 
+import itertools
+import os
 import sys
+import thread
+import _cthreading
 from _cthreading import Lock, RLock, Condition
+from _cthreading import Channel, ChannelClosed, Timeout, select
+from _cthreading import WaitGroup, RateLimiter, LockTable, SeqLock
+from _cthreading import ObjectPool, AtomicInt, Counter, ByteRing
+from _cthreading import Scheduler
+from _cthreading import CancelToken, Cancelled
 
 _patched = False
+_scheduler = None
+_scheduler_pid = None  # Process owning _scheduler threads
+_timers = set()  # Started non-daemon timers
+_counter = itertools.count(1)
 
 
-def monkeypatch():
+def monkeypatch(timer=False):
+    """
+    Patch the thread and threading modules to use cthreading locks. If timer
+    is True, threading.Timer is patched to use the shared scheduler; see
+    Timer. Exit waits for pending non-daemon timers, as it waits for
+    threads.
+    """
     global _patched
 
     if _patched:
@@ -28,4 +47,238 @@ def monkeypatch():
     threading.RLock = RLock
     threading.Condition = Condition
 
+    if timer:
+        threading.Timer = Timer
+
     _patched = True
+
+
+def watchdog(threshold, callback=None):
+    """
+    Report Lock and RLock objects held or waited on longer than threshold
+    seconds. If callback is not specified, reports are logged as warnings
+    using the "cthreading" logger. See _cthreading.set_watchdog() for the
+    callback arguments.
+
+    Use threshold=None to disable the watchdog.
+    """
+    if threshold is not None and callback is None:
+        callback = _log_report
+    _cthreading.set_watchdog(threshold, callback)
+
+
+def _log_report(kind, lock, duration, holder, stack, waiters):
+    # Importing logging imports threading, so we cannot import it before
+    # monkeypatching.
+    import logging
+    import traceback
+
+    if kind == "hold":
+        msg = "Lock %r held for %.3f seconds by thread %d (%d waiters)"
+    else:
+        msg = ("Waiting for lock %r for %.3f seconds, held by thread %d "
+               "(%d waiters)")
+    msg %= (lock, duration, holder, waiters)
+    if stack:
+        msg += ", acquired at:\n" + "".join(traceback.format_list(stack))
+
+    logging.getLogger("cthreading").warning("%s", msg)
+
+
+def blocked():
+    """
+    Return a list of dicts describing the threads blocked on cthreading
+    objects, with the keys "thread", "object", "kind" ("acquire", "wait",
+    "send", "recv", "read" or "write"), "start" (seconds since the epoch),
+    "timeout" (None if waiting without a limit) and "stack" (as returned by
+    traceback.extract_stack()). A thread blocked in select() has an entry
+    for every channel.
+    """
+    import traceback
+
+    frames = sys._current_frames()
+    result = []
+    for thread, obj, kind, start, timeout in _cthreading.blocked():
+        frame = frames.get(thread)
+        stack = traceback.extract_stack(frame) if frame else []
+        result.append({"thread": thread, "object": obj, "kind": kind,
+                       "start": start, "timeout": timeout, "stack": stack})
+    return result
+
+
+def scheduler():
+    """
+    Return the shared Scheduler, creating it on the first call. Due calls
+    run in worker threads; see _Dispatcher. The scheduler is shut down when
+    the interpreter exits, after running pending non-daemon timers.
+    """
+    global _scheduler, _scheduler_pid
+    if _scheduler_pid != os.getpid():
+        if _scheduler is None:
+            import atexit
+            atexit.register(_shutdown_scheduler)
+        else:
+            _forget_parent_scheduler()
+        _scheduler = Scheduler(dispatch=_Dispatcher())
+        _scheduler_pid = os.getpid()
+    return _scheduler
+
+
+def _forget_parent_scheduler():
+    # A forked child inherits the scheduler and timers, but not the threads
+    # running them. Like threading does for threads of the parent, consider
+    # the parent timers finished.
+    for timer in _timers:
+        timer.finished.set()
+    _timers.clear()
+    _scheduler.shutdown()
+
+
+def _shutdown_scheduler():
+    if _scheduler_pid != os.getpid():
+        _forget_parent_scheduler()
+        return
+    # Like threading, wait for non-daemon timers before exiting. Timers may
+    # start other timers.
+    while _timers:
+        _timers.pop().join()
+    _scheduler.shutdown()
+
+
+class _Dispatcher(object):
+    """
+    Pass due calls to worker threads, so a blocking call does not delay the
+    other calls. A call is passed to an idle worker, or to a new worker if
+    all workers are busy. Workers exit after waiting idle seconds for the
+    next call.
+    """
+
+    def __init__(self, idle=5.0):
+        self._calls = Channel()
+        self._idle = idle
+
+    def __call__(self, call):
+        try:
+            self._calls.send(call, timeout=0)
+        except Timeout:
+            import threading
+            t = threading.Thread(target=self._work, args=(call,),
+                                 name="cthreading-scheduler")
+            t.daemon = True
+            try:
+                t.start()
+            except Exception:
+                # Losing the call would leave a timer pending forever; run it
+                # in the dispatch thread, delaying the other calls instead.
+                import traceback
+                traceback.print_exc()
+                self._work(call, idle=False)
+
+    def _work(self, call, idle=True):
+        import traceback
+        while True:
+            try:
+                call()
+            except Exception:
+                traceback.print_exc()
+            if not idle:
+                return
+            call = None
+            try:
+                call = self._calls.recv(timeout=self._idle)
+            except Timeout:
+                return
+
+
+class Timer(object):
+    """
+    Replacement for threading.Timer, scheduling function on the shared
+    scheduler instead of starting a thread per timer. When the interval
+    expires, run() is called in a worker thread shared with other timers.
+
+    As with threading, the interpreter waits for pending non-daemon timers
+    when exiting, without a timeout; a non-daemon timer with a long interval
+    delays exit until it fires. Cancel such timers before exiting, or make
+    them daemon.
+    """
+
+    def __init__(self, interval, function, args=(), kwargs=None):
+        # Importing threading before monkeypatching is not allowed.
+        import threading
+        self.interval = interval
+        self.function = function
+        self.args = args
+        self.kwargs = {} if kwargs is None else kwargs
+        self.finished = threading.Event()
+        self.name = "Timer-%d" % next(_counter)
+        self.ident = None  # Thread running the timer, once it runs
+        self._daemon = threading.current_thread().daemon
+        self._call = None
+
+    def start(self):
+        if self._call is not None:
+            raise RuntimeError("threads can only be started once")
+        self._call = scheduler().call_later(self.interval, self._run)
+        if not self._daemon:
+            _timers.add(self)
+
+    def run(self):
+        """
+        Call function unless the timer was cancelled. Subclasses may
+        override this.
+        """
+        if not self.finished.is_set():
+            self.function(*self.args, **self.kwargs)
+        self.finished.set()
+
+    def cancel(self):
+        """Stop the timer if it hasn't finished yet."""
+        self.finished.set()
+        _timers.discard(self)
+        if self._call is not None:
+            self._call.cancel()
+
+    def join(self, timeout=None):
+        """
+        Wait until function returned or the timer was cancelled.
+        """
+        if self._call is None:
+            raise RuntimeError("cannot join thread before it is started")
+        if self.ident == thread.get_ident() and self.is_alive():
+            raise RuntimeError("cannot join current thread")
+        self.finished.wait(timeout)
+
+    def is_alive(self):
+        return self._call is not None and not self.finished.is_set()
+
+    isAlive = is_alive
+
+    @property
+    def daemon(self):
+        return self._daemon
+
+    @daemon.setter
+    def daemon(self, daemonic):
+        if self._call is not None:
+            raise RuntimeError("cannot set daemon status of active thread")
+        self._daemon = daemonic
+
+    def isDaemon(self):
+        return self.daemon
+
+    def setDaemon(self, daemonic):
+        self.daemon = daemonic
+
+    def getName(self):
+        return self.name
+
+    def setName(self, name):
+        self.name = name
+
+    def _run(self):
+        self.ident = thread.get_ident()
+        try:
+            self.run()
+        finally:
+            self.finished.set()
+            _timers.discard(self)
@@ -9,6 +9,10 @@
 #include <Python.h>
 #include <structmember.h> /* offsetof */
 #include <pythread.h>
+#include <frameobject.h>
+
+#define CTHREADING_MODULE
+#include "cthreading_capi.h"
 
 #include <semaphore.h>
 #include <string.h>
@@ -16,10 +20,81 @@
 #include <time.h>
 #include <stdlib.h>
 
+/* Static tracepoints
+ *
+ * When built with systemtap sys/sdt.h, the module provides USDT probes under
+ * the "cthreading" provider. When no tracer is attached, a probe costs a
+ * single test of the probe semaphore. Object arguments are the address of the Python object,
+ * matching id(obj); timeouts are in microseconds, -1 meaning unlimited.
+ *
+ *   acquire__start(obj, tid, timeout)    - lock is contended, about to block
+ *   acquire__done(obj, tid, timeout, contended, acquired)
+ *   release(obj, tid)
+ *   wait__start(cond, tid, timeout)
+ *   wait__done(cond, tid, timeout, notified)
+ *   notify(cond, tid, requested, woken)
+ *
+ * See the tracing directory for example bpftrace scripts. */
+
+#ifdef HAVE_SYS_SDT_H
+
+/* Use probe semaphores so arguments are computed only when a tracer is
+ * attached. */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) \
+    unsigned short cthreading_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+
+#define TRACE_ENABLED(name) \
+    __builtin_expect(cthreading_##name##_semaphore, 0)
+
+TRACE_SEMAPHORE(acquire__start);
+TRACE_SEMAPHORE(acquire__done);
+TRACE_SEMAPHORE(release);
+TRACE_SEMAPHORE(wait__start);
+TRACE_SEMAPHORE(wait__done);
+TRACE_SEMAPHORE(notify);
+
+#define TRACE2(name, a, b) do { \
+    if (TRACE_ENABLED(name)) \
+        DTRACE_PROBE2(cthreading, name, a, b); \
+} while (0)
+
+#define TRACE3(name, a, b, c) do { \
+    if (TRACE_ENABLED(name)) \
+        DTRACE_PROBE3(cthreading, name, a, b, c); \
+} while (0)
+
+#define TRACE4(name, a, b, c, d) do { \
+    if (TRACE_ENABLED(name)) \
+        DTRACE_PROBE4(cthreading, name, a, b, c, d); \
+} while (0)
+
+#define TRACE5(name, a, b, c, d, e) do { \
+    if (TRACE_ENABLED(name)) \
+        DTRACE_PROBE5(cthreading, name, a, b, c, d, e); \
+} while (0)
+
+#else
+
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#define TRACE4(name, a, b, c, d) do {} while (0)
+#define TRACE5(name, a, b, c, d, e) do {} while (0)
+
+#endif
+
 static PyObject *ThreadError;
 
 /* Helpers */
 
+/* Python 2 does not provide Py_MIN. */
+#ifndef Py_MIN
+#define Py_MIN(x, y) (((x) > (y)) ? (y) : (x))
+#endif
+
 static PyObject *
 set_error_info(int err, const char *msg, const char *file, int line)
 {
@@ -76,6 +151,24 @@ deadline_from_timeout(double timeout, struct timespec *deadline)
     deadline->tv_nsec = tv.tv_usec * NSEC_PER_USEC;
 }
 
+/* Return monotonic time in seconds. */
+static double
+monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+timespec_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
 #define UNLIMITED (-1)
 
 static int
@@ -101,19 +194,27 @@ parse_timeout(PyObject *obj, double *timeout)
     return 0;
 }
 
-/* Parse acquire args (blocking=True, timeout=-1)) and return the timeout by
- * reference. The blocking argument is not needed as timeout=-1 means blocking
- * without limit, and timeout=0 means no blocking. */
+/* Convert timeout to microseconds for tracepoints. */
+#define TRACE_TIMEOUT(timeout) \
+    ((timeout) < 0 ? -1L : (long)((timeout) * USEC_PER_SEC))
+
+/* Parse acquire args (blocking=True, timeout=-1, token=None)) and return the
+ * timeout and the token argument by reference. The blocking argument is not
+ * needed as timeout=-1 means blocking without limit, and timeout=0 means no
+ * blocking. */
 static int
-acquire_parse_args(PyObject *args, PyObject *kwds, double *timeout)
+acquire_parse_args(PyObject *args, PyObject *kwds, double *timeout,
+                   PyObject **token)
 {
-    char *kwlist[] = {"blocking", "timeout", NULL};
+    char *kwlist[] = {"blocking", "timeout", "token", NULL};
     int blocking = 1;
     PyObject *obj = Py_None;
     double value;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iO:acquire", kwlist,
-                                     &blocking, &obj))
+    *token = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iOO:acquire", kwlist,
+                                     &blocking, &obj, token))
         return -1;
 
     if (parse_timeout(obj, &value) != 0)
@@ -133,17 +234,404 @@ acquire_parse_args(PyObject *args, PyObject *kwds, double *timeout)
     return 0;
 }
 
+/* Watchdog
+ *
+ * When enabled, Lock and RLock record the time, the thread and the Python
+ * stack of the outermost acquire. Holding a lock longer than the watchdog
+ * threshold is reported when the lock is released; waiting for a lock is
+ * reported every threshold seconds while waiting.
+ *
+ * The stack is recorded as the code object and current line of each frame,
+ * since the frames keep running while the lock is held, and keeping them
+ * would keep their locals alive. The array is reused by the next acquire, so
+ * recording does not allocate once it is large enough. */
+
+struct watch_site {
+    PyCodeObject *code;
+    int lineno;
+};
+
+struct watch {
+    double acquired;    /* Monotonic time of acquire, 0 if not recorded */
+    long holder;        /* Thread acquiring the lock */
+    struct watch_site *stack;   /* Acquiring stack, innermost frame first */
+    int depth;          /* Number of recorded frames */
+    int allocated;      /* Size of stack array */
+    int waiters;        /* Threads blocked on the lock */
+};
+
+static double watchdog_threshold;   /* Seconds, 0 if disabled */
+static PyObject *watchdog_callback;
+
+static void
+watch_init(struct watch *watch)
+{
+    watch->acquired = 0;
+    watch->holder = 0;
+    watch->stack = NULL;
+    watch->depth = 0;
+    watch->allocated = 0;
+    watch->waiters = 0;
+}
+
+static void
+watch_clear_stack(struct watch *watch)
+{
+    while (watch->depth > 0) {
+        watch->depth--;
+        Py_DECREF(watch->stack[watch->depth].code);
+    }
+}
+
+static void
+watch_free(struct watch *watch)
+{
+    watch_clear_stack(watch);
+    PyMem_Free(watch->stack);
+    watch->stack = NULL;
+    watch->allocated = 0;
+}
+
+/* Return a list of (filename, lineno, name) tuples for the recorded stack,
+ * oldest frame first. Does not run Python code, so the stack cannot change
+ * while extracting it. */
+static PyObject *
+watch_extract(struct watch *watch)
+{
+    PyObject *sites;
+    int i;
+
+    sites = PyList_New(watch->depth);
+    if (sites == NULL)
+        return NULL;
+
+    for (i = 0; i < watch->depth; i++) {
+        struct watch_site *site = &watch->stack[watch->depth - 1 - i];
+        PyObject *item = Py_BuildValue("OiO", site->code->co_filename,
+                                       site->lineno, site->code->co_name);
+        if (item == NULL) {
+            Py_DECREF(sites);
+            return NULL;
+        }
+        PyList_SET_ITEM(sites, i, item);
+    }
+
+    return sites;
+}
+
+/* Convert sites from watch_extract() to a list of (filename, lineno, name,
+ * line) tuples, as returned by traceback.extract_stack(). */
+static PyObject *
+watch_format_stack(PyObject *sites)
+{
+    PyObject *linecache;
+    PyObject *stack;
+    Py_ssize_t i;
+
+    linecache = PyImport_ImportModule("linecache");
+    if (linecache == NULL)
+        return NULL;
+
+    stack = PyList_New(PyList_GET_SIZE(sites));
+    if (stack == NULL)
+        goto out;
+
+    for (i = 0; i < PyList_GET_SIZE(sites); i++) {
+        PyObject *filename, *name;
+        PyObject *line = NULL;
+        PyObject *item = NULL;
+        int lineno;
+
+        if (!PyArg_ParseTuple(PyList_GET_ITEM(sites, i), "OiO", &filename,
+                              &lineno, &name))
+            goto error;
+
+        line = PyObject_CallMethod(linecache, "checkcache", "O", filename);
+        if (line == NULL)
+            goto error;
+        Py_DECREF(line);
+
+        item = PyObject_CallMethod(linecache, "getline", "Oi", filename,
+                                   lineno);
+        if (item == NULL)
+            goto error;
+
+        line = PyObject_CallMethod(item, "strip", NULL);
+        Py_DECREF(item);
+        if (line == NULL)
+            goto error;
+
+        item = Py_BuildValue("OiOO", filename, lineno, name,
+                             PyObject_IsTrue(line) ? line : Py_None);
+        Py_DECREF(line);
+        if (item == NULL)
+            goto error;
+
+        PyList_SET_ITEM(stack, i, item);
+    }
+
+out:
+    Py_DECREF(linecache);
+    return stack;
+
+error:
+    Py_CLEAR(stack);
+    goto out;
+}
+
+/* Report a lock held or waited on for duration seconds to the watchdog
+ * callback. Errors in the callback are printed and ignored. Reports from
+ * within the callback are dropped, since the callback may use locks. */
+static void
+watchdog_report(const char *kind, PyObject *obj, double duration, long holder,
+                PyObject *sites, int waiters)
+{
+    PyObject *type, *value, *traceback;
+    PyObject *callback;
+    PyObject *tstate_dict;
+    PyObject *stack = NULL;
+    PyObject *r = NULL;
+
+    callback = watchdog_callback;
+    if (callback == NULL)
+        return;
+
+    tstate_dict = PyThreadState_GetDict();
+    if (tstate_dict == NULL)
+        return;
+
+    if (PyDict_GetItemString(tstate_dict, "_cthreading.watchdog"))
+        return;
+
+    PyErr_Fetch(&type, &value, &traceback);
+
+    Py_INCREF(callback);
+
+    if (PyDict_SetItemString(tstate_dict, "_cthreading.watchdog",
+                             Py_True) != 0)
+        goto out;
+
+    if (sites)
+        stack = watch_format_stack(sites);
+    else
+        stack = PyList_New(0);
+
+    if (stack == NULL)
+        goto out;
+
+    r = PyObject_CallFunction(callback, "sOdlOi", kind, obj, duration,
+                              holder, stack, waiters);
+
+out:
+    if (PyErr_Occurred())
+        PyErr_WriteUnraisable(callback);
+
+    if (PyDict_DelItemString(tstate_dict, "_cthreading.watchdog") != 0)
+        PyErr_Clear();
+
+    Py_CLEAR(r);
+    Py_CLEAR(stack);
+    Py_CLEAR(callback);
+
+    PyErr_Restore(type, value, traceback);
+}
+
+/* Record acquiring the lock by the current thread. */
+static void
+watch_acquired(struct watch *watch)
+{
+    PyFrameObject *frame;
+
+    if (watchdog_threshold == 0)
+        return;
+
+    watch_clear_stack(watch);
+
+    for (frame = PyEval_GetFrame(); frame != NULL; frame = frame->f_back) {
+        struct watch_site *site;
+
+        if (watch->depth == watch->allocated) {
+            int allocated = watch->allocated ? watch->allocated * 2 : 16;
+            struct watch_site *stack = watch->stack;
+
+            /* Keep the stack recorded so far if we are out of memory. */
+            PyMem_Resize(stack, struct watch_site, allocated);
+            if (stack == NULL)
+                break;
+
+            watch->stack = stack;
+            watch->allocated = allocated;
+        }
+
+        site = &watch->stack[watch->depth++];
+        Py_INCREF(frame->f_code);
+        site->code = frame->f_code;
+        site->lineno = PyFrame_GetLineNumber(frame);
+    }
+
+    watch->holder = PyThread_get_thread_ident();
+    watch->acquired = monotonic_time();
+}
+
+/* Record releasing the lock, reporting if it was held too long. Must be
+ * called after the lock was released. */
+static void
+watch_released(PyObject *obj, struct watch *watch)
+{
+    PyObject *sites = NULL;
+    double held;
+
+    if (watch->acquired == 0)
+        return;
+
+    held = monotonic_time() - watch->acquired;
+
+    /* The callback may release the GIL, letting other threads acquire the
+     * lock, so take the state before reporting. */
+    if (watchdog_threshold > 0 && held >= watchdog_threshold) {
+        sites = watch_extract(watch);
+        if (sites == NULL)
+            PyErr_WriteUnraisable(obj);
+    }
+
+    watch_clear_stack(watch);
+    watch->acquired = 0;
+
+    if (watchdog_threshold > 0 && held >= watchdog_threshold)
+        watchdog_report("hold", obj, held, watch->holder, sites,
+                        watch->waiters);
+
+    Py_XDECREF(sites);
+}
+
+/* Block on sem until deadline, or forever if deadline is NULL, releasing the
+ * GIL while blocked. Returns the result of sem_timedwait() or sem_wait(). */
+static int
+sem_wait_released(sem_t *sem, const struct timespec *deadline)
+{
+    int err;
+
+    Py_BEGIN_ALLOW_THREADS;
+
+    do {
+        if (deadline)
+            err = sem_timedwait(sem, deadline);
+        else
+            err = sem_wait(sem);
+    } while (err != 0 && errno == EINTR);
+
+    Py_END_ALLOW_THREADS;
+
+    return err;
+}
+
+/* Block on sem until deadline, or forever if timeout is negative, reporting
+ * every threshold seconds while waiting. Returns like sem_wait_released(). */
+static int
+watchdog_wait(PyObject *obj, sem_t *sem, struct watch *watch, double timeout,
+              const struct timespec *deadline)
+{
+    double start = monotonic_time();
+    struct timespec slice;
+    int last;
+    int err;
+
+    for (;;) {
+        PyObject *sites;
+
+        /* The watchdog may be disabled while we wait. */
+        if (watchdog_threshold == 0)
+            return sem_wait_released(sem, timeout > 0 ? deadline : NULL);
+
+        deadline_from_timeout(watchdog_threshold, &slice);
+        last = timeout > 0 && !timespec_before(&slice, deadline);
+
+        err = sem_wait_released(sem, last ? deadline : &slice);
+        if (err == 0 || errno != ETIMEDOUT || last)
+            return err;
+
+        sites = watch_extract(watch);
+        if (sites == NULL)
+            PyErr_WriteUnraisable(obj);
+
+        watchdog_report("wait", obj, monotonic_time() - start, watch->holder,
+                        sites, watch->waiters);
+        Py_XDECREF(sites);
+    }
+}
+
+/* Blocked threads
+ *
+ * Threads blocking on a primitive register an entry allocated on their stack,
+ * so blocked() can report what every thread is waiting for. The GIL protects
+ * the registry; entries are added before releasing the GIL and removed after
+ * taking it back. Only the slow path registers. */
+
+struct blocked {
+    struct blocked *next;
+    struct blocked *prev;
+    PyObject *obj;      /* Borrowed, kept alive by the blocked call */
+    const char *kind;   /* "acquire", "wait", "send", "recv", "read" or
+                           "write" */
+    long thread;
+    double start;       /* Seconds since the epoch */
+    double timeout;
+};
+
+static struct blocked *blocked_first;
+
+static void
+blocked_register(struct blocked *entry, PyObject *obj, const char *kind,
+                 double timeout)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    entry->obj = obj;
+    entry->kind = kind;
+    entry->thread = PyThread_get_thread_ident();
+    entry->start = tv.tv_sec + tv.tv_usec / 1e6;
+    entry->timeout = timeout;
+
+    entry->prev = NULL;
+    entry->next = blocked_first;
+
+    if (blocked_first)
+        blocked_first->prev = entry;
+
+    blocked_first = entry;
+}
+
+static void
+blocked_unregister(struct blocked *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        blocked_first = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+}
+
 typedef enum {
     ACQUIRE_OK,         /* Lock is acquired by calling thread */
     ACQUIRE_FAIL,       /* Lock is acquired by another thread */
     ACQUIRE_ERROR,      /* Invalid arguments or lower level error */
 } acquire_result;
 
+/* Acquire semaphore sem, blocking up to timeout seconds.
+ *
+ * obj is the object owning the semaphore, reported to the acquire
+ * tracepoints, and watch is its watchdog state. Internal waiter semaphores
+ * pass NULL for both; they are traced by the condition probes instead. */
 static acquire_result
-acquire_lock(sem_t *sem, double timeout)
+acquire_lock(PyObject *obj, sem_t *sem, struct watch *watch, double timeout)
 {
     int err;
     struct timespec deadline;
+    struct blocked entry;
 
     if (timeout > 0)
         deadline_from_timeout(timeout, &deadline);
@@ -156,42 +644,70 @@ acquire_lock(sem_t *sem, double timeout)
         err = sem_trywait(sem);
     } while (err != 0 && errno == EINTR);
 
-    if (err == 0)
+    if (err == 0) {
+        if (obj)
+            TRACE5(acquire__done, obj, PyThread_get_thread_ident(),
+                   TRACE_TIMEOUT(timeout), 0, 1);
         return ACQUIRE_OK;
+    }
 
     if (errno != EAGAIN) {
         set_error(errno, "sem_trywait");
         return ACQUIRE_ERROR;
     }
 
-    if (timeout == 0)
+    if (timeout == 0) {
+        if (obj)
+            TRACE5(acquire__done, obj, PyThread_get_thread_ident(),
+                   TRACE_TIMEOUT(timeout), 1, 0);
         return ACQUIRE_FAIL;
+    }
 
-    Py_BEGIN_ALLOW_THREADS;
+    if (obj)
+        TRACE3(acquire__start, obj, PyThread_get_thread_ident(),
+               TRACE_TIMEOUT(timeout));
 
-    do {
-        if (timeout > 0)
-            err = sem_timedwait(sem, &deadline);
-        else
-            err = sem_wait(sem);
-    } while (err != 0 && errno == EINTR);
+    if (watch)
+        watch->waiters++;
 
-    Py_END_ALLOW_THREADS;
+    if (obj)
+        blocked_register(&entry, obj, "acquire", timeout);
+
+    if (watch && watchdog_threshold > 0)
+        err = watchdog_wait(obj, sem, watch, timeout, &deadline);
+    else
+        err = sem_wait_released(sem, timeout > 0 ? &deadline : NULL);
+
+    if (obj)
+        blocked_unregister(&entry);
+
+    if (watch)
+        watch->waiters--;
 
     if (err != 0) {
-        if (timeout > 0 && errno == ETIMEDOUT)
+        if (timeout > 0 && errno == ETIMEDOUT) {
+            if (obj)
+                TRACE5(acquire__done, obj, PyThread_get_thread_ident(),
+                       TRACE_TIMEOUT(timeout), 1, 0);
             return ACQUIRE_FAIL;
+        }
 
         /* Should never happen */
         set_error(errno, timeout > 0 ? "sem_timedwait" : "sem_wait");
         return ACQUIRE_ERROR;
     }
 
+    if (obj)
+        TRACE5(acquire__done, obj, PyThread_get_thread_ident(),
+               TRACE_TIMEOUT(timeout), 1, 1);
+
     return ACQUIRE_OK;
 }
 
+/* Release semaphore sem. obj is reported to the release tracepoint, or NULL
+ * for internal waiter semaphores. */
 static int
-release_lock(sem_t *sem)
+release_lock(PyObject *obj, sem_t *sem)
 {
     int err;
 
@@ -203,156 +719,5861 @@ release_lock(sem_t *sem)
         return -1;
     }
 
+    if (obj)
+        TRACE2(release, obj, PyThread_get_thread_ident());
+
     return 0;
 }
 
-/* Lock object */
+/* Block on waiter semaphore sem up to timeout seconds on behalf of obj,
+ * registered in blocked() as kind while blocking. */
+static acquire_result
+park_blocked(PyObject *obj, const char *kind, sem_t *sem, double timeout)
+{
+    struct blocked entry;
+    acquire_result res;
 
-typedef struct {
-    PyObject_HEAD
-    sem_t sem;
-    long owner;
-    PyObject *weakrefs;
-} lockobj;
+    blocked_register(&entry, obj, kind, timeout);
+    res = acquire_lock(NULL, sem, NULL, timeout);
+    blocked_unregister(&entry);
 
-PyDoc_STRVAR(lock_doc,
-"Lock()");
+    return res;
+}
 
-static PyObject *
-lock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    lockobj *self;
-    int err;
+/* waitq */
 
-    self = (lockobj *)type->tp_alloc(type, 0);
-    if (self == NULL)
-        return NULL;
+#define WAITER_UNUSED ((struct waiter *) -1)
 
-    /* First initialize all fields so lock_dealloc does the right thing if
-     * initializing the semaphore fails. */
-    self->owner = 0;
-    self->weakrefs = NULL;
+struct waiter {
+    sem_t sem;
+    struct waiter *next;
+    struct waiter *prev;
+};
 
-    err = sem_init(&self->sem, 0, 1);
-    if (err) {
-        int saved_errno = errno;
-        Py_CLEAR(self);
-        set_error(saved_errno, "sem_init");
-        return NULL;
+static int
+waiter_init(struct waiter *waiter)
+{
+    waiter->next = waiter->prev = WAITER_UNUSED;
+
+    /* Initialize in blocked state */
+    if (sem_init(&waiter->sem, 0, 0) != 0) {
+        set_error(errno, "sem_init");
+        return -1;
     }
 
-    return (PyObject *)self;
+    return 0;
 }
 
 static void
-lock_dealloc(lockobj *self)
+waiter_destroy(struct waiter *waiter)
 {
-    if (self->weakrefs)
-        PyObject_ClearWeakRefs((PyObject *) self);
-
-    /* This must not be called when other threads are waiting on the semaphore
-     * in sem_wait(). We rely on the reference counting machanisim to call this
-     * only when no object has a reference to the lockobj object. */
-    sem_destroy(&self->sem);
-
-    PyObject_Del(self);
+    assert(waiter->next == WAITER_UNUSED && waiter->prev == WAITER_UNUSED);
+    sem_destroy(&waiter->sem);
 }
 
-static PyObject *
-lock_acquire(lockobj *self, PyObject *args, PyObject *kwds)
-{
-    double timeout;
+struct waitq {
+    struct waiter *first;
+    struct waiter *last;
+    int count;
+};
+
+static void
+waitq_init(struct waitq *waitq)
+{
+    waitq->first = waitq->last = NULL;
+    waitq->count = 0;
+}
+
+static void
+waitq_append(struct waitq *waitq, struct waiter *waiter)
+{
+    assert(waiter->next == WAITER_UNUSED && waiter->prev == WAITER_UNUSED);
+
+    waiter->next = NULL;
+    waiter->prev = waitq->last;
+
+    if (waitq->last)
+        waitq->last->next = waiter;
+    else
+        waitq->first = waiter;
+
+    waitq->last = waiter;
+
+    waitq->count++;
+}
+
+static void
+waitq_remove(struct waitq *waitq, struct waiter *waiter)
+{
+    if (waiter->next == WAITER_UNUSED)
+        return;
+
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        waitq->first = waiter->next;
+
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    else
+        waitq->last = waiter->prev;
+
+    waiter->prev = waiter->next = WAITER_UNUSED;
+
+    waitq->count--;
+    assert(waitq->count >= 0);
+}
+
+/* Wake up to count waiters from waitq, oldest first. Returns the number of
+ * woken waiters, or -1 on errors. */
+static int
+waitq_wake(struct waitq *waitq, int count)
+{
+    int i;
+
+    for (i = 0; i < count && waitq->first != NULL; i++) {
+        struct waiter *waiter = waitq->first;
+        if (release_lock(NULL, &waiter->sem) != 0)
+            return -1;
+        waitq_remove(waitq, waiter);
+    }
+
+    return i;
+}
+
+/* Like waitq_wake, but wake the most recently added waiters first. */
+static int
+waitq_wake_last(struct waitq *waitq, int count)
+{
+    int i;
+
+    for (i = 0; i < count && waitq->last != NULL; i++) {
+        struct waiter *waiter = waitq->last;
+        if (release_lock(NULL, &waiter->sem) != 0)
+            return -1;
+        waitq_remove(waitq, waiter);
+    }
+
+    return i;
+}
+
+/* CancelToken object
+ *
+ * A thread blocking with a token registers its waiter with the token, and
+ * cancel() wakes all registered waiters. The woken thread finds the node
+ * cancelled, unparks its waiter, and raises Cancelled. Operations completed
+ * before the thread noticed the cancellation are not undone. */
+
+#define CANCEL_UNUSED ((struct cancel_node *) -1)
+
+struct cancel_node {
+    struct cancel_node *next;
+    struct cancel_node *prev;
+    struct waiter *waiter;
+    int cancelled;
+};
+
+typedef struct {
+    PyObject_HEAD
+    int cancelled;
+    struct cancel_node *first;
+    struct cancel_node *last;
+    PyObject *weakrefs;
+} tokenobj;
+
+static PyObject *Cancelled;
+static PyTypeObject CancelTokenType;
+
+PyDoc_STRVAR(token_doc,
+"CancelToken()\n\
+\n\
+Pass the token to blocking calls; cancel() wakes all threads blocked with\n\
+the token, raising Cancelled in each of them. Calls using a cancelled token\n\
+raise Cancelled without blocking.");
+
+static PyObject *
+token_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    tokenobj *self;
+
+    if (!_PyArg_NoKeywords("CancelToken()", kwds))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, ":CancelToken"))
+        return NULL;
+
+    self = (tokenobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->cancelled = 0;
+    self->first = self->last = NULL;
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+token_dealloc(tokenobj *self)
+{
+    /* Blocked threads keep a reference to the token. */
+    assert(self->first == NULL && self->last == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    PyObject_Del(self);
+}
+
+/* Convert token argument to tokenobj, or NULL for None. */
+static int
+parse_token(PyObject *obj, tokenobj **token)
+{
+    if (obj == Py_None) {
+        *token = NULL;
+        return 0;
+    }
+
+    if (!PyObject_TypeCheck(obj, &CancelTokenType)) {
+        PyErr_Format(PyExc_TypeError, "expected CancelToken, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+
+    *token = (tokenobj *)obj;
+    return 0;
+}
+
+/* Raise Cancelled if token was cancelled. token may be NULL. */
+static int
+token_check(tokenobj *token)
+{
+    if (token && token->cancelled) {
+        PyErr_SetString(Cancelled, "operation cancelled");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Register waiter, so cancel() wakes it. token may be NULL. */
+static void
+token_register(tokenobj *token, struct cancel_node *node,
+               struct waiter *waiter)
+{
+    node->waiter = waiter;
+    node->cancelled = 0;
+    node->next = node->prev = CANCEL_UNUSED;
+
+    if (token == NULL)
+        return;
+
+    node->next = NULL;
+    node->prev = token->last;
+
+    if (token->last)
+        token->last->next = node;
+    else
+        token->first = node;
+
+    token->last = node;
+}
+
+/* Unregister node; does nothing if cancel() already removed it. */
+static void
+token_unregister(tokenobj *token, struct cancel_node *node)
+{
+    if (node->next == CANCEL_UNUSED)
+        return;
+
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        token->first = node->next;
+
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        token->last = node->prev;
+
+    node->prev = node->next = CANCEL_UNUSED;
+}
+
+static PyObject *
+token_cancel(tokenobj *self)
+{
+    self->cancelled = 1;
+
+    while (self->first) {
+        struct cancel_node *node = self->first;
+        if (release_lock(NULL, &node->waiter->sem) != 0)
+            return NULL;
+        node->cancelled = 1;
+        token_unregister(self, node);
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(token_cancel_doc,
+"cancel()\n\
+\n\
+Cancel the token, waking all threads blocked with it.");
+
+static PyObject *
+token_get_cancelled(tokenobj *self, void *closure)
+{
+    return PyBool_FromLong(self->cancelled);
+}
+
+static PyMethodDef token_methods[] = {
+    {"cancel", (PyCFunction)token_cancel, METH_NOARGS, token_cancel_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef token_getset[] = {
+    {"cancelled", (getter)token_get_cancelled, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject CancelTokenType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.CancelToken",  /* tp_name */
+    sizeof(tokenobj),           /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)token_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    token_doc,                  /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(tokenobj, weakrefs),   /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    token_methods,              /* tp_methods */
+    0,                          /* tp_members */
+    token_getset,               /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    token_new,                  /* tp_new */
+};
+
+/* Cancellable lock acquire
+ *
+ * A thread blocked in sem_wait() on a lock semaphore cannot be woken without
+ * releasing the lock. Threads acquiring a lock with a token block instead on
+ * their own waiter, parked in the lock token waiters queue, and retry when
+ * woken. Releasing the lock wakes one of them. */
+
+static acquire_result
+try_acquire(sem_t *sem)
+{
+    int err;
+
+    do {
+        err = sem_trywait(sem);
+    } while (err != 0 && errno == EINTR);
+
+    if (err == 0)
+        return ACQUIRE_OK;
+
+    if (errno != EAGAIN) {
+        set_error(errno, "sem_trywait");
+        return ACQUIRE_ERROR;
+    }
+
+    return ACQUIRE_FAIL;
+}
+
+/* Park waiter up to timeout seconds while acquiring obj, reporting to the
+ * watchdog like acquire_lock(). Returns 0 when woken or timed out, -1 on
+ * errors. */
+static int
+park_waiter(PyObject *obj, struct waiter *waiter, struct watch *watch,
+            double timeout)
+{
+    struct timespec deadline;
+    int err;
+
+    if (timeout > 0)
+        deadline_from_timeout(timeout, &deadline);
+
+    if (watch && watchdog_threshold > 0)
+        err = watchdog_wait(obj, &waiter->sem, watch, timeout, &deadline);
+    else
+        err = sem_wait_released(&waiter->sem, timeout > 0 ? &deadline : NULL);
+
+    if (err != 0 && !(timeout > 0 && errno == ETIMEDOUT)) {
+        set_error(errno, timeout > 0 ? "sem_timedwait" : "sem_wait");
+        return -1;
+    }
+
+    return 0;
+}
+
+static acquire_result
+acquire_lock_cancellable(PyObject *obj, sem_t *sem, struct waitq *waiters,
+                         struct watch *watch, double timeout, tokenobj *token)
+{
+    struct waiter waiter;
+    struct cancel_node node;
+    struct blocked entry;
+    double deadline = 0;
+    double remaining = timeout;
     acquire_result res;
+    int woken = 0;
+    int contended = 0;
+
+    if (timeout > 0)
+        deadline = monotonic_time() + timeout;
+
+    if (waiter_init(&waiter) != 0)
+        return ACQUIRE_ERROR;
+
+    for (;;) {
+        if (token_check(token) != 0) {
+            res = ACQUIRE_ERROR;
+            break;
+        }
+
+        res = try_acquire(sem);
+        if (res != ACQUIRE_FAIL)
+            break;
+
+        if (timeout > 0) {
+            remaining = deadline - monotonic_time();
+            if (remaining <= 0)
+                break;
+        } else if (timeout == 0) {
+            break;
+        }
+
+        waitq_append(waiters, &waiter);
+        token_register(token, &node, &waiter);
+
+        /* The lock may have been released before we were parked. Releasing
+         * threads posting without the GIL check the queue after posting, so
+         * one of us must see the other. */
+        res = try_acquire(sem);
+
+        if (res == ACQUIRE_FAIL) {
+            if (watch)
+                watch->waiters++;
+
+            if (!contended) {
+                TRACE3(acquire__start, obj, PyThread_get_thread_ident(),
+                       TRACE_TIMEOUT(timeout));
+                contended = 1;
+            }
+
+            blocked_register(&entry, obj, "acquire", timeout);
+
+            /* Woken by a release, by cancel(), or timed out; retry. */
+            if (park_waiter(obj, &waiter, watch, remaining) != 0)
+                res = ACQUIRE_ERROR;
+
+            blocked_unregister(&entry);
+
+            if (watch)
+                watch->waiters--;
+        }
+
+        /* Waiters woken by a release were removed by the releasing thread. */
+        woken = waiter.next == WAITER_UNUSED;
+
+        waitq_remove(waiters, &waiter);
+        token_unregister(token, &node);
+
+        if (res != ACQUIRE_FAIL)
+            break;
+    }
+
+    /* Pass a wakeup we could not use to the next waiter. */
+    if (res != ACQUIRE_OK && woken) {
+        if (waitq_wake(waiters, 1) < 0 && res != ACQUIRE_ERROR)
+            res = ACQUIRE_ERROR;
+    }
+
+    waiter_destroy(&waiter);
+
+    if (res != ACQUIRE_ERROR)
+        TRACE5(acquire__done, obj, PyThread_get_thread_ident(),
+               TRACE_TIMEOUT(timeout), contended || timeout == 0,
+               res == ACQUIRE_OK);
+
+    return res;
+}
+
+/* Wake a thread blocked with a token after releasing a lock. */
+static int
+wake_token_waiter(struct waitq *waiters)
+{
+    if (waiters->first == NULL)
+        return 0;
+
+    return waitq_wake(waiters, 1) < 0 ? -1 : 0;
+}
+
+/* Lock object */
+
+typedef struct {
+    PyObject_HEAD
+    sem_t sem;
+    long owner;
+    struct watch watch;
+    struct waitq token_waiters;     /* Threads acquiring with a token */
+    PyObject *weakrefs;
+} lockobj;
+
+PyDoc_STRVAR(lock_doc,
+"Lock()");
+
+static PyObject *
+lock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    lockobj *self;
+    int err;
+
+    self = (lockobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    /* First initialize all fields so lock_dealloc does the right thing if
+     * initializing the semaphore fails. */
+    self->owner = 0;
+    watch_init(&self->watch);
+    waitq_init(&self->token_waiters);
+    self->weakrefs = NULL;
+
+    err = sem_init(&self->sem, 0, 1);
+    if (err) {
+        int saved_errno = errno;
+        Py_CLEAR(self);
+        set_error(saved_errno, "sem_init");
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+lock_dealloc(lockobj *self)
+{
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    /* This must not be called when other threads are waiting on the semaphore
+     * in sem_wait(). We rely on the reference counting machanisim to call this
+     * only when no object has a reference to the lockobj object. */
+    sem_destroy(&self->sem);
+
+    watch_free(&self->watch);
+
+    PyObject_Del(self);
+}
+
+static acquire_result
+lock_acquire_internal(lockobj *self, double timeout, tokenobj *token)
+{
+    acquire_result res;
+
+    if (token)
+        res = acquire_lock_cancellable((PyObject *)self, &self->sem,
+                                       &self->token_waiters, &self->watch,
+                                       timeout, token);
+    else
+        res = acquire_lock((PyObject *)self, &self->sem, &self->watch,
+                           timeout);
+
+    if (res == ACQUIRE_OK) {
+        self->owner = PyThread_get_thread_ident();
+        watch_acquired(&self->watch);
+    }
+
+    return res;
+}
+
+static int
+lock_release_internal(lockobj *self)
+{
+    long owner = self->owner;
+
+    /* Sanity check: the lock must be locked */
+    if (owner == 0) {
+        PyErr_SetString(ThreadError, "release unlocked lock");
+        return -1;
+    }
+
+    /* Clear the owner before releasing, since C API users may acquire the
+     * lock without the GIL. */
+    self->owner = 0;
+
+    if (release_lock((PyObject *)self, &self->sem) != 0) {
+        self->owner = owner;
+        return -1;
+    }
+
+    watch_released((PyObject *)self, &self->watch);
+
+    return wake_token_waiter(&self->token_waiters);
+}
+
+static PyObject *
+lock_acquire(lockobj *self, PyObject *args, PyObject *kwds)
+{
+    double timeout;
+    PyObject *obj;
+    tokenobj *token;
+    acquire_result res;
+
+    if (acquire_parse_args(args, kwds, &timeout, &obj))
+        return NULL;
+
+    if (parse_token(obj, &token) != 0)
+        return NULL;
+
+    res = lock_acquire_internal(self, timeout, token);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyObject *
+lock_release(lockobj *self, PyObject *args)
+{
+    if (lock_release_internal(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+lock_locked(lockobj *self)
+{
+    return PyBool_FromLong(self->owner);
+}
+
+static PyObject *
+lock_is_owned(lockobj *self)
+{
+    long tid = PyThread_get_thread_ident();
+    return PyBool_FromLong(self->owner == tid);
+}
+
+static PyObject *
+lock_acquire_restore(lockobj *self, PyObject *args)
+{
+    PyObject *ignored;
+    acquire_result res;
+
+    /* Require one argument to keep the same interface as rlockobj. */
+    if (!PyArg_ParseTuple(args, "O:_acquire_restore", &ignored))
+        return NULL;
+
+    /* May block forever but cannot fail unless the underlying sem_wait call
+     * fails (unlikely). */
+    res = acquire_lock((PyObject *)self, &self->sem, &self->watch, -1);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    assert(res == ACQUIRE_OK);
+    assert(self->owner == 0);
+
+    self->owner = PyThread_get_thread_ident();
+    watch_acquired(&self->watch);
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef lock_methods[] = {
+    {"acquire", (PyCFunction)lock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"__enter__", (PyCFunction)lock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"release", (PyCFunction)lock_release, METH_VARARGS, NULL},
+    {"__exit__", (PyCFunction)lock_release, METH_VARARGS, NULL},
+    {"locked", (PyCFunction)lock_locked, METH_NOARGS, NULL},
+    {"_is_owned", (PyCFunction)lock_is_owned, METH_NOARGS, NULL},
+    {"_release_save", (PyCFunction)lock_release, METH_VARARGS, NULL},
+    {"_acquire_restore", (PyCFunction)lock_acquire_restore, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+lock_get_waiters(lockobj *self, void *closure)
+{
+    return PyInt_FromLong(self->watch.waiters);
+}
+
+static PyGetSetDef lock_getset[] = {
+    {"waiters", (getter)lock_get_waiters, NULL,
+     "Number of threads blocked acquiring the lock", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject LockType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.Lock",         /* tp_name */
+    sizeof(lockobj),            /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)lock_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    lock_doc,                   /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(lockobj, weakrefs),   /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    lock_methods,               /* tp_methods */
+    0,                          /* tp_members */
+    lock_getset,                /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    lock_new,                   /* tp_new */
+};
+
+/* RLock object */
+
+typedef struct {
+    PyObject_HEAD
+    sem_t sem;
+    long owner;
+    unsigned long count;
+    int biased;
+    long reserved;      /* Thread the unlocked lock is reserved for, or 0 */
+    struct watch watch;
+    struct waitq token_waiters;     /* Threads acquiring with a token */
+    PyObject *weakrefs;
+} rlockobj;
+
+/* Biased mode
+ *
+ * When a biased lock is released by its last owner and no thread is waiting,
+ * the semaphore is kept held and the lock is reserved for the owner.
+ * Acquiring a reserved lock takes over the semaphore using plain stores, so
+ * the common case of one thread taking the same lock over and over does not
+ * touch the semaphore at all.
+ *
+ * Another thread acquiring a reserved lock revokes the reservation and takes
+ * over the semaphore in the same way. The GIL orders the reservation with the
+ * revoking thread, so no handshake with the reserving thread is needed. A
+ * thread that must block finds the lock owned, so the owner sees the waiter
+ * when releasing and posts the semaphore instead of reserving it. */
+
+PyDoc_STRVAR(rlock_doc,
+"RLock(biased=False)\n\
+\n\
+If biased is True, the lock stays reserved for its last owner after it is\n\
+released, making acquiring it again by the same thread cheaper.");
+
+static PyObject *
+rlock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    rlockobj *self;
+    int biased = 0;
+    int err;
+    static char *kwlist[] = {"biased", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:RLock", kwlist, &biased))
+        return NULL;
+
+    self = (rlockobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    /* First initialize all fields so rlock_dealloc does the right thing if
+     * initializing the semaphore fails. */
+    self->owner = 0;
+    self->count = 0;
+    self->biased = biased != 0;
+    self->reserved = 0;
+    watch_init(&self->watch);
+    waitq_init(&self->token_waiters);
+    self->weakrefs = NULL;
+
+    err = sem_init(&self->sem, 0, 1);
+    if (err) {
+        int saved_errno = errno;
+        Py_CLEAR(self);
+        set_error(saved_errno, "sem_init");
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+rlock_dealloc(rlockobj *self)
+{
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    /* This must not be called when other threads are waiting on the semaphore
+     * in sem_wait(). We rely on the reference counting machanisim to call this
+     * only when no object has a reference to the lockobj object. */
+    sem_destroy(&self->sem);
+
+    watch_free(&self->watch);
+
+    PyObject_Del(self);
+}
+
+static acquire_result
+rlock_acquire_internal(rlockobj *self, double timeout, tokenobj *token)
+{
+    long tid;
+    acquire_result res;
+
+    tid = PyThread_get_thread_ident();
+    if (self->count > 0 && self->owner == tid) {
+        unsigned long count = self->count + 1;
+        if (count <= self->count) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "Internal lock count overflowed");
+            return ACQUIRE_ERROR;
+        }
+
+        self->count = count;
+        return ACQUIRE_OK;
+    }
+
+    if (self->reserved) {
+        /* Take over the semaphore held by the reservation. */
+        self->reserved = 0;
+        res = ACQUIRE_OK;
+        TRACE5(acquire__done, (PyObject *)self, tid, TRACE_TIMEOUT(timeout),
+               0, 1);
+    } else if (token) {
+        res = acquire_lock_cancellable((PyObject *)self, &self->sem,
+                                       &self->token_waiters, &self->watch,
+                                       timeout, token);
+    } else {
+        res = acquire_lock((PyObject *)self, &self->sem, &self->watch,
+                           timeout);
+    }
+
+    if (res == ACQUIRE_OK) {
+        assert(self->count == 0);
+        self->owner = tid;
+        self->count = 1;
+        watch_acquired(&self->watch);
+    }
+
+    return res;
+}
+
+static int
+rlock_release_internal(rlockobj *self)
+{
+    long tid = PyThread_get_thread_ident();
+
+    if (self->count == 0 || self->owner != tid) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot release un-acquired lock");
+        return -1;
+    }
+
+    if (self->count > 1) {
+        --self->count;
+        return 0;
+    }
+
+    assert(self->count == 1);
+
+    /* Clear the owner before releasing, since C API users may acquire the
+     * lock without the GIL. */
+    self->count = 0;
+    self->owner = 0;
+
+    if (self->biased && self->watch.waiters == 0 &&
+            self->token_waiters.first == NULL) {
+        self->reserved = tid;
+        TRACE2(release, (PyObject *)self, tid);
+        watch_released((PyObject *)self, &self->watch);
+        return 0;
+    }
+
+    if (release_lock((PyObject *)self, &self->sem) != 0) {
+        self->count = 1;
+        self->owner = tid;
+        return -1;
+    }
+
+    watch_released((PyObject *)self, &self->watch);
+
+    return wake_token_waiter(&self->token_waiters);
+}
+
+static PyObject *
+rlock_acquire(rlockobj *self, PyObject *args, PyObject *kwds)
+{
+    double timeout;
+    PyObject *obj;
+    tokenobj *token;
+    acquire_result res;
+
+    if (acquire_parse_args(args, kwds, &timeout, &obj))
+        return NULL;
+
+    if (parse_token(obj, &token) != 0)
+        return NULL;
+
+    res = rlock_acquire_internal(self, timeout, token);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyObject *
+rlock_release(rlockobj *self, PyObject *args)
+{
+    if (rlock_release_internal(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+rlock_is_owned(rlockobj *self)
+{
+    long tid = PyThread_get_thread_ident();
+    return PyBool_FromLong(self->count > 0 && self->owner == tid);
+}
+
+static PyObject *
+rlock_release_save(rlockobj *self)
+{
+    PyObject *saved_state;
+    unsigned long count;
+    long owner;
+
+    if (self->count == 0) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot release un-acquired lock");
+        return NULL;
+    }
+
+    saved_state = Py_BuildValue("kl", self->count, self->owner);
+    if (saved_state == NULL)
+        return NULL;
+
+    count = self->count;
+    owner = self->owner;
+
+    /* Clear the owner before releasing, since C API users may acquire the
+     * lock without the GIL. */
+    self->count = 0;
+    self->owner = 0;
+
+    if (release_lock((PyObject *)self, &self->sem) != 0) {
+        self->count = count;
+        self->owner = owner;
+        Py_CLEAR(saved_state);
+        return NULL;
+    }
+
+    watch_released((PyObject *)self, &self->watch);
+
+    if (wake_token_waiter(&self->token_waiters) != 0) {
+        Py_CLEAR(saved_state);
+        return NULL;
+    }
+
+    return saved_state;
+}
+
+static PyObject *
+rlock_acquire_restore(rlockobj *self, PyObject *args)
+{
+    unsigned long count;
+    long owner;
+    acquire_result res;
+
+    if (!PyArg_ParseTuple(args, "(kl):_acquire_restore", &count, &owner))
+        return NULL;
+
+    if (self->reserved) {
+        /* Take over the semaphore held by the reservation. */
+        self->reserved = 0;
+        TRACE5(acquire__done, (PyObject *)self, PyThread_get_thread_ident(),
+               TRACE_TIMEOUT(UNLIMITED), 0, 1);
+    } else {
+        /* May block forever but cannot fail unless the underlying sem_wait
+         * call fails (unlikely). */
+        res = acquire_lock((PyObject *)self, &self->sem, &self->watch, -1);
+        if (res == ACQUIRE_ERROR)
+            return NULL;
+
+        assert(res == ACQUIRE_OK);
+    }
+
+    assert(self->owner == 0);
+    assert(self->count == 0);
+
+    self->owner = owner;
+    self->count = count;
+    watch_acquired(&self->watch);
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef rlock_methods[] = {
+    {"acquire", (PyCFunction)rlock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"__enter__", (PyCFunction)rlock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"release", (PyCFunction)rlock_release, METH_VARARGS, NULL},
+    {"__exit__", (PyCFunction)rlock_release, METH_VARARGS, NULL},
+    {"_is_owned", (PyCFunction)rlock_is_owned, METH_NOARGS, NULL},
+    {"_release_save", (PyCFunction)rlock_release_save, METH_NOARGS, NULL},
+    {"_acquire_restore", (PyCFunction)rlock_acquire_restore, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+rlock_get_waiters(rlockobj *self, void *closure)
+{
+    return PyInt_FromLong(self->watch.waiters);
+}
+
+static PyObject *
+rlock_get_biased(rlockobj *self, void *closure)
+{
+    return PyBool_FromLong(self->biased);
+}
+
+static PyGetSetDef rlock_getset[] = {
+    {"waiters", (getter)rlock_get_waiters, NULL,
+     "Number of threads blocked acquiring the lock", NULL},
+    {"biased", (getter)rlock_get_biased, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject RLockType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.RLock",        /* tp_name */
+    sizeof(rlockobj),           /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)rlock_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    rlock_doc,                  /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(rlockobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    rlock_methods,              /* tp_methods */
+    0,                          /* tp_members */
+    rlock_getset,               /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    rlock_new,                  /* tp_new */
+};
+
+/* Condition object */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *lock;
+    PyObject *acquire;
+    PyObject *release;
+    PyObject *is_owned;
+    PyObject *release_save;
+    PyObject *acquire_restore;
+    struct waitq waiters;
+    PyObject *keyed;    /* Maps key to waitq of keyed waiters */
+    int lifo;           /* Wake the most recent waiter first */
+    PyObject *weakrefs;
+} condobj;
+
+PyDoc_STRVAR(cond_doc,
+"Condition(lock=None, policy='fifo')\n\
+\n\
+With policy='fifo', notify() wakes the oldest waiter. With policy='lifo',\n\
+notify() wakes the most recent waiter, keeping recently active threads busy\n\
+and letting the rest stay idle.");
+
+/* Keyed waiters
+ *
+ * Threads waiting for different things on the same condition can wait with a
+ * key, and notify only the threads waiting for the same key. Each key has its
+ * own waitq, allocated when the first thread waits for the key and freed when
+ * the last waiter is removed. The waitq address is kept in the keyed dict. */
+
+static struct waitq *
+cond_keyed_lookup(condobj *self, PyObject *key)
+{
+    PyObject *value;
+
+    /* PyDict_GetItem hides errors; report unhashable keys. */
+    if (PyObject_Hash(key) == -1)
+        return NULL;
+
+    if (self->keyed == NULL)
+        return NULL;
+
+    value = PyDict_GetItem(self->keyed, key);
+    if (value == NULL)
+        return NULL;
+
+    return PyLong_AsVoidPtr(value);
+}
+
+static struct waitq *
+cond_keyed_get(condobj *self, PyObject *key)
+{
+    struct waitq *waitq;
+    PyObject *value;
+    int err;
+
+    waitq = cond_keyed_lookup(self, key);
+    if (waitq || PyErr_Occurred())
+        return waitq;
+
+    if (self->keyed == NULL) {
+        self->keyed = PyDict_New();
+        if (self->keyed == NULL)
+            return NULL;
+    }
+
+    waitq = PyMem_New(struct waitq, 1);
+    if (waitq == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    waitq_init(waitq);
+
+    value = PyLong_FromVoidPtr(waitq);
+    if (value == NULL) {
+        PyMem_Free(waitq);
+        return NULL;
+    }
+
+    err = PyDict_SetItem(self->keyed, key, value);
+    Py_CLEAR(value);
+    if (err != 0) {
+        PyMem_Free(waitq);
+        return NULL;
+    }
+
+    return waitq;
+}
+
+/* Remove the empty waitq of key. */
+static void
+cond_keyed_drop(condobj *self, PyObject *key, struct waitq *waitq)
+{
+    assert(waitq->count == 0);
+
+    if (PyDict_DelItem(self->keyed, key) != 0)
+        PyErr_Clear();
+
+    PyMem_Free(waitq);
+}
+
+/* Free all keyed waitqs. Called on init, since a child process may inherit
+ * waiters of other threads from the parent, and on dealloc. */
+static void
+cond_clear_keyed(condobj *self)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+
+    if (self->keyed == NULL)
+        return;
+
+    while (PyDict_Next(self->keyed, &pos, &key, &value))
+        PyMem_Free(PyLong_AsVoidPtr(value));
+
+    Py_CLEAR(self->keyed);
+}
+
+static int
+cond_init(condobj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *lock = Py_None;
+    PyObject *acquire = NULL;
+    PyObject *release = NULL;
+    PyObject *is_owned = NULL;
+    PyObject *release_save = NULL;
+    PyObject *acquire_restore = NULL;
+    PyObject *tmp = NULL;
+    const char *policy = "fifo";
+    int lifo;
+    static char *kwlist[] = {"lock", "policy", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Os", kwlist, &lock,
+                                     &policy))
+        return -1;
+
+    if (strcmp(policy, "fifo") == 0) {
+        lifo = 0;
+    } else if (strcmp(policy, "lifo") == 0) {
+        lifo = 1;
+    } else {
+        PyErr_Format(PyExc_ValueError, "invalid policy: '%.200s'", policy);
+        return -1;
+    }
+
+    if (lock == Py_None) {
+        lock = PyObject_CallObject((PyObject *)&RLockType, NULL);
+        if (lock == NULL)
+            return -1;
+    } else {
+        Py_INCREF(lock);
+    }
+
+    tmp = self->lock;
+    self->lock = lock;
+    Py_CLEAR(tmp);
+
+    acquire = PyObject_GetAttrString(self->lock, "acquire");
+    if (acquire == NULL)
+        return -1;
+
+    tmp = self->acquire;
+    self->acquire = acquire;
+    Py_CLEAR(tmp);
+
+    release = PyObject_GetAttrString(self->lock, "release");
+    if (release == NULL)
+        return -1;
+
+    tmp = self->release;
+    self->release = release;
+    Py_CLEAR(tmp);
+
+    is_owned = PyObject_GetAttrString(self->lock, "_is_owned");
+    if (is_owned == NULL)
+        return -1;
+
+    tmp = self->is_owned;
+    self->is_owned = is_owned;
+    Py_CLEAR(tmp);
+
+    release_save = PyObject_GetAttrString(self->lock, "_release_save");
+    if (release_save == NULL)
+        return -1;
+
+    tmp = self->release_save;
+    self->release_save = release_save;
+    Py_CLEAR(tmp);
+
+    acquire_restore = PyObject_GetAttrString(self->lock, "_acquire_restore");
+    if (acquire_restore == NULL)
+        return -1;
+
+    tmp = self->acquire_restore;
+    self->acquire_restore = acquire_restore;
+    Py_CLEAR(tmp);
+
+    waitq_init(&self->waiters);
+    cond_clear_keyed(self);
+    self->lifo = lifo;
+
+    return 0;
+}
+
+static void
+cond_dealloc(condobj *self)
+{
+    assert(self->waiters.first == NULL && self->waiters.last == NULL);
+
+    cond_clear_keyed(self);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    Py_CLEAR(self->lock);
+    Py_CLEAR(self->acquire);
+    Py_CLEAR(self->release);
+    Py_CLEAR(self->is_owned);
+    Py_CLEAR(self->release_save);
+    Py_CLEAR(self->acquire_restore);
+
+    PyObject_Del(self);
+}
+
+static PyObject *
+cond_release_save(condobj *self)
+{
+    return PyObject_CallObject(self->release_save, NULL);
+}
+
+static PyObject *
+cond_acquire_restore(condobj *self, PyObject *args)
+{
+    return PyObject_CallObject(self->acquire_restore, args);
+}
+
+static acquire_result
+cond_wait_released(condobj *self, struct waiter *waiter, double timeout)
+{
+    PyObject *saved_state = NULL;
+    PyObject *r = NULL;
+    struct blocked entry;
+    acquire_result res;
+
+    saved_state = PyObject_CallObject(self->release_save, NULL);
+    if (saved_state == NULL)
+        return ACQUIRE_ERROR;
+
+    /* Taking the lock back registers separately if it blocks. */
+    blocked_register(&entry, (PyObject *)self, "wait", timeout);
+
+    res = acquire_lock(NULL, &waiter->sem, NULL, timeout);
+
+    blocked_unregister(&entry);
+
+    r = PyObject_CallFunctionObjArgs(self->acquire_restore, saved_state, NULL);
+    if (r == NULL)
+        res = ACQUIRE_ERROR;
+
+    Py_CLEAR(saved_state);
+    Py_CLEAR(r);
+
+    return res;
+}
+
+static int
+cond_is_owned_internal(condobj *self)
+{
+    PyObject *r;
+    int is_owned;
+
+    r = PyObject_CallObject(self->is_owned, NULL);
+    is_owned = r == Py_True;
+    Py_CLEAR(r);
+
+    return is_owned;
+}
+
+/* Wake all keyed waiters and free the keyed waitqs. */
+static int
+cond_wake_keyed(condobj *self)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int woken = 0;
+
+    if (self->keyed == NULL)
+        return 0;
+
+    while (PyDict_Next(self->keyed, &pos, &key, &value)) {
+        struct waitq *waitq = PyLong_AsVoidPtr(value);
+        int n = waitq_wake(waitq, waitq->count);
+        if (n < 0)
+            return -1;
+        woken += n;
+    }
+
+    cond_clear_keyed(self);
+
+    return woken;
+}
+
+/* Wake up count waiters waiting for key, or unkeyed waiters if key is
+ * Py_None. */
+static PyObject *
+cond_notify_waiters(condobj *self, PyObject *key, int count)
+{
+    struct waitq *waitq = &self->waiters;
+    int woken;
+
+    if (!cond_is_owned_internal(self)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot notify un-acquired condition");
+        return NULL;
+    }
+
+    if (key != Py_None) {
+        waitq = cond_keyed_lookup(self, key);
+        if (waitq == NULL) {
+            if (PyErr_Occurred())
+                return NULL;
+            Py_RETURN_NONE;
+        }
+    }
+
+    if (self->lifo)
+        woken = waitq_wake_last(waitq, count);
+    else
+        woken = waitq_wake(waitq, count);
+    if (woken < 0)
+        return NULL;
+
+    if (key != Py_None && waitq->count == 0)
+        cond_keyed_drop(self, key, waitq);
+
+    TRACE4(notify, self, PyThread_get_thread_ident(), count, woken);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+cond_acquire(condobj *self, PyObject *args, PyObject *kwds)
+{
+    assert(args != NULL);
+    return PyObject_Call(self->acquire, args, kwds);
+}
+
+static PyObject *
+cond_release(condobj *self, PyObject *args)
+{
+    return PyObject_CallObject(self->release, args);
+}
+
+static int
+cond_wait_parse_args(PyObject *args, PyObject *kwds, double *timeout,
+                     PyObject **key, tokenobj **token)
+{
+    char *kwlist[] = {"timeout", "balancing", "key", "token", NULL};
+    PyObject *obj = Py_None;
+    PyObject *balancing = NULL; /* Unused */
+    PyObject *token_obj = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOO:wait", kwlist,
+                                     &obj, &balancing, key, &token_obj))
+        return -1;
+
+    if (parse_timeout(obj, timeout) != 0)
+        return -1;
+
+    return parse_token(token_obj, token);
+}
+
+/* Park waiter on the condition, in the waitq of key unless key is Py_None,
+ * and wait until notified, timeout expires, or token is cancelled. The waiter
+ * can be reused for another wait after this returns. */
+static acquire_result
+cond_wait_internal(condobj *self, struct waiter *waiter, PyObject *key,
+                   double timeout, tokenobj *token)
+{
+    struct waitq *waitq = &self->waiters;
+    struct cancel_node node;
+    acquire_result res;
+    int notified;
+
+    if (token_check(token) != 0)
+        return ACQUIRE_ERROR;
+
+    if (key != Py_None) {
+        waitq = cond_keyed_get(self, key);
+        if (waitq == NULL)
+            return ACQUIRE_ERROR;
+    }
+
+    waitq_append(waitq, waiter);
+    token_register(token, &node, waiter);
+
+    TRACE3(wait__start, self, PyThread_get_thread_ident(),
+           TRACE_TIMEOUT(timeout));
+
+    res = cond_wait_released(self, waiter, timeout);
+
+    token_unregister(token, &node);
+
+    /* Notified waiters are removed by the notifying thread, and the waitq of
+     * a key may be freed when its last waiter is notified. A waiter that was
+     * not notified is still linked, so its waitq is alive. */
+    notified = waiter->next == WAITER_UNUSED;
+    if (!notified) {
+        waitq_remove(waitq, waiter);
+        if (key != Py_None && waitq->count == 0)
+            cond_keyed_drop(self, key, waitq);
+    }
+
+    /* A notification received before the cancellation is not lost. */
+    if (node.cancelled && !notified && res != ACQUIRE_ERROR) {
+        PyErr_SetString(Cancelled, "operation cancelled");
+        res = ACQUIRE_ERROR;
+    }
+
+    TRACE4(wait__done, self, PyThread_get_thread_ident(),
+           TRACE_TIMEOUT(timeout), res == ACQUIRE_OK);
+
+    return res;
+}
+
+static acquire_result
+cond_wait_key(condobj *self, PyObject *key, double timeout, tokenobj *token)
+{
+    struct waiter waiter;
+    acquire_result res;
+
+    if (!cond_is_owned_internal(self)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot wait on un-acquired condition");
+        return ACQUIRE_ERROR;
+    }
+
+    if (waiter_init(&waiter) != 0)
+        return ACQUIRE_ERROR;
+
+    res = cond_wait_internal(self, &waiter, key, timeout, token);
+
+    waiter_destroy(&waiter);
+
+    return res;
+}
+
+static PyObject *
+cond_wait(condobj *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key = Py_None;
+    tokenobj *token;
+    double timeout;
+    acquire_result res;
+
+    if (cond_wait_parse_args(args, kwds, &timeout, &key, &token) != 0)
+        return NULL;
+
+    res = cond_wait_key(self, key, timeout, token);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+/* Wait until predicate() is true, timeout expires, or token is cancelled. The
+ * deadline is computed once, so spurious wakeups or notifications taken by
+ * other threads do not extend the wait. The predicate is called with the lock
+ * held. Returns the last value returned by predicate. */
+static PyObject *
+cond_wait_for(condobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"predicate", "timeout", "key", "token", NULL};
+    PyObject *predicate;
+    PyObject *obj = Py_None;
+    PyObject *key = Py_None;
+    PyObject *token_obj = Py_None;
+    PyObject *result;
+    struct waiter waiter;
+    tokenobj *token;
+    double timeout;
+    double deadline = 0;
+    acquire_result res;
+    int done;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO:wait_for", kwlist,
+                                     &predicate, &obj, &key, &token_obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    if (!cond_is_owned_internal(self)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot wait on un-acquired condition");
+        return NULL;
+    }
+
+    result = PyObject_CallObject(predicate, NULL);
+    if (result == NULL)
+        return NULL;
+
+    done = PyObject_IsTrue(result);
+    if (done != 0)
+        goto out;
+
+    if (timeout != UNLIMITED)
+        deadline = monotonic_time() + timeout;
+
+    if (waiter_init(&waiter) != 0) {
+        done = -1;
+        goto out;
+    }
+
+    while (done == 0) {
+        if (timeout != UNLIMITED) {
+            timeout = deadline - monotonic_time();
+            if (timeout <= 0)
+                break;
+        }
+
+        /* If a notification raced with a timeout, the waiter semaphore is
+         * left posted and the next wait returns immediately, rechecking the
+         * predicate. */
+        res = cond_wait_internal(self, &waiter, key, timeout, token);
+        if (res == ACQUIRE_ERROR) {
+            done = -1;
+            break;
+        }
+
+        Py_CLEAR(result);
+        result = PyObject_CallObject(predicate, NULL);
+        if (result == NULL) {
+            done = -1;
+            break;
+        }
+
+        done = PyObject_IsTrue(result);
+    }
+
+    waiter_destroy(&waiter);
+
+out:
+    if (done < 0)
+        Py_CLEAR(result);
+
+    return result;
+}
+
+static PyObject *
+cond_notify(condobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"n", "key", NULL};
+    int count = 1;
+    PyObject *key = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iO:notify", kwlist,
+                                     &count, &key))
+        return NULL;
+
+    return cond_notify_waiters(self, key, count);
+}
+
+/* Wake all waiters, keyed or not. */
+static PyObject *
+cond_notify_all_waiters(condobj *self)
+{
+    PyObject *r;
+
+    r = cond_notify_waiters(self, Py_None, self->waiters.count);
+    if (r == NULL)
+        return NULL;
+
+    if (cond_wake_keyed(self) < 0)
+        Py_CLEAR(r);
+
+    return r;
+}
+
+static PyObject *
+cond_notify_all(condobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", NULL};
+    PyObject *key = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:notify_all", kwlist,
+                                     &key))
+        return NULL;
+
+    if (key != Py_None)
+        return cond_notify_waiters(self, key, INT_MAX);
+
+    return cond_notify_all_waiters(self);
+}
+
+static PyObject *
+cond_is_owned(condobj *self)
+{
+    return PyObject_CallObject(self->is_owned, NULL);
+}
+
+static PyMethodDef cond_methods[] = {
+    {"acquire", (PyCFunction)cond_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"__enter__", (PyCFunction)cond_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"release", (PyCFunction)cond_release, METH_VARARGS, NULL},
+    {"__exit__", (PyCFunction)cond_release, METH_VARARGS, NULL},
+    {"wait", (PyCFunction)cond_wait, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"wait_for", (PyCFunction)cond_wait_for, METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"notify", (PyCFunction)cond_notify, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"notify_all", (PyCFunction)cond_notify_all, METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"notifyAll", (PyCFunction)cond_notify_all, METH_VARARGS | METH_KEYWORDS,
+     NULL},
+    {"_is_owned", (PyCFunction)cond_is_owned, METH_NOARGS, NULL},
+    {"_release_save", (PyCFunction)cond_release_save, METH_NOARGS, NULL},
+    {"_acquire_restore", (PyCFunction)cond_acquire_restore, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+cond_get_policy(condobj *self, void *closure)
+{
+    return PyString_FromString(self->lifo ? "lifo" : "fifo");
+}
+
+static PyObject *
+cond_get_waiters(condobj *self, void *closure)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long count = self->waiters.count;
+
+    if (self->keyed) {
+        while (PyDict_Next(self->keyed, &pos, &key, &value)) {
+            struct waitq *waitq = PyLong_AsVoidPtr(value);
+            count += waitq->count;
+        }
+    }
+
+    return PyInt_FromLong(count);
+}
+
+static PyGetSetDef cond_getset[] = {
+    {"policy", (getter)cond_get_policy, NULL, NULL, NULL},
+    {"waiters", (getter)cond_get_waiters, NULL,
+     "Number of threads waiting on the condition", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ConditionType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.Condition",    /* tp_name */
+    sizeof(condobj),            /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)cond_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    cond_doc,                   /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(condobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    cond_methods,               /* tp_methods */
+    0,                          /* tp_members */
+    cond_getset,                /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    (initproc)cond_init,        /* tp_init */
+    0,                          /* tp_alloc */
+    0,                          /* tp_new */
+};
+
+/* Channel object */
+
+#define CHANOP_UNUSED ((struct chanop *) -1)
+
+enum {
+    CHAN_RECV,
+    CHAN_SEND,
+};
+
+struct chanobj;
+struct select_waiter;
+
+/* A send or receive operation parked on a channel. recv() and send() park one
+ * operation; select() parks one operation per case, all sharing the same
+ * select_waiter. */
+struct chanop {
+    struct chanop *next;
+    struct chanop *prev;
+    struct chanobj *chan;
+    struct select_waiter *sw;
+    int op;
+    PyObject *value;    /* Borrowed value to send, or new reference received */
+    struct blocked entry;   /* Registered while the waiter is blocked */
+};
+
+/* The thread blocked on one or more operations. The first thread completing
+ * one of the operations unparks all of them and wakes the waiter. */
+struct select_waiter {
+    struct waiter waiter;   /* Used only for its semaphore */
+    struct chanop *ops;
+    int nops;
+    struct chanop *done;    /* Completed operation, NULL while parked */
+    int closed;             /* Operation completed by closing the channel */
+};
+
+struct chanq {
+    struct chanop *first;
+    struct chanop *last;
+    long count;
+};
+
+static void
+chanq_init(struct chanq *q)
+{
+    q->first = q->last = NULL;
+    q->count = 0;
+}
+
+static void
+chanq_append(struct chanq *q, struct chanop *op)
+{
+    assert(op->next == CHANOP_UNUSED && op->prev == CHANOP_UNUSED);
+
+    op->next = NULL;
+    op->prev = q->last;
+
+    if (q->last)
+        q->last->next = op;
+    else
+        q->first = op;
+
+    q->last = op;
+    q->count++;
+}
+
+static void
+chanq_remove(struct chanq *q, struct chanop *op)
+{
+    if (op->next == CHANOP_UNUSED)
+        return;
+
+    if (op->prev)
+        op->prev->next = op->next;
+    else
+        q->first = op->next;
+
+    if (op->next)
+        op->next->prev = op->prev;
+    else
+        q->last = op->prev;
+
+    op->prev = op->next = CHANOP_UNUSED;
+    q->count--;
+}
+
+typedef struct chanobj {
+    PyObject_HEAD
+    PyObject **buf;
+    Py_ssize_t capacity;
+    Py_ssize_t head;
+    Py_ssize_t len;
+    int closed;
+    struct chanq recvq;
+    struct chanq sendq;
+    PyObject *weakrefs;
+} chanobj;
+
+static PyObject *ChannelClosed;
+static PyObject *Timeout;
+
+static struct chanq *
+chanop_queue(struct chanop *op)
+{
+    return op->op == CHAN_RECV ? &op->chan->recvq : &op->chan->sendq;
+}
+
+/* Complete parked operation op, unpark the other operations of the same
+ * waiter, and wake the waiting thread. For receive operations, steals a
+ * reference to value. Must be called with the GIL held. */
+static int
+chanop_complete(struct chanop *op, PyObject *value, int closed)
+{
+    struct select_waiter *sw = op->sw;
+    int i;
+
+    for (i = 0; i < sw->nops; i++)
+        chanq_remove(chanop_queue(&sw->ops[i]), &sw->ops[i]);
+
+    if (op->op == CHAN_RECV)
+        op->value = value;
+
+    sw->done = op;
+    sw->closed = closed;
+
+    return release_lock(NULL, &sw->waiter.sem);
+}
+
+/* Try to send value without blocking. Returns 1 if value was sent, 0 if the
+ * caller must block, and -1 on errors. */
+static int
+chan_try_send(chanobj *self, PyObject *value)
+{
+    if (self->closed) {
+        PyErr_SetString(ChannelClosed, "send on closed channel");
+        return -1;
+    }
+
+    /* A parked receiver means the buffer is empty; hand the value directly to
+     * the receiver. */
+    if (self->recvq.first) {
+        Py_INCREF(value);
+        if (chanop_complete(self->recvq.first, value, 0) != 0)
+            return -1;
+        return 1;
+    }
+
+    if (self->len < self->capacity) {
+        Py_INCREF(value);
+        self->buf[(self->head + self->len) % self->capacity] = value;
+        self->len++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Try to receive a value without blocking. Returns 1 and a new reference in
+ * value if a value was received, 0 if the caller must block, and -1 on
+ * errors. */
+static int
+chan_try_recv(chanobj *self, PyObject **value)
+{
+    struct chanop *sender;
+
+    if (self->len > 0) {
+        *value = self->buf[self->head];
+        self->head = (self->head + 1) % self->capacity;
+        self->len--;
+
+        /* Move the value of the first parked sender into the buffer. */
+        sender = self->sendq.first;
+        if (sender) {
+            Py_INCREF(sender->value);
+            self->buf[(self->head + self->len) % self->capacity] =
+                sender->value;
+            self->len++;
+            if (chanop_complete(sender, NULL, 0) != 0)
+                return -1;
+        }
+
+        return 1;
+    }
+
+    /* Unbuffered channel, take the value directly from the sender. */
+    sender = self->sendq.first;
+    if (sender) {
+        Py_INCREF(sender->value);
+        *value = sender->value;
+        if (chanop_complete(sender, NULL, 0) != 0) {
+            Py_CLEAR(*value);
+            return -1;
+        }
+        return 1;
+    }
+
+    if (self->closed) {
+        PyErr_SetString(ChannelClosed, "receive on closed channel");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+chanop_try(struct chanop *op)
+{
+    if (op->op == CHAN_SEND)
+        return chan_try_send(op->chan, op->value);
+    else
+        return chan_try_recv(op->chan, &op->value);
+}
+
+/* Perform the first operation in ops that can complete, blocking up to
+ * timeout seconds. Returns the index of the completed operation, -1 on
+ * errors, or -2 if the timeout expired. For receive operations, the received
+ * value is returned as a new reference in the operation value. */
+static int
+chan_select(struct chanop *ops, int nops, double timeout, tokenobj *token)
+{
+    struct select_waiter sw;
+    struct cancel_node node;
+    acquire_result res;
+    int i;
+
+    if (token_check(token) != 0)
+        return -1;
+
+    for (i = 0; i < nops; i++) {
+        int r = chanop_try(&ops[i]);
+        if (r == 1)
+            return i;
+        if (r == -1)
+            return -1;
+    }
+
+    if (timeout == 0)
+        return -2;
+
+    if (waiter_init(&sw.waiter) != 0)
+        return -1;
+
+    sw.ops = ops;
+    sw.nops = nops;
+    sw.done = NULL;
+    sw.closed = 0;
+
+    for (i = 0; i < nops; i++) {
+        ops[i].next = ops[i].prev = CHANOP_UNUSED;
+        ops[i].sw = &sw;
+        chanq_append(chanop_queue(&ops[i]), &ops[i]);
+        blocked_register(&ops[i].entry, (PyObject *)ops[i].chan,
+                         ops[i].op == CHAN_SEND ? "send" : "recv", timeout);
+    }
+
+    token_register(token, &node, &sw.waiter);
+
+    res = acquire_lock(NULL, &sw.waiter.sem, NULL, timeout);
+
+    token_unregister(token, &node);
+
+    for (i = 0; i < nops; i++)
+        blocked_unregister(&ops[i].entry);
+
+    /* The operation may complete after the wait timed out or the token was
+     * cancelled, before we took the GIL back; the completion is already
+     * visible to the other thread. */
+    if (sw.done == NULL) {
+        for (i = 0; i < nops; i++)
+            chanq_remove(chanop_queue(&ops[i]), &ops[i]);
+    } else if (res == ACQUIRE_ERROR) {
+        PyErr_Clear();
+    }
+
+    waiter_destroy(&sw.waiter);
+
+    if (sw.done == NULL) {
+        if (node.cancelled && res != ACQUIRE_ERROR) {
+            PyErr_SetString(Cancelled, "operation cancelled");
+            return -1;
+        }
+        return res == ACQUIRE_ERROR ? -1 : -2;
+    }
+
+    if (sw.closed) {
+        PyErr_SetString(ChannelClosed, sw.done->op == CHAN_SEND ?
+                        "send on closed channel" :
+                        "receive on closed channel");
+        return -1;
+    }
+
+    return sw.done - ops;
+}
+
+static void
+chanop_init(struct chanop *op, chanobj *chan, int kind, PyObject *value)
+{
+    op->next = op->prev = CHANOP_UNUSED;
+    op->chan = chan;
+    op->sw = NULL;
+    op->op = kind;
+    op->value = value;
+}
+
+PyDoc_STRVAR(chan_doc,
+"Channel(capacity=0)");
+
+static PyObject *
+chan_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    chanobj *self;
+    Py_ssize_t capacity = 0;
+    static char *kwlist[] = {"capacity", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:Channel", kwlist,
+                                     &capacity))
+        return NULL;
+
+    if (capacity < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return NULL;
+    }
+
+    self = (chanobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->buf = NULL;
+    self->capacity = capacity;
+    self->head = 0;
+    self->len = 0;
+    self->closed = 0;
+    chanq_init(&self->recvq);
+    chanq_init(&self->sendq);
+    self->weakrefs = NULL;
+
+    if (capacity > 0) {
+        self->buf = PyMem_New(PyObject *, capacity);
+        if (self->buf == NULL) {
+            Py_CLEAR(self);
+            return PyErr_NoMemory();
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+chan_dealloc(chanobj *self)
+{
+    /* Parked threads keep a reference to the channel. */
+    assert(self->recvq.first == NULL && self->sendq.first == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    while (self->len > 0) {
+        Py_CLEAR(self->buf[self->head]);
+        self->head = (self->head + 1) % self->capacity;
+        self->len--;
+    }
+
+    PyMem_Free(self->buf);
+
+    PyObject_Del(self);
+}
+
+static int
+chan_timeout_parse_args(PyObject *args, PyObject *kwds, const char *format,
+                        char **kwlist, PyObject **value, double *timeout,
+                        tokenobj **token)
+{
+    PyObject *obj = Py_None;
+    PyObject *token_obj = Py_None;
+
+    if (value) {
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, format, kwlist,
+                                         value, &obj, &token_obj))
+            return -1;
+    } else {
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, format, kwlist, &obj,
+                                         &token_obj))
+            return -1;
+    }
+
+    if (parse_timeout(obj, timeout) != 0)
+        return -1;
+
+    return parse_token(token_obj, token);
+}
+
+static PyObject *
+chan_send(chanobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"value", "timeout", "token", NULL};
+    PyObject *value;
+    tokenobj *token;
+    double timeout;
+    struct chanop op;
+    int r;
+
+    if (chan_timeout_parse_args(args, kwds, "O|OO:send", kwlist, &value,
+                                &timeout, &token) != 0)
+        return NULL;
+
+    chanop_init(&op, self, CHAN_SEND, value);
+
+    r = chan_select(&op, 1, timeout, token);
+    if (r == -1)
+        return NULL;
+
+    if (r == -2) {
+        PyErr_SetString(Timeout, "timeout sending to channel");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+chan_recv_internal(chanobj *self, double timeout, tokenobj *token)
+{
+    struct chanop op;
+    int r;
+
+    chanop_init(&op, self, CHAN_RECV, NULL);
+
+    r = chan_select(&op, 1, timeout, token);
+    if (r == -1)
+        return NULL;
+
+    if (r == -2) {
+        PyErr_SetString(Timeout, "timeout receiving from channel");
+        return NULL;
+    }
+
+    return op.value;
+}
+
+static PyObject *
+chan_recv(chanobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", "token", NULL};
+    tokenobj *token;
+    double timeout;
+
+    if (chan_timeout_parse_args(args, kwds, "|OO:recv", kwlist, NULL,
+                                &timeout, &token) != 0)
+        return NULL;
+
+    return chan_recv_internal(self, timeout, token);
+}
+
+static PyObject *
+chan_close(chanobj *self)
+{
+    if (self->closed)
+        Py_RETURN_NONE;
+
+    self->closed = 1;
+
+    /* Parked receivers mean an empty buffer, so they will never get a value.
+     * Parked senders mean a full buffer; their values are not sent. */
+    while (self->recvq.first) {
+        if (chanop_complete(self->recvq.first, NULL, 1) != 0)
+            return NULL;
+    }
+
+    while (self->sendq.first) {
+        if (chanop_complete(self->sendq.first, NULL, 1) != 0)
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+chan_iternext(chanobj *self)
+{
+    PyObject *value;
+
+    value = chan_recv_internal(self, UNLIMITED, NULL);
+    if (value == NULL && PyErr_ExceptionMatches(ChannelClosed))
+        PyErr_Clear();
+
+    return value;
+}
+
+static PyMethodDef chan_methods[] = {
+    {"send", (PyCFunction)chan_send, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"recv", (PyCFunction)chan_recv, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"close", (PyCFunction)chan_close, METH_NOARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+chan_get_waiters(chanobj *self, void *closure)
+{
+    return PyInt_FromLong(self->recvq.count + self->sendq.count);
+}
+
+static PyGetSetDef chan_getset[] = {
+    {"waiters", (getter)chan_get_waiters, NULL,
+     "Number of threads blocked sending to or receiving from the channel",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ChannelType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.Channel",      /* tp_name */
+    sizeof(chanobj),            /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)chan_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    chan_doc,                   /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(chanobj, weakrefs),  /* tp_weaklistoffset */
+    PyObject_SelfIter,          /* tp_iter */
+    (iternextfunc)chan_iternext,  /* tp_iternext */
+    chan_methods,               /* tp_methods */
+    0,                          /* tp_members */
+    chan_getset,                /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    chan_new,                   /* tp_new */
+};
+
+/* Parse select case (chan, "recv") or (chan, "send", value). */
+static int
+select_parse_case(PyObject *item, struct chanop *op)
+{
+    PyObject *chan;
+    const char *kind;
+    PyObject *value = NULL;
+
+    if (!PyTuple_Check(item)) {
+        PyErr_SetString(PyExc_TypeError, "select case must be a tuple");
+        return -1;
+    }
+
+    if (!PyArg_ParseTuple(item, "O!s|O:select", &ChannelType, &chan, &kind,
+                          &value))
+        return -1;
+
+    if (strcmp(kind, "recv") == 0 && value == NULL) {
+        chanop_init(op, (chanobj *)chan, CHAN_RECV, NULL);
+    } else if (strcmp(kind, "send") == 0 && value != NULL) {
+        chanop_init(op, (chanobj *)chan, CHAN_SEND, value);
+    } else {
+        PyErr_SetString(PyExc_ValueError,
+                        "select case must be (chan, 'recv') or "
+                        "(chan, 'send', value)");
+        return -1;
+    }
+
+    return 0;
+}
+
+PyDoc_STRVAR(select_doc,
+"select(cases, timeout=None, token=None) -> (index, value) or None\n\
+\n\
+Block until one of cases can proceed, and perform it. Cases are\n\
+(chan, 'recv') or (chan, 'send', value) tuples. Returns the index of the\n\
+completed case and the received value (None for send), or None if the\n\
+timeout expired.");
+
+static PyObject *
+module_select(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"cases", "timeout", "token", NULL};
+    PyObject *cases;
+    PyObject *seq = NULL;
+    PyObject *obj = Py_None;
+    PyObject *token_obj = Py_None;
+    PyObject *result = NULL;
+    struct chanop *ops = NULL;
+    tokenobj *token;
+    Py_ssize_t nops;
+    Py_ssize_t i;
+    double timeout;
+    int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:select", kwlist,
+                                     &cases, &obj, &token_obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    /* Keeps the cases, and so the channels and values, alive while we are
+     * parked. */
+    seq = PySequence_Fast(cases, "cases must be a sequence");
+    if (seq == NULL)
+        return NULL;
+
+    nops = PySequence_Fast_GET_SIZE(seq);
+    if (nops == 0 || nops > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "invalid number of cases");
+        goto out;
+    }
+
+    ops = PyMem_New(struct chanop, nops);
+    if (ops == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (i = 0; i < nops; i++) {
+        if (select_parse_case(PySequence_Fast_GET_ITEM(seq, i), &ops[i]) != 0)
+            goto out;
+    }
+
+    r = chan_select(ops, (int)nops, timeout, token);
+    if (r == -1)
+        goto out;
+
+    if (r == -2) {
+        Py_INCREF(Py_None);
+        result = Py_None;
+        goto out;
+    }
+
+    if (ops[r].op == CHAN_RECV)
+        result = Py_BuildValue("(iN)", r, ops[r].value);
+    else
+        result = Py_BuildValue("(iO)", r, Py_None);
+
+out:
+    PyMem_Free(ops);
+    Py_CLEAR(seq);
+
+    return result;
+}
+
+/* WaitGroup object */
+
+typedef struct {
+    PyObject_HEAD
+    long count;
+    struct waitq waiters;
+    PyObject *weakrefs;
+} waitgroupobj;
+
+PyDoc_STRVAR(waitgroup_doc,
+"WaitGroup()\n\
+\n\
+Wait for a collection of operations to finish. Call add(n) before starting\n\
+operations, done() when an operation has finished, and wait() to block\n\
+until all operations have finished.");
+
+static PyObject *
+waitgroup_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    waitgroupobj *self;
+
+    if (!_PyArg_NoKeywords("WaitGroup()", kwds))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, ":WaitGroup"))
+        return NULL;
+
+    self = (waitgroupobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->count = 0;
+    waitq_init(&self->waiters);
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+waitgroup_dealloc(waitgroupobj *self)
+{
+    /* Waiting threads keep a reference to the wait group. */
+    assert(self->waiters.first == NULL && self->waiters.last == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    PyObject_Del(self);
+}
+
+/* Add delta to the counter, waking all waiters if the counter drops to zero.
+ * The GIL serializes all access to the counter and the waiters, so done() is
+ * a single decrement, and the waiters are touched only when the counter
+ * drops to zero. */
+static PyObject *
+waitgroup_add_internal(waitgroupobj *self, long delta)
+{
+    long count;
+
+    if (__builtin_add_overflow(self->count, delta, &count)) {
+        PyErr_SetString(PyExc_OverflowError, "WaitGroup counter overflowed");
+        return NULL;
+    }
+
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative WaitGroup counter");
+        return NULL;
+    }
+
+    self->count = count;
+
+    if (count == 0 && self->waiters.first != NULL) {
+        if (waitq_wake(&self->waiters, self->waiters.count) < 0)
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+waitgroup_add(waitgroupobj *self, PyObject *args)
+{
+    long delta = 1;
+
+    if (!PyArg_ParseTuple(args, "|l:add", &delta))
+        return NULL;
+
+    return waitgroup_add_internal(self, delta);
+}
+
+static PyObject *
+waitgroup_done(waitgroupobj *self)
+{
+    return waitgroup_add_internal(self, -1);
+}
+
+static PyObject *
+waitgroup_wait(waitgroupobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", "token", NULL};
+    PyObject *obj = Py_None;
+    PyObject *token_obj = Py_None;
+    struct waiter waiter;
+    struct cancel_node node;
+    tokenobj *token;
+    double timeout;
+    acquire_result res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:wait", kwlist, &obj,
+                                     &token_obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    if (self->count == 0)
+        Py_RETURN_TRUE;
+
+    if (token_check(token) != 0)
+        return NULL;
+
+    if (timeout == 0)
+        Py_RETURN_FALSE;
+
+    if (waiter_init(&waiter) != 0)
+        return NULL;
+
+    waitq_append(&self->waiters, &waiter);
+    token_register(token, &node, &waiter);
+
+    res = park_blocked((PyObject *)self, "wait", &waiter.sem, timeout);
+
+    token_unregister(token, &node);
+    waitq_remove(&self->waiters, &waiter);
+
+    waiter_destroy(&waiter);
+
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    if (node.cancelled && self->count != 0) {
+        PyErr_SetString(Cancelled, "operation cancelled");
+        return NULL;
+    }
+
+    /* The counter may drop to zero after the wait timed out, before we took
+     * the GIL back. */
+    return PyBool_FromLong(res == ACQUIRE_OK || self->count == 0);
+}
+
+static PyObject *
+waitgroup_get_count(waitgroupobj *self, void *closure)
+{
+    return PyInt_FromLong(self->count);
+}
+
+static PyMethodDef waitgroup_methods[] = {
+    {"add", (PyCFunction)waitgroup_add, METH_VARARGS, NULL},
+    {"done", (PyCFunction)waitgroup_done, METH_NOARGS, NULL},
+    {"wait", (PyCFunction)waitgroup_wait, METH_VARARGS | METH_KEYWORDS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+waitgroup_get_waiters(waitgroupobj *self, void *closure)
+{
+    return PyInt_FromLong(self->waiters.count);
+}
+
+static PyGetSetDef waitgroup_getset[] = {
+    {"count", (getter)waitgroup_get_count, NULL, NULL, NULL},
+    {"waiters", (getter)waitgroup_get_waiters, NULL,
+     "Number of threads waiting for the counter to reach zero", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject WaitGroupType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.WaitGroup",    /* tp_name */
+    sizeof(waitgroupobj),       /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)waitgroup_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    waitgroup_doc,              /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(waitgroupobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    waitgroup_methods,          /* tp_methods */
+    0,                          /* tp_members */
+    waitgroup_getset,           /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    waitgroup_new,              /* tp_new */
+};
+
+/* RateLimiter object */
+
+typedef struct {
+    PyObject_HEAD
+    double rate;        /* Tokens per second */
+    double burst;       /* Maximum number of tokens */
+    double tokens;      /* Available tokens at updated */
+    double updated;     /* Monotonic time of last refill */
+    struct waitq waiters;
+    PyObject *weakrefs;
+} ratelimiterobj;
+
+PyDoc_STRVAR(ratelimiter_doc,
+"RateLimiter(rate, burst)\n\
+\n\
+Token bucket rate limiter, refilled with rate tokens per second, up to\n\
+burst tokens. Threads blocked in acquire() are served in FIFO order.");
+
+static PyObject *
+ratelimiter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ratelimiterobj *self;
+    double rate;
+    double burst;
+    static char *kwlist[] = {"rate", "burst", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "dd:RateLimiter", kwlist,
+                                     &rate, &burst))
+        return NULL;
+
+    if (rate <= 0 || burst <= 0) {
+        PyErr_SetString(PyExc_ValueError, "rate and burst must be positive");
+        return NULL;
+    }
+
+    self = (ratelimiterobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->rate = rate;
+    self->burst = burst;
+    self->tokens = burst;
+    self->updated = monotonic_time();
+    waitq_init(&self->waiters);
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+ratelimiter_dealloc(ratelimiterobj *self)
+{
+    /* Waiting threads keep a reference to the rate limiter. */
+    assert(self->waiters.first == NULL && self->waiters.last == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    PyObject_Del(self);
+}
+
+/* Add the tokens accumulated since the last refill. Returns the current
+ * monotonic time. */
+static double
+ratelimiter_refill(ratelimiterobj *self)
+{
+    double now = monotonic_time();
+
+    self->tokens += (now - self->updated) * self->rate;
+    if (self->tokens > self->burst)
+        self->tokens = self->burst;
+
+    self->updated = now;
+
+    return now;
+}
+
+/* Remove waiter from the queue. If it was first, wake the next waiter, which
+ * is now responsible for waiting for its tokens. */
+static int
+ratelimiter_remove(ratelimiterobj *self, struct waiter *waiter)
+{
+    int first = self->waiters.first == waiter;
+
+    waitq_remove(&self->waiters, waiter);
+
+    if (first && self->waiters.first)
+        return release_lock(NULL, &self->waiters.first->sem);
+
+    return 0;
+}
+
+/* Take tokens, blocking up to timeout seconds. Only the first waiter sleeps
+ * until enough tokens are available; the others sleep until they become
+ * first. Returns ACQUIRE_OK, ACQUIRE_FAIL if the tokens cannot be taken
+ * before the timeout expires, or ACQUIRE_ERROR. */
+static acquire_result
+ratelimiter_take(ratelimiterobj *self, double tokens, double timeout)
+{
+    struct waiter waiter;
+    acquire_result res = ACQUIRE_FAIL;
+    double deadline = 0;
+    double now;
+
+    now = ratelimiter_refill(self);
+
+    if (self->waiters.first == NULL && self->tokens >= tokens) {
+        self->tokens -= tokens;
+        return ACQUIRE_OK;
+    }
+
+    if (timeout == 0)
+        return ACQUIRE_FAIL;
+
+    if (timeout != UNLIMITED)
+        deadline = now + timeout;
+
+    if (waiter_init(&waiter) != 0)
+        return ACQUIRE_ERROR;
+
+    waitq_append(&self->waiters, &waiter);
+
+    for (;;) {
+        double wait = UNLIMITED;
+
+        if (self->waiters.first == &waiter) {
+            if (self->tokens >= tokens) {
+                self->tokens -= tokens;
+                res = ACQUIRE_OK;
+                break;
+            }
+
+            /* Sleep exactly until our tokens are available. If this is past
+             * the deadline, fail now instead of sleeping in vain. */
+            wait = (tokens - self->tokens) / self->rate;
+            if (timeout != UNLIMITED && now + wait > deadline)
+                break;
+        } else if (timeout != UNLIMITED) {
+            wait = deadline - now;
+            if (wait <= 0)
+                break;
+        }
+
+        if (park_blocked((PyObject *)self, "acquire", &waiter.sem, wait) ==
+                ACQUIRE_ERROR) {
+            res = ACQUIRE_ERROR;
+            break;
+        }
+
+        now = ratelimiter_refill(self);
+    }
+
+    if (ratelimiter_remove(self, &waiter) != 0)
+        res = ACQUIRE_ERROR;
+
+    waiter_destroy(&waiter);
+
+    return res;
+}
+
+static int
+ratelimiter_parse_tokens(ratelimiterobj *self, double tokens)
+{
+    if (tokens <= 0) {
+        PyErr_SetString(PyExc_ValueError, "tokens must be positive");
+        return -1;
+    }
+
+    if (tokens > self->burst) {
+        PyErr_SetString(PyExc_ValueError, "tokens must not exceed burst");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+ratelimiter_acquire(ratelimiterobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"tokens", "timeout", NULL};
+    double tokens = 1;
+    PyObject *obj = Py_None;
+    double timeout;
+    acquire_result res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dO:acquire", kwlist,
+                                     &tokens, &obj))
+        return NULL;
+
+    if (ratelimiter_parse_tokens(self, tokens) != 0)
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    res = ratelimiter_take(self, tokens, timeout);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyObject *
+ratelimiter_try_acquire(ratelimiterobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"tokens", NULL};
+    double tokens = 1;
+    acquire_result res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|d:try_acquire", kwlist,
+                                     &tokens))
+        return NULL;
+
+    if (ratelimiter_parse_tokens(self, tokens) != 0)
+        return NULL;
+
+    res = ratelimiter_take(self, tokens, 0);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyMethodDef ratelimiter_methods[] = {
+    {"acquire", (PyCFunction)ratelimiter_acquire,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"try_acquire", (PyCFunction)ratelimiter_try_acquire,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef ratelimiter_members[] = {
+    {"rate", T_DOUBLE, offsetof(ratelimiterobj, rate), READONLY, NULL},
+    {"burst", T_DOUBLE, offsetof(ratelimiterobj, burst), READONLY, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+ratelimiter_get_waiters(ratelimiterobj *self, void *closure)
+{
+    return PyInt_FromLong(self->waiters.count);
+}
+
+static PyGetSetDef ratelimiter_getset[] = {
+    {"waiters", (getter)ratelimiter_get_waiters, NULL,
+     "Number of threads blocked taking tokens", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject RateLimiterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.RateLimiter",  /* tp_name */
+    sizeof(ratelimiterobj),     /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)ratelimiter_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    ratelimiter_doc,            /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(ratelimiterobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    ratelimiter_methods,        /* tp_methods */
+    ratelimiter_members,        /* tp_members */
+    ratelimiter_getset,         /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    ratelimiter_new,            /* tp_new */
+};
+
+/* LockTable object */
+
+/* Stripes are aligned to the cache line size, so threads using different
+ * stripes do not share cache lines. */
+#define CACHE_LINE_SIZE 64
+
+/* A compact reentrant lock. Reentrancy is required since multiple keys may
+ * map to the same stripe. */
+struct stripe {
+    sem_t sem;
+    long owner;
+    unsigned long count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct {
+    PyObject_HEAD
+    struct stripe *stripes;
+    Py_ssize_t size;
+    PyObject *weakrefs;
+} locktableobj;
+
+PyDoc_STRVAR(locktable_doc,
+"LockTable(stripes)\n\
+\n\
+Per-key reentrant locking using a fixed number of locks. Keys are mapped\n\
+to locks by their hash, so memory usage does not depend on the number of\n\
+keys. Keys mapped to the same lock contend with each other.");
+
+static PyObject *
+locktable_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    locktableobj *self;
+    Py_ssize_t size;
+    Py_ssize_t i;
+    void *mem;
+    static char *kwlist[] = {"stripes", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n:LockTable", kwlist,
+                                     &size))
+        return NULL;
+
+    if (size <= 0 || size > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(struct stripe)) {
+        PyErr_SetString(PyExc_ValueError, "invalid number of stripes");
+        return NULL;
+    }
+
+    self = (locktableobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    /* First initialize all fields so locktable_dealloc does the right thing
+     * if allocating or initializing the stripes fails. */
+    self->stripes = NULL;
+    self->size = 0;
+    self->weakrefs = NULL;
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                       size * sizeof(struct stripe)) != 0) {
+        Py_CLEAR(self);
+        return PyErr_NoMemory();
+    }
+
+    self->stripes = mem;
+
+    for (i = 0; i < size; i++) {
+        struct stripe *stripe = &self->stripes[i];
+
+        stripe->owner = 0;
+        stripe->count = 0;
+
+        if (sem_init(&stripe->sem, 0, 1) != 0) {
+            int saved_errno = errno;
+            Py_CLEAR(self);
+            set_error(saved_errno, "sem_init");
+            return NULL;
+        }
+
+        self->size++;
+    }
+
+    return (PyObject *)self;
+}
+
+static void
+locktable_dealloc(locktableobj *self)
+{
+    Py_ssize_t i;
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    for (i = 0; i < self->size; i++)
+        sem_destroy(&self->stripes[i].sem);
+
+    free(self->stripes);
+
+    PyObject_Del(self);
+}
+
+/* Return the index of the stripe of key, or -1 if key is not hashable. */
+static Py_ssize_t
+locktable_index(locktableobj *self, PyObject *key)
+{
+    long hash;
+
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return -1;
+
+    return (unsigned long)hash % (size_t)self->size;
+}
+
+static acquire_result
+locktable_acquire_stripe(locktableobj *self, Py_ssize_t index, double timeout)
+{
+    struct stripe *stripe = &self->stripes[index];
+    long tid = PyThread_get_thread_ident();
+    acquire_result res;
+
+    if (stripe->count > 0 && stripe->owner == tid) {
+        if (stripe->count + 1 == 0) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "Internal lock count overflowed");
+            return ACQUIRE_ERROR;
+        }
+
+        stripe->count++;
+        return ACQUIRE_OK;
+    }
+
+    res = acquire_lock((PyObject *)self, &stripe->sem, NULL, timeout);
+
+    if (res == ACQUIRE_OK) {
+        assert(stripe->count == 0);
+        stripe->owner = tid;
+        stripe->count = 1;
+    }
+
+    return res;
+}
+
+static int
+locktable_release_stripe(locktableobj *self, Py_ssize_t index)
+{
+    struct stripe *stripe = &self->stripes[index];
+    long tid = PyThread_get_thread_ident();
+
+    if (stripe->count == 0 || stripe->owner != tid) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot release un-acquired lock");
+        return -1;
+    }
+
+    if (stripe->count > 1) {
+        stripe->count--;
+        return 0;
+    }
+
+    stripe->count = 0;
+    stripe->owner = 0;
+
+    if (release_lock((PyObject *)self, &stripe->sem) != 0) {
+        stripe->count = 1;
+        stripe->owner = tid;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+compare_index(const void *a, const void *b)
+{
+    Py_ssize_t x = *(const Py_ssize_t *)a;
+    Py_ssize_t y = *(const Py_ssize_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Map keys to a sorted array of unique stripe indices. Returns the number of
+ * indices in the new array, or -1 on errors. The caller must free the array
+ * with PyMem_Free. */
+static Py_ssize_t
+locktable_indices(locktableobj *self, PyObject *keys, Py_ssize_t **indices)
+{
+    PyObject *seq;
+    Py_ssize_t *array = NULL;
+    Py_ssize_t len;
+    Py_ssize_t n = 0;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(keys, "keys must be iterable");
+    if (seq == NULL)
+        return -1;
+
+    len = PySequence_Fast_GET_SIZE(seq);
+
+    /* Allocate at least one item, PyMem_New(0) may return NULL. */
+    array = PyMem_New(Py_ssize_t, len > 0 ? len : 1);
+    if (array == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < len; i++) {
+        Py_ssize_t index;
+
+        index = locktable_index(self, PySequence_Fast_GET_ITEM(seq, i));
+        if (index == -1)
+            goto error;
+
+        array[i] = index;
+    }
+
+    qsort(array, len, sizeof(*array), compare_index);
+
+    for (i = 0; i < len; i++) {
+        if (n == 0 || array[n - 1] != array[i])
+            array[n++] = array[i];
+    }
+
+    Py_CLEAR(seq);
+    *indices = array;
+
+    return n;
+
+error:
+    PyMem_Free(array);
+    Py_CLEAR(seq);
+
+    return -1;
+}
+
+static void
+locktable_release_indices(locktableobj *self, Py_ssize_t *indices,
+                          Py_ssize_t n)
+{
+    while (n-- > 0) {
+        /* Cannot fail, since we own these stripes. */
+        if (locktable_release_stripe(self, indices[n]) != 0)
+            PyErr_Clear();
+    }
+}
+
+/* Acquire the stripes of all keys in ascending order, so threads acquiring
+ * multiple keys cannot deadlock. Holds one deadline for all stripes. */
+static acquire_result
+locktable_acquire_keys(locktableobj *self, PyObject *keys, double timeout)
+{
+    Py_ssize_t *indices;
+    Py_ssize_t n;
+    Py_ssize_t i;
+    double deadline = 0;
+    acquire_result res = ACQUIRE_OK;
+
+    n = locktable_indices(self, keys, &indices);
+    if (n == -1)
+        return ACQUIRE_ERROR;
+
+    if (timeout > 0)
+        deadline = monotonic_time() + timeout;
+
+    for (i = 0; i < n; i++) {
+        double remaining = timeout;
+
+        if (timeout > 0) {
+            remaining = deadline - monotonic_time();
+            if (remaining <= 0) {
+                res = ACQUIRE_FAIL;
+                break;
+            }
+        }
+
+        res = locktable_acquire_stripe(self, indices[i], remaining);
+        if (res != ACQUIRE_OK)
+            break;
+    }
+
+    /* Do not keep some of the keys locked on failures. */
+    if (res != ACQUIRE_OK)
+        locktable_release_indices(self, indices, i);
+
+    PyMem_Free(indices);
+
+    return res;
+}
+
+static int
+locktable_release_keys(locktableobj *self, PyObject *keys)
+{
+    Py_ssize_t *indices;
+    Py_ssize_t n;
+    Py_ssize_t i;
+
+    n = locktable_indices(self, keys, &indices);
+    if (n == -1)
+        return -1;
+
+    /* Check first, so we do not release some of the keys and fail. */
+    for (i = 0; i < n; i++) {
+        struct stripe *stripe = &self->stripes[indices[i]];
+        if (stripe->count == 0 ||
+                stripe->owner != PyThread_get_thread_ident()) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "cannot release un-acquired lock");
+            PyMem_Free(indices);
+            return -1;
+        }
+    }
+
+    locktable_release_indices(self, indices, n);
+
+    PyMem_Free(indices);
+
+    return 0;
+}
+
+static PyObject *
+locktable_acquire(locktableobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "timeout", NULL};
+    PyObject *key;
+    PyObject *obj = Py_None;
+    Py_ssize_t index;
+    double timeout;
+    acquire_result res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:acquire", kwlist,
+                                     &key, &obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    index = locktable_index(self, key);
+    if (index == -1)
+        return NULL;
+
+    res = locktable_acquire_stripe(self, index, timeout);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyObject *
+locktable_release(locktableobj *self, PyObject *key)
+{
+    Py_ssize_t index;
+
+    index = locktable_index(self, key);
+    if (index == -1)
+        return NULL;
+
+    if (locktable_release_stripe(self, index) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+locktable_acquire_many(locktableobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"keys", "timeout", NULL};
+    PyObject *keys;
+    PyObject *obj = Py_None;
+    double timeout;
+    acquire_result res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:acquire_many", kwlist,
+                                     &keys, &obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    res = locktable_acquire_keys(self, keys, timeout);
+    if (res == ACQUIRE_ERROR)
+        return NULL;
+
+    return PyBool_FromLong(res == ACQUIRE_OK);
+}
+
+static PyObject *
+locktable_release_many(locktableobj *self, PyObject *keys)
+{
+    if (locktable_release_keys(self, keys) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+/* Context manager returned by LockTable.locked() */
+
+typedef struct {
+    PyObject_HEAD
+    locktableobj *table;
+    PyObject *keys;
+} lockguardobj;
+
+static void
+lockguard_dealloc(lockguardobj *self)
+{
+    Py_CLEAR(self->table);
+    Py_CLEAR(self->keys);
+
+    PyObject_Del(self);
+}
+
+static PyObject *
+lockguard_enter(lockguardobj *self)
+{
+    if (locktable_acquire_keys(self->table, self->keys, UNLIMITED) ==
+            ACQUIRE_ERROR)
+        return NULL;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+lockguard_exit(lockguardobj *self, PyObject *args)
+{
+    if (locktable_release_keys(self->table, self->keys) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef lockguard_methods[] = {
+    {"__enter__", (PyCFunction)lockguard_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)lockguard_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject LockGuardType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.LockGuard",    /* tp_name */
+    sizeof(lockguardobj),       /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)lockguard_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    0,                          /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    lockguard_methods,          /* tp_methods */
+    0,                          /* tp_members */
+    0,                          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    0,                          /* tp_new */
+};
+
+/* Return a context manager locking all keys. */
+static PyObject *
+locktable_locked(locktableobj *self, PyObject *keys)
+{
+    lockguardobj *guard;
+
+    guard = PyObject_New(lockguardobj, &LockGuardType);
+    if (guard == NULL)
+        return NULL;
+
+    Py_INCREF(self);
+    guard->table = self;
+
+    Py_INCREF(keys);
+    guard->keys = keys;
+
+    return (PyObject *)guard;
+}
+
+static PyMethodDef locktable_methods[] = {
+    {"acquire", (PyCFunction)locktable_acquire,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"release", (PyCFunction)locktable_release, METH_O, NULL},
+    {"acquire_many", (PyCFunction)locktable_acquire_many,
+     METH_VARARGS | METH_KEYWORDS, NULL},
+    {"release_many", (PyCFunction)locktable_release_many, METH_O, NULL},
+    {"locked", (PyCFunction)locktable_locked, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject LockTableType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.LockTable",    /* tp_name */
+    sizeof(locktableobj),       /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)locktable_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    locktable_doc,              /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(locktableobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    locktable_methods,          /* tp_methods */
+    0,                          /* tp_members */
+    0,                          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    locktable_new,              /* tp_new */
+};
+
+/* SeqLock object */
+
+/* Readers run under the GIL, which orders their accesses with writers, so
+ * they read the sequence without atomic operations. Writers are serialized
+ * by a semaphore. Readers finding a write in progress park on the readers
+ * queue until the writer is done. */
+
+typedef struct {
+    PyObject_HEAD
+    unsigned long sequence;
+    sem_t sem;
+    long owner;
+    struct waitq readers;   /* Readers waiting for the writer */
+    PyObject *weakrefs;
+} seqlockobj;
+
+PyDoc_STRVAR(seqlock_doc,
+"SeqLock()\n\
+\n\
+Sequence lock for data read often and written rarely. Readers do not block\n\
+each other or writers; a reader is retried if a writer modified the data\n\
+while it was reading.");
+
+static PyObject *
+seqlock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    seqlockobj *self;
+
+    if (!_PyArg_NoKeywords("SeqLock()", kwds))
+        return NULL;
+
+    if (!PyArg_ParseTuple(args, ":SeqLock"))
+        return NULL;
+
+    self = (seqlockobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    if (sem_init(&self->sem, 0, 1) != 0) {
+        set_error(errno, "sem_init");
+        PyObject_Del(self);
+        return NULL;
+    }
+
+    self->sequence = 0;
+    self->owner = 0;
+    waitq_init(&self->readers);
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+seqlock_dealloc(seqlockobj *self)
+{
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    sem_destroy(&self->sem);
+
+    PyObject_Del(self);
+}
+
+static acquire_result
+seqlock_write_begin(seqlockobj *self)
+{
+    acquire_result res;
+
+    if (self->owner == PyThread_get_thread_ident()) {
+        PyErr_SetString(PyExc_RuntimeError, "SeqLock is not reentrant");
+        return ACQUIRE_ERROR;
+    }
+
+    res = acquire_lock((PyObject *)self, &self->sem, NULL, UNLIMITED);
+
+    if (res == ACQUIRE_OK) {
+        self->owner = PyThread_get_thread_ident();
+        self->sequence++;
+    }
+
+    return res;
+}
+
+static int
+seqlock_write_end(seqlockobj *self)
+{
+    if (self->owner != PyThread_get_thread_ident()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot release un-acquired lock");
+        return -1;
+    }
+
+    self->sequence++;
+    self->owner = 0;
+
+    if (release_lock((PyObject *)self, &self->sem) != 0) {
+        self->sequence--;
+        self->owner = PyThread_get_thread_ident();
+        return -1;
+    }
+
+    if (self->readers.first == NULL)
+        return 0;
+
+    return waitq_wake(&self->readers, self->readers.count) < 0 ? -1 : 0;
+}
+
+/* Wait until the writer that made the sequence odd is done. Readers do not
+ * touch the writers semaphore, so they never delay writers; they park on the
+ * readers queue, woken when the write ends. */
+static int
+seqlock_wait_writer(seqlockobj *self, unsigned long sequence)
+{
+    struct waiter waiter;
+    acquire_result res = ACQUIRE_OK;
+
+    if (waiter_init(&waiter) != 0)
+        return -1;
+
+    while (self->sequence == sequence && res != ACQUIRE_ERROR) {
+        waitq_append(&self->readers, &waiter);
+        res = park_blocked((PyObject *)self, "read", &waiter.sem, UNLIMITED);
+        waitq_remove(&self->readers, &waiter);
+    }
+
+    waiter_destroy(&waiter);
+
+    return res == ACQUIRE_ERROR ? -1 : 0;
+}
+
+static PyObject *
+seqlock_read(seqlockobj *self, PyObject *args)
+{
+    PyObject *fn;
+    PyObject *fn_args;
+    PyObject *result;
+    unsigned long sequence;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "read() requires a callable argument");
+        return NULL;
+    }
+
+    fn = PyTuple_GET_ITEM(args, 0);
+
+    fn_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (fn_args == NULL)
+        return NULL;
+
+    /* The writer reads its own writes. */
+    if (self->owner == PyThread_get_thread_ident()) {
+        result = PyObject_Call(fn, fn_args, NULL);
+        Py_DECREF(fn_args);
+        return result;
+    }
+
+    for (;;) {
+        sequence = self->sequence;
+
+        /* Odd sequence: a writer is modifying the data. */
+        if (sequence & 1) {
+            if (seqlock_wait_writer(self, sequence) != 0) {
+                Py_DECREF(fn_args);
+                return NULL;
+            }
+            continue;
+        }
+
+        result = PyObject_Call(fn, fn_args, NULL);
+
+        if (self->sequence == sequence)
+            break;
+
+        /* The data was modified while reading; an error may be caused by
+         * inconsistent data, so retry in this case too. */
+        Py_XDECREF(result);
+        if (result == NULL)
+            PyErr_Clear();
+    }
+
+    Py_DECREF(fn_args);
+
+    return result;
+}
+
+PyDoc_STRVAR(seqlock_read_doc,
+"read(fn, *args) -> result\n\
+\n\
+Return fn(*args), calling fn again if the data was modified during the\n\
+call. fn may be called more than once, and must not have side effects.");
+
+static PyObject *
+seqlock_sequence(seqlockobj *self, void *closure)
+{
+    return PyLong_FromUnsignedLong(self->sequence);
+}
+
+static PyObject *
+seqlock_get_waiters(seqlockobj *self, void *closure)
+{
+    return PyInt_FromLong(self->readers.count);
+}
+
+/* Context manager returned by SeqLock.write() */
+
+typedef struct {
+    PyObject_HEAD
+    seqlockobj *seqlock;
+} seqlockwriterobj;
+
+static void
+seqlockwriter_dealloc(seqlockwriterobj *self)
+{
+    Py_CLEAR(self->seqlock);
+
+    PyObject_Del(self);
+}
+
+static PyObject *
+seqlockwriter_enter(seqlockwriterobj *self)
+{
+    if (seqlock_write_begin(self->seqlock) != ACQUIRE_OK)
+        return NULL;
+
+    Py_INCREF(self->seqlock);
+    return (PyObject *)self->seqlock;
+}
+
+static PyObject *
+seqlockwriter_exit(seqlockwriterobj *self, PyObject *args)
+{
+    if (seqlock_write_end(self->seqlock) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef seqlockwriter_methods[] = {
+    {"__enter__", (PyCFunction)seqlockwriter_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)seqlockwriter_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject SeqLockWriterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.SeqLockWriter",    /* tp_name */
+    sizeof(seqlockwriterobj),   /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)seqlockwriter_dealloc,  /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    0,                          /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    seqlockwriter_methods,      /* tp_methods */
+    0,                          /* tp_members */
+    0,                          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    0,                          /* tp_new */
+};
+
+static PyObject *
+seqlock_write(seqlockobj *self)
+{
+    seqlockwriterobj *writer;
+
+    writer = PyObject_New(seqlockwriterobj, &SeqLockWriterType);
+    if (writer == NULL)
+        return NULL;
+
+    Py_INCREF(self);
+    writer->seqlock = self;
+
+    return (PyObject *)writer;
+}
+
+PyDoc_STRVAR(seqlock_write_doc,
+"write() -> context manager\n\
+\n\
+Return a context manager modifying the data exclusively.");
+
+static PyMethodDef seqlock_methods[] = {
+    {"read", (PyCFunction)seqlock_read, METH_VARARGS, seqlock_read_doc},
+    {"write", (PyCFunction)seqlock_write, METH_NOARGS, seqlock_write_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef seqlock_getset[] = {
+    {"sequence", (getter)seqlock_sequence, NULL, NULL, NULL},
+    {"waiters", (getter)seqlock_get_waiters, NULL,
+     "Number of readers waiting for a writer", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject SeqLockType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.SeqLock",      /* tp_name */
+    sizeof(seqlockobj),         /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)seqlock_dealloc,    /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    seqlock_doc,                /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(seqlockobj, weakrefs), /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    seqlock_methods,            /* tp_methods */
+    0,                          /* tp_members */
+    seqlock_getset,             /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    seqlock_new,                /* tp_new */
+};
+
+/* ObjectPool object
+ *
+ * The pool keeps a reference to every object it created. items holds the
+ * free objects first, most recently released last, followed by the acquired
+ * objects:
+ *
+ *   items[0:len]       free
+ *   items[len:count]   acquired
+ *
+ * Acquiring a free object moves the boundary down, making it the first
+ * acquired object, and releasing finds the object in the acquired part and
+ * swaps it back across the boundary. Objects are usually released in reverse
+ * acquire order, so the search usually checks only the first acquired
+ * object, without allocating or hashing. */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *factory;
+    PyObject **items;
+    Py_ssize_t len;         /* Number of free objects */
+    Py_ssize_t count;       /* Number of objects in items */
+    Py_ssize_t size;        /* Number of objects created by the pool,
+                               including objects being created */
+    Py_ssize_t maxsize;
+    struct waitq waiters;
+    PyObject *weakrefs;
+} poolobj;
+
+PyDoc_STRVAR(pool_doc,
+"ObjectPool(factory, maxsize)\n\
+\n\
+Pool of up to maxsize objects created lazily by calling factory(). The most\n\
+recently released object is reused first. When all objects are in use,\n\
+acquire() blocks until an object is released.");
+
+static PyObject *
+pool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    poolobj *self;
+    PyObject *factory;
+    Py_ssize_t maxsize;
+    static char *kwlist[] = {"factory", "maxsize", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On:ObjectPool", kwlist,
+                                     &factory, &maxsize))
+        return NULL;
+
+    if (!PyCallable_Check(factory)) {
+        PyErr_SetString(PyExc_TypeError, "factory must be callable");
+        return NULL;
+    }
+
+    if (maxsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must be positive");
+        return NULL;
+    }
+
+    self = (poolobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->items = PyMem_New(PyObject *, maxsize);
+    if (self->items == NULL) {
+        PyObject_Del(self);
+        return PyErr_NoMemory();
+    }
+
+    Py_INCREF(factory);
+    self->factory = factory;
+    self->len = 0;
+    self->count = 0;
+    self->size = 0;
+    self->maxsize = maxsize;
+    waitq_init(&self->waiters);
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+pool_dealloc(poolobj *self)
+{
+    /* Waiting threads keep a reference to the pool. */
+    assert(self->waiters.first == NULL && self->waiters.last == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    while (self->count > 0) {
+        self->count--;
+        Py_DECREF(self->items[self->count]);
+    }
+
+    PyMem_Free(self->items);
+    Py_CLEAR(self->factory);
+
+    PyObject_Del(self);
+}
+
+/* Wake one waiter after an object was released, or a slot for creating a
+ * new object became available. */
+static int
+pool_wake(poolobj *self)
+{
+    if (self->waiters.first == NULL)
+        return 0;
+
+    return waitq_wake(&self->waiters, 1) < 0 ? -1 : 0;
+}
+
+/* Return the index of acquired obj in items. Raises ValueError and returns -1
+ * if obj is not acquired. */
+static Py_ssize_t
+pool_find_acquired(poolobj *self, PyObject *obj)
+{
+    Py_ssize_t i;
+
+    for (i = self->len; i < self->count; i++) {
+        if (self->items[i] == obj)
+            return i;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "object was not acquired from pool");
+    return -1;
+}
+
+static void
+pool_swap(poolobj *self, Py_ssize_t i, Py_ssize_t j)
+{
+    PyObject *tmp = self->items[i];
+
+    self->items[i] = self->items[j];
+    self->items[j] = tmp;
+}
+
+/* Return a new reference to a free object, creating a new object if needed.
+ * Raises Timeout if no object became available within timeout, or Cancelled
+ * if token was cancelled. */
+static PyObject *
+pool_acquire_internal(poolobj *self, double timeout, tokenobj *token)
+{
+    struct waiter waiter;
+    struct cancel_node node;
+    double deadline = 0;
+    double remaining = timeout;
+    acquire_result res;
+    PyObject *obj;
+
+    if (timeout > 0)
+        deadline = monotonic_time() + timeout;
+
+    for (;;) {
+        if (token_check(token) != 0)
+            return NULL;
+
+        if (self->len > 0) {
+            obj = self->items[--self->len];
+            Py_INCREF(obj);
+            return obj;
+        }
+
+        if (self->size < self->maxsize) {
+            /* Reserve a slot, since the factory may release the GIL. */
+            self->size++;
+
+            obj = PyObject_CallObject(self->factory, NULL);
+            if (obj == NULL) {
+                self->size--;
+                if (pool_wake(self) != 0)
+                    PyErr_Clear();
+                return NULL;
+            }
+
+            /* Other threads may have acquired objects while we were
+             * creating this one; keep the free objects first. */
+            Py_INCREF(obj);
+            self->items[self->count++] = obj;
+
+            return obj;
+        }
+
+        if (timeout > 0) {
+            remaining = deadline - monotonic_time();
+            if (remaining <= 0)
+                break;
+        } else if (timeout == 0) {
+            break;
+        }
+
+        if (waiter_init(&waiter) != 0)
+            return NULL;
+
+        waitq_append(&self->waiters, &waiter);
+        token_register(token, &node, &waiter);
+
+        res = park_blocked((PyObject *)self, "acquire", &waiter.sem,
+                           remaining);
+
+        token_unregister(token, &node);
+
+        /* Woken by a release if pool_wake() removed us. */
+        if (node.cancelled && waiter.next == WAITER_UNUSED) {
+            if (pool_wake(self) != 0)
+                res = ACQUIRE_ERROR;
+        }
+
+        waitq_remove(&self->waiters, &waiter);
+        waiter_destroy(&waiter);
+
+        if (res == ACQUIRE_ERROR)
+            return NULL;
+
+        /* If we timed out after being woken up, the next iteration takes the
+         * released object, so the wakeup is not lost. A cancelled waiter
+         * passed its wakeup to the next waiter above. */
+    }
+
+    PyErr_SetString(Timeout, "timeout acquiring object from pool");
+    return NULL;
+}
+
+static int
+pool_release_internal(poolobj *self, PyObject *obj)
+{
+    Py_ssize_t i = pool_find_acquired(self, obj);
+
+    if (i < 0)
+        return -1;
+
+    pool_swap(self, i, self->len++);
+
+    return pool_wake(self);
+}
+
+static PyObject *
+pool_acquire(poolobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", "token", NULL};
+    PyObject *obj = Py_None;
+    PyObject *token_obj = Py_None;
+    tokenobj *token;
+    double timeout;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:acquire", kwlist, &obj,
+                                     &token_obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    return pool_acquire_internal(self, timeout, token);
+}
+
+PyDoc_STRVAR(pool_acquire_doc,
+"acquire(timeout=None, token=None) -> object\n\
+\n\
+Return a free object, creating one if the pool is not full. Raises Timeout\n\
+if no object is available within timeout seconds, or Cancelled if token is\n\
+cancelled.");
+
+static PyObject *
+pool_release(poolobj *self, PyObject *obj)
+{
+    if (pool_release_internal(self, obj) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pool_release_doc,
+"release(obj)\n\
+\n\
+Return an object acquired from the pool.");
+
+static PyObject *
+pool_discard(poolobj *self, PyObject *obj)
+{
+    Py_ssize_t i = pool_find_acquired(self, obj);
+
+    if (i < 0)
+        return NULL;
+
+    pool_swap(self, i, --self->count);
+    self->size--;
+    Py_DECREF(obj);
+
+    if (pool_wake(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(pool_discard_doc,
+"discard(obj)\n\
+\n\
+Drop an acquired object instead of returning it to the pool, for example a\n\
+broken connection. A new object will be created when needed.");
+
+static PyObject *
+pool_get_size(poolobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->size);
+}
+
+static PyObject *
+pool_get_maxsize(poolobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->maxsize);
+}
+
+static PyObject *
+pool_get_available(poolobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->len);
+}
+
+static PyObject *
+pool_get_waiters(poolobj *self, void *closure)
+{
+    return PyInt_FromLong(self->waiters.count);
+}
+
+/* Context manager returned by ObjectPool.item() */
+
+typedef struct {
+    PyObject_HEAD
+    poolobj *pool;
+    double timeout;
+    PyObject *obj;
+} poolitemobj;
+
+static void
+poolitem_dealloc(poolitemobj *self)
+{
+    Py_CLEAR(self->pool);
+    Py_CLEAR(self->obj);
+
+    PyObject_Del(self);
+}
+
+static PyObject *
+poolitem_enter(poolitemobj *self)
+{
+    PyObject *obj;
+
+    if (self->obj != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "pool item already acquired");
+        return NULL;
+    }
+
+    obj = pool_acquire_internal(self->pool, self->timeout, NULL);
+    if (obj == NULL)
+        return NULL;
+
+    Py_INCREF(obj);
+    self->obj = obj;
+
+    return obj;
+}
+
+static PyObject *
+poolitem_exit(poolitemobj *self, PyObject *args)
+{
+    PyObject *obj = self->obj;
+    int r;
+
+    if (obj == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "pool item not acquired");
+        return NULL;
+    }
+
+    self->obj = NULL;
+    r = pool_release_internal(self->pool, obj);
+    Py_DECREF(obj);
+
+    if (r != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef poolitem_methods[] = {
+    {"__enter__", (PyCFunction)poolitem_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)poolitem_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PoolItemType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.PoolItem",     /* tp_name */
+    sizeof(poolitemobj),        /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)poolitem_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    0,                          /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    poolitem_methods,           /* tp_methods */
+    0,                          /* tp_members */
+    0,                          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    0,                          /* tp_new */
+};
+
+static PyObject *
+pool_item(poolobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *obj = Py_None;
+    poolitemobj *item;
+    double timeout;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:item", kwlist, &obj))
+        return NULL;
+
+    if (parse_timeout(obj, &timeout) != 0)
+        return NULL;
+
+    item = PyObject_New(poolitemobj, &PoolItemType);
+    if (item == NULL)
+        return NULL;
+
+    Py_INCREF(self);
+    item->pool = self;
+    item->timeout = timeout;
+    item->obj = NULL;
+
+    return (PyObject *)item;
+}
+
+PyDoc_STRVAR(pool_item_doc,
+"item(timeout=None) -> context manager\n\
+\n\
+Return a context manager acquiring an object on enter and releasing it on\n\
+exit.");
+
+static PyMethodDef pool_methods[] = {
+    {"acquire", (PyCFunction)pool_acquire, METH_VARARGS | METH_KEYWORDS,
+     pool_acquire_doc},
+    {"release", (PyCFunction)pool_release, METH_O, pool_release_doc},
+    {"discard", (PyCFunction)pool_discard, METH_O, pool_discard_doc},
+    {"item", (PyCFunction)pool_item, METH_VARARGS | METH_KEYWORDS,
+     pool_item_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef pool_getset[] = {
+    {"size", (getter)pool_get_size, NULL, NULL, NULL},
+    {"maxsize", (getter)pool_get_maxsize, NULL, NULL, NULL},
+    {"available", (getter)pool_get_available, NULL, NULL, NULL},
+    {"waiters", (getter)pool_get_waiters, NULL,
+     "Number of threads blocked acquiring an object", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ObjectPoolType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.ObjectPool",   /* tp_name */
+    sizeof(poolobj),            /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)pool_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    pool_doc,                   /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(poolobj, weakrefs),    /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    pool_methods,               /* tp_methods */
+    0,                          /* tp_members */
+    pool_getset,                /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    pool_new,                   /* tp_new */
+};
+
+/* AtomicInt object
+ *
+ * Operations use compiler atomic builtins instead of a lock. Python callers
+ * are serialized by the GIL anyway; the atomics keep the value consistent
+ * for C code accessing it without the GIL, and cost no more than plain
+ * operations when uncontended. */
+
+typedef struct {
+    PyObject_HEAD
+    long value;
+    PyObject *weakrefs;
+} atomicobj;
+
+PyDoc_STRVAR(atomic_doc,
+"AtomicInt(value=0)\n\
+\n\
+Integer that can be modified by multiple threads without a lock.");
+
+static PyObject *
+atomic_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    atomicobj *self;
+    long value = 0;
+    static char *kwlist[] = {"value", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|l:AtomicInt", kwlist,
+                                     &value))
+        return NULL;
+
+    self = (atomicobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->value = value;
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+atomic_dealloc(atomicobj *self)
+{
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    PyObject_Del(self);
+}
+
+static PyObject *
+atomic_add(atomicobj *self, PyObject *args)
+{
+    long delta = 1;
+    long old;
+    long value;
+
+    if (!PyArg_ParseTuple(args, "|l:add", &delta))
+        return NULL;
+
+    old = __atomic_load_n(&self->value, __ATOMIC_RELAXED);
+
+    do {
+        if (__builtin_add_overflow(old, delta, &value)) {
+            PyErr_SetString(PyExc_OverflowError, "AtomicInt overflowed");
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&self->value, &old, value, 1,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    return PyInt_FromLong(value);
+}
+
+PyDoc_STRVAR(atomic_add_doc,
+"add(delta=1) -> int\n\
+\n\
+Add delta and return the new value.");
+
+static PyObject *
+atomic_get(atomicobj *self)
+{
+    return PyInt_FromLong(__atomic_load_n(&self->value, __ATOMIC_SEQ_CST));
+}
+
+PyDoc_STRVAR(atomic_get_doc,
+"get() -> int\n\
+\n\
+Return the current value.");
+
+static PyObject *
+atomic_set(atomicobj *self, PyObject *args)
+{
+    long value;
+
+    if (!PyArg_ParseTuple(args, "l:set", &value))
+        return NULL;
+
+    __atomic_store_n(&self->value, value, __ATOMIC_SEQ_CST);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(atomic_set_doc,
+"set(value)\n\
+\n\
+Set the value.");
+
+static PyObject *
+atomic_compare_and_swap(atomicobj *self, PyObject *args)
+{
+    long expected;
+    long value;
+    int swapped;
+
+    if (!PyArg_ParseTuple(args, "ll:compare_and_swap", &expected, &value))
+        return NULL;
+
+    swapped = __atomic_compare_exchange_n(&self->value, &expected, value, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return PyBool_FromLong(swapped);
+}
+
+PyDoc_STRVAR(atomic_compare_and_swap_doc,
+"compare_and_swap(expected, value) -> bool\n\
+\n\
+Set the value if the current value is expected. Returns True if the value\n\
+was set.");
+
+static PyObject *
+atomic_exchange(atomicobj *self, PyObject *args)
+{
+    long value;
+
+    if (!PyArg_ParseTuple(args, "l:exchange", &value))
+        return NULL;
+
+    return PyInt_FromLong(__atomic_exchange_n(&self->value, value,
+                                              __ATOMIC_SEQ_CST));
+}
+
+PyDoc_STRVAR(atomic_exchange_doc,
+"exchange(value) -> int\n\
+\n\
+Set the value and return the previous value.");
+
+static PyMethodDef atomic_methods[] = {
+    {"add", (PyCFunction)atomic_add, METH_VARARGS, atomic_add_doc},
+    {"get", (PyCFunction)atomic_get, METH_NOARGS, atomic_get_doc},
+    {"set", (PyCFunction)atomic_set, METH_VARARGS, atomic_set_doc},
+    {"compare_and_swap", (PyCFunction)atomic_compare_and_swap, METH_VARARGS,
+     atomic_compare_and_swap_doc},
+    {"exchange", (PyCFunction)atomic_exchange, METH_VARARGS,
+     atomic_exchange_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef atomic_getset[] = {
+    {"value", (getter)atomic_get, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject AtomicIntType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.AtomicInt",    /* tp_name */
+    sizeof(atomicobj),          /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)atomic_dealloc, /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    atomic_doc,                 /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(atomicobj, weakrefs),  /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    atomic_methods,             /* tp_methods */
+    0,                          /* tp_members */
+    atomic_getset,              /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    atomic_new,                 /* tp_new */
+};
+
+/* Counter object */
+
+#define COUNTER_DEFAULT_SHARDS 16
+
+/* Threads add to the shard of their thread id, so threads running on
+ * different cpus do not share cache lines. */
+struct shard {
+    long value;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+typedef struct {
+    PyObject_HEAD
+    struct shard *shards;
+    Py_ssize_t size;
+    PyObject *weakrefs;
+} counterobj;
+
+PyDoc_STRVAR(counter_doc,
+"Counter(shards=16)\n\
+\n\
+Counter sharded by thread. add() is cheap, get() sums all the shards.\n\
+Use for counters modified often and read rarely, such as metrics.");
+
+static PyObject *
+counter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    counterobj *self;
+    Py_ssize_t size = COUNTER_DEFAULT_SHARDS;
+    void *mem;
+    static char *kwlist[] = {"shards", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:Counter", kwlist,
+                                     &size))
+        return NULL;
+
+    if (size <= 0 || size > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(struct shard)) {
+        PyErr_SetString(PyExc_ValueError, "invalid number of shards");
+        return NULL;
+    }
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                       size * sizeof(struct shard)) != 0)
+        return PyErr_NoMemory();
+
+    memset(mem, 0, size * sizeof(struct shard));
+
+    self = (counterobj *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        free(mem);
+        return NULL;
+    }
+
+    self->shards = mem;
+    self->size = size;
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+counter_dealloc(counterobj *self)
+{
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    free(self->shards);
+
+    PyObject_Del(self);
+}
+
+static struct shard *
+counter_shard(counterobj *self)
+{
+    /* Thread ids are pthread_t addresses; mix the bits so consecutive
+     * threads spread over the shards. */
+    unsigned long tid = (unsigned long)PyThread_get_thread_ident();
+
+    tid ^= tid >> 16;
+    tid *= 0x45d9f3bUL;
+    tid ^= tid >> 16;
+
+    return &self->shards[tid % (size_t)self->size];
+}
+
+static PyObject *
+counter_add(counterobj *self, PyObject *args)
+{
+    long delta = 1;
+
+    if (!PyArg_ParseTuple(args, "|l:add", &delta))
+        return NULL;
+
+    __atomic_fetch_add(&counter_shard(self)->value, delta, __ATOMIC_RELAXED);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(counter_add_doc,
+"add(delta=1)\n\
+\n\
+Add delta to the counter.");
+
+static PyObject *
+counter_get(counterobj *self)
+{
+    long sum = 0;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->size; i++) {
+        long value = __atomic_load_n(&self->shards[i].value,
+                                     __ATOMIC_RELAXED);
+        if (__builtin_add_overflow(sum, value, &sum)) {
+            PyErr_SetString(PyExc_OverflowError, "Counter overflowed");
+            return NULL;
+        }
+    }
+
+    return PyInt_FromLong(sum);
+}
+
+PyDoc_STRVAR(counter_get_doc,
+"get() -> int\n\
+\n\
+Return the sum of all shards. Additions running concurrently may or may\n\
+not be included.");
+
+static PyMethodDef counter_methods[] = {
+    {"add", (PyCFunction)counter_add, METH_VARARGS, counter_add_doc},
+    {"get", (PyCFunction)counter_get, METH_NOARGS, counter_get_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef counter_getset[] = {
+    {"value", (getter)counter_get, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject CounterType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.Counter",      /* tp_name */
+    sizeof(counterobj),         /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)counter_dealloc,    /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    counter_doc,                /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(counterobj, weakrefs), /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    counter_methods,            /* tp_methods */
+    0,                          /* tp_members */
+    counter_getset,             /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    counter_new,                /* tp_new */
+};
+
+/* ByteRing object
+ *
+ * A fixed size ring of bytes. write() and read_into() copy data directly
+ * between the caller buffer and the ring. Producers filling buffers in place,
+ * for example using file.readinto(), can reserve() a region and commit() it,
+ * and consumers can peek() at a region and consume() it, avoiding copies.
+ *
+ * While a region is reserved, other writers wait until it is committed, and
+ * while a region is peeked, other readers wait until it is consumed.
+ * Regions are returned as memoryviews of the ring buffer; they must not be
+ * used after commit() or consume(). */
+
+typedef struct {
+    PyObject_HEAD
+    char *buf;
+    Py_ssize_t capacity;
+    Py_ssize_t head;        /* Offset of first readable byte */
+    Py_ssize_t len;         /* Number of readable bytes */
+    Py_ssize_t reserved;    /* Size of reserved region, or 0 */
+    Py_ssize_t peeked;      /* Size of peeked region, or 0 */
+    int closed;
+    struct waitq readers;
+    struct waitq writers;
+    PyObject *weakrefs;
+} ringobj;
+
+PyDoc_STRVAR(ring_doc,
+"ByteRing(capacity)\n\
+\n\
+Ring buffer of capacity bytes for passing binary data between threads.\n\
+Writers block when the ring is full, and readers block when the ring is\n\
+empty. After close(), readers get the remaining data and then end of file.");
+
+static PyObject *
+ring_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ringobj *self;
+    Py_ssize_t capacity;
+    static char *kwlist[] = {"capacity", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n:ByteRing", kwlist,
+                                     &capacity))
+        return NULL;
+
+    if (capacity <= 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return NULL;
+    }
+
+    self = (ringobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->buf = PyMem_Malloc(capacity);
+    if (self->buf == NULL) {
+        PyObject_Del(self);
+        return PyErr_NoMemory();
+    }
+
+    self->capacity = capacity;
+    self->head = 0;
+    self->len = 0;
+    self->reserved = 0;
+    self->peeked = 0;
+    self->closed = 0;
+    waitq_init(&self->readers);
+    waitq_init(&self->writers);
+    self->weakrefs = NULL;
+
+    return (PyObject *)self;
+}
+
+static void
+ring_dealloc(ringobj *self)
+{
+    /* Waiting threads and memoryviews keep a reference to the ring. */
+    assert(self->readers.first == NULL && self->writers.first == NULL);
+
+    if (self->weakrefs)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    PyMem_Free(self->buf);
+
+    PyObject_Del(self);
+}
+
+/* Return the offset of the first writable byte. */
+static Py_ssize_t
+ring_tail(ringobj *self)
+{
+    return (self->head + self->len) % self->capacity;
+}
+
+/* Remove size bytes from the start of the ring. When the ring becomes empty,
+ * start again at the start of the buffer, so the next reserved region can use
+ * the entire buffer. */
+static void
+ring_advance(ringobj *self, Py_ssize_t size)
+{
+    self->head = (self->head + size) % self->capacity;
+    self->len -= size;
+
+    if (self->len == 0 && !self->reserved)
+        self->head = 0;
+}
+
+/* Wake all writers after space was freed or a reserved region was committed.
+ * Writers may wait for different amounts of space, so waking only the first
+ * writer could leave another writer waiting while its write fits. */
+static int
+ring_wake_writers(ringobj *self)
+{
+    if (self->writers.first == NULL)
+        return 0;
+
+    return waitq_wake(&self->writers, self->writers.count) < 0 ? -1 : 0;
+}
+
+/* Wake one reader if data can be read. A reader leaving data in the ring
+ * wakes the next reader. */
+static int
+ring_wake_reader(ringobj *self)
+{
+    if (self->readers.first == NULL)
+        return 0;
+
+    if (self->peeked || (self->len == 0 && !self->closed))
+        return 0;
+
+    return waitq_wake(&self->readers, 1) < 0 ? -1 : 0;
+}
+
+/* Block on waitq q of ring self up to remaining seconds, or until token is
+ * cancelled. kind is reported by blocked(). */
+static int
+ring_park(ringobj *self, struct waitq *q, const char *kind, double remaining,
+          tokenobj *token)
+{
+    struct waiter waiter;
+    struct cancel_node node;
+    acquire_result res;
+
+    if (waiter_init(&waiter) != 0)
+        return -1;
+
+    waitq_append(q, &waiter);
+    token_register(token, &node, &waiter);
+
+    res = park_blocked((PyObject *)self, kind, &waiter.sem, remaining);
+
+    token_unregister(token, &node);
+
+    /* Woken by a writer or reader if it removed us; pass the wakeup to the
+     * next waiter. */
+    if (node.cancelled && waiter.next == WAITER_UNUSED && q->first != NULL) {
+        if (waitq_wake(q, 1) < 0)
+            res = ACQUIRE_ERROR;
+    }
+
+    waitq_remove(q, &waiter);
+    waiter_destroy(&waiter);
+
+    return res == ACQUIRE_ERROR ? -1 : 0;
+}
+
+/* Wait until no region is reserved and size bytes are free. Raises
+ * ChannelClosed if the ring is closed, Timeout if timeout expired, or
+ * Cancelled if token was cancelled. */
+static int
+ring_wait_writable(ringobj *self, Py_ssize_t size, double timeout,
+                   tokenobj *token)
+{
+    double deadline = 0;
+    double remaining = timeout;
+
+    if (timeout > 0)
+        deadline = monotonic_time() + timeout;
+
+    for (;;) {
+        if (token_check(token) != 0)
+            return -1;
+
+        if (self->closed) {
+            PyErr_SetString(ChannelClosed, "write to closed ring");
+            return -1;
+        }
+
+        if (!self->reserved && self->capacity - self->len >= size)
+            return 0;
+
+        if (timeout > 0) {
+            remaining = deadline - monotonic_time();
+            if (remaining <= 0)
+                break;
+        } else if (timeout == 0) {
+            break;
+        }
+
+        if (ring_park(self, &self->writers, "write", remaining, token) != 0)
+            return -1;
+    }
+
+    PyErr_SetString(Timeout, "timeout writing to ring");
+    return -1;
+}
+
+/* Wait until no region is peeked and data is available. Returns 1 if data
+ * is available, 0 if the ring is closed and empty, and -1 on errors. */
+static int
+ring_wait_readable(ringobj *self, double timeout, tokenobj *token)
+{
+    double deadline = 0;
+    double remaining = timeout;
+
+    if (timeout > 0)
+        deadline = monotonic_time() + timeout;
+
+    for (;;) {
+        if (token_check(token) != 0)
+            return -1;
+
+        if (!self->peeked) {
+            if (self->len > 0)
+                return 1;
+            if (self->closed)
+                return 0;
+        }
+
+        if (timeout > 0) {
+            remaining = deadline - monotonic_time();
+            if (remaining <= 0)
+                break;
+        } else if (timeout == 0) {
+            break;
+        }
+
+        if (ring_park(self, &self->readers, "read", remaining, token) != 0)
+            return -1;
+    }
+
+    PyErr_SetString(Timeout, "timeout reading from ring");
+    return -1;
+}
+
+/* Exporter of a region returned by reserve() or peek(), keeping the ring
+ * alive. Memoryviews get their buffer from the exporter, so each region
+ * exports only its own bytes, and peeked regions are read only. */
+
+typedef struct {
+    PyObject_HEAD
+    ringobj *ring;
+    char *buf;
+    Py_ssize_t len;
+    int readonly;
+} regionobj;
+
+static void
+region_dealloc(regionobj *self)
+{
+    Py_CLEAR(self->ring);
+
+    PyObject_Del(self);
+}
+
+static int
+region_getbuffer(regionobj *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->buf, self->len,
+                             self->readonly, flags);
+}
+
+static PyBufferProcs region_as_buffer = {
+    0,                          /* bf_getreadbuffer */
+    0,                          /* bf_getwritebuffer */
+    0,                          /* bf_getsegcount */
+    0,                          /* bf_getcharbuffer */
+    (getbufferproc)region_getbuffer,    /* bf_getbuffer */
+    0,                          /* bf_releasebuffer */
+};
+
+static PyTypeObject RingRegionType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.RingRegion",   /* tp_name */
+    sizeof(regionobj),          /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)region_dealloc, /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    &region_as_buffer,          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    0,                          /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    0,                          /* tp_methods */
+    0,                          /* tp_members */
+    0,                          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    0,                          /* tp_new */
+};
+
+/* Return a memoryview of size bytes at offset in the ring buffer. */
+static PyObject *
+ring_region(ringobj *self, Py_ssize_t offset, Py_ssize_t size, int readonly)
+{
+    regionobj *exporter;
+    PyObject *region;
+
+    exporter = PyObject_New(regionobj, &RingRegionType);
+    if (exporter == NULL)
+        return NULL;
+
+    Py_INCREF(self);
+    exporter->ring = self;
+    exporter->buf = self->buf + offset;
+    exporter->len = size;
+    exporter->readonly = readonly;
+
+    region = PyMemoryView_FromObject((PyObject *)exporter);
+    Py_DECREF(exporter);
+
+    return region;
+}
+
+/* Parse region size, None meaning as much as possible (-1). */
+static int
+ring_parse_size(PyObject *obj, Py_ssize_t *size)
+{
+    if (obj == Py_None) {
+        *size = -1;
+        return 0;
+    }
+
+    *size = PyNumber_AsSsize_t(obj, PyExc_OverflowError);
+    if (*size == -1 && PyErr_Occurred())
+        return -1;
+
+    if (*size == 0 || *size < -1) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+ring_write(ringobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "timeout", "token", NULL};
+    Py_buffer data;
+    PyObject *timeout_obj = Py_None;
+    PyObject *token_obj = Py_None;
+    tokenobj *token;
+    double timeout;
+    Py_ssize_t tail;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|OO:write", kwlist,
+                                     &data, &timeout_obj, &token_obj))
+        return NULL;
+
+    if (parse_timeout(timeout_obj, &timeout) != 0)
+        goto error;
+
+    if (parse_token(token_obj, &token) != 0)
+        goto error;
+
+    if (data.len > self->capacity) {
+        PyErr_SetString(PyExc_ValueError, "data is larger than ring capacity");
+        goto error;
+    }
+
+    if (ring_wait_writable(self, data.len, timeout, token) != 0)
+        goto error;
+
+    /* Copy the data in up to 2 parts, wrapping around the end. */
+    tail = ring_tail(self);
+    n = Py_MIN(data.len, self->capacity - tail);
+    memcpy(self->buf + tail, data.buf, n);
+    memcpy(self->buf, (char *)data.buf + n, data.len - n);
+    self->len += data.len;
+
+    PyBuffer_Release(&data);
+
+    if (ring_wake_reader(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+
+error:
+    PyBuffer_Release(&data);
+    return NULL;
+}
+
+PyDoc_STRVAR(ring_write_doc,
+"write(data, timeout=None, token=None)\n\
+\n\
+Copy data, any object supporting the buffer protocol, to the ring, blocking\n\
+until there is enough free space. Data is written entirely or not at all.\n\
+Raises Timeout if there is not enough space within timeout seconds, or\n\
+ChannelClosed if the ring is closed.");
+
+static PyObject *
+ring_read_into(ringobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"buffer", "timeout", "token", NULL};
+    Py_buffer buffer;
+    PyObject *timeout_obj = Py_None;
+    PyObject *token_obj = Py_None;
+    tokenobj *token;
+    double timeout;
+    Py_ssize_t size;
+    Py_ssize_t n;
+    int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|OO:read_into", kwlist,
+                                     &buffer, &timeout_obj, &token_obj))
+        return NULL;
+
+    if (parse_timeout(timeout_obj, &timeout) != 0)
+        goto error;
+
+    if (parse_token(token_obj, &token) != 0)
+        goto error;
+
+    r = ring_wait_readable(self, timeout, token);
+    if (r < 0)
+        goto error;
+
+    /* Copy the data in up to 2 parts, wrapping around the end. */
+    size = r ? Py_MIN(buffer.len, self->len) : 0;
+    n = Py_MIN(size, self->capacity - self->head);
+    memcpy(buffer.buf, self->buf + self->head, n);
+    memcpy((char *)buffer.buf + n, self->buf, size - n);
+    ring_advance(self, size);
+
+    PyBuffer_Release(&buffer);
+
+    if (size > 0 && ring_wake_writers(self) != 0)
+        return NULL;
+
+    if (ring_wake_reader(self) != 0)
+        return NULL;
+
+    return PyInt_FromSsize_t(size);
+
+error:
+    PyBuffer_Release(&buffer);
+    return NULL;
+}
+
+PyDoc_STRVAR(ring_read_into_doc,
+"read_into(buffer, timeout=None, token=None) -> int\n\
+\n\
+Copy up to len(buffer) bytes from the ring into buffer, blocking until data\n\
+is available. Returns the number of bytes read, or 0 if the ring is closed\n\
+and empty. Raises Timeout if no data is available within timeout seconds.");
+
+static PyObject *
+ring_reserve(ringobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "timeout", "token", NULL};
+    PyObject *size_obj = Py_None;
+    Py_ssize_t size;
+    PyObject *timeout_obj = Py_None;
+    PyObject *token_obj = Py_None;
+    tokenobj *token;
+    double timeout;
+    Py_ssize_t tail;
+    Py_ssize_t avail;
+    PyObject *region;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO:reserve", kwlist,
+                                     &size_obj, &timeout_obj, &token_obj))
+        return NULL;
+
+    if (ring_parse_size(size_obj, &size) != 0)
+        return NULL;
+
+    if (parse_timeout(timeout_obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    if (ring_wait_writable(self, 1, timeout, token) != 0)
+        return NULL;
+
+    /* The region ends at the end of the buffer or at the first unread byte. */
+    tail = ring_tail(self);
+    avail = tail < self->head ? self->head - tail : self->capacity - tail;
+    if (size == -1 || size > avail)
+        size = avail;
+
+    region = ring_region(self, tail, size, 0);
+    if (region == NULL)
+        return NULL;
+
+    self->reserved = size;
+
+    return region;
+}
+
+PyDoc_STRVAR(ring_reserve_doc,
+"reserve(size=None, timeout=None, token=None) -> memoryview\n\
+\n\
+Reserve a writable region of up to size bytes, or all contiguous free space\n\
+if size is None, blocking until some space is free. The region may be\n\
+smaller than size when free space wraps around the end of the ring. Fill\n\
+the region and call commit() to make the data available to readers.");
+
+static PyObject *
+ring_commit(ringobj *self, PyObject *args)
+{
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTuple(args, "n:commit", &size))
+        return NULL;
+
+    if (!self->reserved) {
+        PyErr_SetString(PyExc_RuntimeError, "no region reserved");
+        return NULL;
+    }
+
+    if (size < 0 || size > self->reserved) {
+        PyErr_SetString(PyExc_ValueError, "size out of reserved region");
+        return NULL;
+    }
+
+    self->len += size;
+    self->reserved = 0;
+
+    if (ring_wake_writers(self) != 0)
+        return NULL;
+
+    if (ring_wake_reader(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ring_commit_doc,
+"commit(size)\n\
+\n\
+Make the first size bytes of the reserved region available to readers and\n\
+release the reservation. Use size=0 to cancel the reservation.");
+
+static PyObject *
+ring_peek(ringobj *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "timeout", "token", NULL};
+    PyObject *size_obj = Py_None;
+    Py_ssize_t size;
+    PyObject *timeout_obj = Py_None;
+    PyObject *token_obj = Py_None;
+    tokenobj *token;
+    double timeout;
+    Py_ssize_t avail;
+    PyObject *region;
+    int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO:peek", kwlist,
+                                     &size_obj, &timeout_obj, &token_obj))
+        return NULL;
+
+    if (ring_parse_size(size_obj, &size) != 0)
+        return NULL;
+
+    if (parse_timeout(timeout_obj, &timeout) != 0)
+        return NULL;
+
+    if (parse_token(token_obj, &token) != 0)
+        return NULL;
+
+    r = ring_wait_readable(self, timeout, token);
+    if (r < 0)
+        return NULL;
+
+    /* The region ends at the end of the buffer or at the last unread byte. */
+    avail = r ? Py_MIN(self->len, self->capacity - self->head) : 0;
+    if (size == -1 || size > avail)
+        size = avail;
+
+    region = ring_region(self, self->head, size, 1);
+    if (region == NULL)
+        return NULL;
+
+    self->peeked = size;
+
+    return region;
+}
+
+PyDoc_STRVAR(ring_peek_doc,
+"peek(size=None, timeout=None, token=None) -> memoryview\n\
+\n\
+Return a read only region of up to size bytes, or all contiguous readable\n\
+data if size is None, blocking until data is available. Returns an empty\n\
+region if the ring is closed and empty. Call consume() when done with the\n\
+region.");
+
+static PyObject *
+ring_consume(ringobj *self, PyObject *args)
+{
+    Py_ssize_t size;
+
+    if (!PyArg_ParseTuple(args, "n:consume", &size))
+        return NULL;
+
+    if (size < 0 || size > self->peeked) {
+        PyErr_SetString(PyExc_ValueError, "size out of peeked region");
+        return NULL;
+    }
+
+    ring_advance(self, size);
+    self->peeked = 0;
+
+    if (size > 0 && ring_wake_writers(self) != 0)
+        return NULL;
+
+    if (ring_wake_reader(self) != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ring_consume_doc,
+"consume(size)\n\
+\n\
+Remove the first size bytes of the peeked region from the ring, and release\n\
+the region. Use size=0 to keep the data for the next reader.");
+
+static PyObject *
+ring_close(ringobj *self)
+{
+    if (!self->closed) {
+        self->closed = 1;
+
+        if (ring_wake_writers(self) != 0)
+            return NULL;
+
+        if (self->readers.first != NULL &&
+                waitq_wake(&self->readers, self->readers.count) < 0)
+            return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ring_close_doc,
+"close()\n\
+\n\
+Close the ring. Writers raise ChannelClosed, and readers get the remaining\n\
+data and then end of file.");
+
+static PyObject *
+ring_get_capacity(ringobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->capacity);
+}
+
+static PyObject *
+ring_get_available(ringobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->len);
+}
+
+static PyObject *
+ring_get_free(ringobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->capacity - self->len);
+}
+
+static PyObject *
+ring_get_closed(ringobj *self, void *closure)
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyObject *
+ring_get_waiters(ringobj *self, void *closure)
+{
+    return PyInt_FromLong(self->readers.count + self->writers.count);
+}
+
+static PyMethodDef ring_methods[] = {
+    {"write", (PyCFunction)ring_write, METH_VARARGS | METH_KEYWORDS,
+     ring_write_doc},
+    {"read_into", (PyCFunction)ring_read_into, METH_VARARGS | METH_KEYWORDS,
+     ring_read_into_doc},
+    {"reserve", (PyCFunction)ring_reserve, METH_VARARGS | METH_KEYWORDS,
+     ring_reserve_doc},
+    {"commit", (PyCFunction)ring_commit, METH_VARARGS, ring_commit_doc},
+    {"peek", (PyCFunction)ring_peek, METH_VARARGS | METH_KEYWORDS,
+     ring_peek_doc},
+    {"consume", (PyCFunction)ring_consume, METH_VARARGS, ring_consume_doc},
+    {"close", (PyCFunction)ring_close, METH_NOARGS, ring_close_doc},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef ring_getset[] = {
+    {"capacity", (getter)ring_get_capacity, NULL, NULL, NULL},
+    {"available", (getter)ring_get_available, NULL, NULL, NULL},
+    {"free", (getter)ring_get_free, NULL, NULL, NULL},
+    {"closed", (getter)ring_get_closed, NULL, NULL, NULL},
+    {"waiters", (getter)ring_get_waiters, NULL,
+     "Number of threads blocked reading from or writing to the ring", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ByteRingType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                          /* ob_size */
+    "_cthreading.ByteRing",     /* tp_name */
+    sizeof(ringobj),            /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)ring_dealloc,   /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    0,                          /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    ring_doc,                   /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    offsetof(ringobj, weakrefs),    /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    ring_methods,               /* tp_methods */
+    0,                          /* tp_members */
+    ring_getset,                /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    0,                          /* tp_init */
+    0,                          /* tp_alloc */
+    ring_new,                   /* tp_new */
+};
+
+/* Scheduler object
+ *
+ * Calls are kept in a binary min-heap ordered by their monotonic due time.
+ * Each call records its heap index, so cancel() removes it in O(log n). A
+ * single dispatch thread, started on the first call, sleeps on a semaphore
+ * until the first call is due; scheduling an earlier call wakes it.
+ *
+ * Scheduled calls keep a reference to the scheduler, and the dispatch thread
+ * keeps a reference while running, so a scheduler lives until shutdown().
+ *
+ * Callbacks often reference their call, for example a bound method of an
+ * object keeping the call. One-shot calls drop the function and arguments
+ * when invoked, and cancel() drops them for any call; calls dispatched but
+ * never invoked are collected by the garbage collector. */
+
+typedef struct schedobj schedobj;
+
+typedef struct {
+    PyObject_HEAD
+    schedobj *sched;        /* Set while the call is scheduled */
+    Py_ssize_t index;       /* Index in the heap, or -1 */
+    double when;            /* Monotonic time the call is due */
+    double interval;        /* Seconds between periodic calls, or 0 */
+    int cancelled;
+    PyObject *func;         /* NULL after invoking a one-shot call or cancel */
+    PyObject *args;
+    PyObject *kwargs;
+} callobj;
+
+struct schedobj {
+    PyObject_HEAD
+    callobj **heap;
+    Py_ssize_t len;
+    Py_ssize_t allocated;
+    PyObject *dispatch;     /* Callable receiving due calls, or NULL */
+    sem_t wakeup;
+    int sleeping;           /* Dispatch thread waits on wakeup */
+    int started;
+    int stopped;
+    PyObject *weakrefs;
+};
+
+static PyTypeObject ScheduledCallType;
+
+/* Heap helpers. The heap owns a reference to each call. */
+
+static void
+heap_set(schedobj *self, Py_ssize_t i, callobj *call)
+{
+    self->heap[i] = call;
+    call->index = i;
+}
+
+static void
+heap_sift_up(schedobj *self, Py_ssize_t i)
+{
+    callobj *call = self->heap[i];
+
+    while (i > 0) {
+        Py_ssize_t parent = (i - 1) / 2;
+        if (self->heap[parent]->when <= call->when)
+            break;
+        heap_set(self, i, self->heap[parent]);
+        i = parent;
+    }
+
+    heap_set(self, i, call);
+}
+
+static void
+heap_sift_down(schedobj *self, Py_ssize_t i)
+{
+    callobj *call = self->heap[i];
+
+    for (;;) {
+        Py_ssize_t child = 2 * i + 1;
+        if (child >= self->len)
+            break;
+        if (child + 1 < self->len &&
+                self->heap[child + 1]->when < self->heap[child]->when)
+            child++;
+        if (call->when <= self->heap[child]->when)
+            break;
+        heap_set(self, i, self->heap[child]);
+        i = child;
+    }
+
+    heap_set(self, i, call);
+}
+
+static int
+heap_push(schedobj *self, callobj *call)
+{
+    if (self->len == self->allocated) {
+        Py_ssize_t allocated = self->allocated ? self->allocated * 2 : 16;
+        callobj **heap = self->heap;
 
-    if (acquire_parse_args(args, kwds, &timeout))
-        return NULL;
+        PyMem_Resize(heap, callobj *, allocated);
+        if (heap == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
 
-    res = acquire_lock(&self->sem, timeout);
-    if (res == ACQUIRE_ERROR)
-        return NULL;
+        self->heap = heap;
+        self->allocated = allocated;
+    }
 
-    if (res == ACQUIRE_OK)
-        self->owner = PyThread_get_thread_ident();
+    Py_INCREF(call);
+    heap_set(self, self->len++, call);
+    heap_sift_up(self, call->index);
 
-    return PyBool_FromLong(res == ACQUIRE_OK);
+    return 0;
 }
 
-static PyObject *
-lock_release(lockobj *self, PyObject *args)
+/* Remove the call at index i, returning the heap reference. */
+static callobj *
+heap_remove(schedobj *self, Py_ssize_t i)
 {
-    int err;
+    callobj *call = self->heap[i];
+    callobj *last = self->heap[--self->len];
 
-    /* Sanity check: the lock must be locked */
-    if (self->owner == 0) {
-        PyErr_SetString(ThreadError, "release unlocked lock");
-        return NULL;
+    call->index = -1;
+
+    if (last != call) {
+        heap_set(self, i, last);
+        if (i > 0 && self->heap[(i - 1) / 2]->when > last->when)
+            heap_sift_up(self, i);
+        else
+            heap_sift_down(self, i);
     }
 
-    err = release_lock(&self->sem);
-    if (err != 0)
-        return NULL;
+    return call;
+}
 
-    self->owner = 0;
+/* ScheduledCall object, returned by the Scheduler call methods */
 
-    Py_RETURN_NONE;
+static int
+call_traverse(callobj *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->func);
+    Py_VISIT(self->args);
+    Py_VISIT(self->kwargs);
+    return 0;
 }
 
-static PyObject *
-lock_locked(lockobj *self)
+static int
+call_clear(callobj *self)
 {
-    return PyBool_FromLong(self->owner);
+    Py_CLEAR(self->func);
+    Py_CLEAR(self->args);
+    Py_CLEAR(self->kwargs);
+    return 0;
 }
 
-static PyObject *
-lock_is_owned(lockobj *self)
+static void
+call_dealloc(callobj *self)
 {
-    long tid = PyThread_get_thread_ident();
-    return PyBool_FromLong(self->owner == tid);
+    assert(self->sched == NULL);
+
+    PyObject_GC_UnTrack(self);
+    call_clear(self);
+
+    PyObject_GC_Del(self);
 }
 
+/* Invoke the call, doing nothing if it was cancelled or is a one-shot call
+ * that was already invoked. */
 static PyObject *
-lock_acquire_restore(lockobj *self, PyObject *args)
+call_invoke(callobj *self)
 {
-    PyObject *ignored;
-    acquire_result res;
+    PyObject *func = self->func;
+    PyObject *args = self->args;
+    PyObject *kwargs = self->kwargs;
+    PyObject *r;
 
-    /* Require one argument to keep the same interface as rlockobj. */
-    if (!PyArg_ParseTuple(args, "O:_acquire_restore", &ignored))
+    if (self->cancelled || func == NULL)
+        Py_RETURN_NONE;
+
+    /* Periodic calls keep the function; cancel() from the callback may
+     * drop it while it runs. */
+    if (self->interval > 0) {
+        Py_INCREF(func);
+        Py_INCREF(args);
+        Py_XINCREF(kwargs);
+    } else {
+        self->func = NULL;
+        self->args = NULL;
+        self->kwargs = NULL;
+    }
+
+    r = PyObject_Call(func, args, kwargs);
+
+    Py_DECREF(func);
+    Py_DECREF(args);
+    Py_XDECREF(kwargs);
+
+    return r;
+}
+
+static PyObject *
+call_call(callobj *self, PyObject *args, PyObject *kwds)
+{
+    if (!_PyArg_NoKeywords("ScheduledCall()", kwds))
         return NULL;
 
-    /* May block forever but cannot fail unless the underlying sem_wait call
-     * fails (unlikely). */
-    res = acquire_lock(&self->sem, -1);
-    if (res == ACQUIRE_ERROR)
+    if (!PyArg_ParseTuple(args, ":ScheduledCall"))
         return NULL;
 
-    assert(res == ACQUIRE_OK);
-    assert(self->owner == 0);
+    return call_invoke(self);
+}
 
-    self->owner = PyThread_get_thread_ident();
+/* Remove the call from its scheduler, dropping the reference cycle between
+ * the call and the scheduler. */
+static void
+call_unschedule(callobj *self)
+{
+    schedobj *sched = self->sched;
+    callobj *ref = NULL;
+
+    if (sched == NULL)
+        return;
+
+    /* Dropping the heap reference may deallocate the call. */
+    self->sched = NULL;
+
+    if (self->index >= 0)
+        ref = heap_remove(sched, self->index);
+
+    Py_DECREF(sched);
+    Py_XDECREF(ref);
+}
+
+static PyObject *
+call_cancel(callobj *self)
+{
+    self->cancelled = 1;
+    call_unschedule(self);
+    call_clear(self);
 
     Py_RETURN_NONE;
 }
 
-static PyMethodDef lock_methods[] = {
-    {"acquire", (PyCFunction)lock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"__enter__", (PyCFunction)lock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"release", (PyCFunction)lock_release, METH_VARARGS, NULL},
-    {"__exit__", (PyCFunction)lock_release, METH_VARARGS, NULL},
-    {"locked", (PyCFunction)lock_locked, METH_NOARGS, NULL},
-    {"_is_owned", (PyCFunction)lock_is_owned, METH_NOARGS, NULL},
-    {"_release_save", (PyCFunction)lock_release, METH_VARARGS, NULL},
-    {"_acquire_restore", (PyCFunction)lock_acquire_restore, METH_VARARGS, NULL},
+PyDoc_STRVAR(call_cancel_doc,
+"cancel()\n\
+\n\
+Cancel the call. A periodic call is not called again. Does nothing if the\n\
+call was already called or cancelled.");
+
+static PyObject *
+call_get_when(callobj *self, void *closure)
+{
+    return PyFloat_FromDouble(self->when);
+}
+
+static PyObject *
+call_get_interval(callobj *self, void *closure)
+{
+    if (self->interval == 0)
+        Py_RETURN_NONE;
+
+    return PyFloat_FromDouble(self->interval);
+}
+
+static PyObject *
+call_get_cancelled(callobj *self, void *closure)
+{
+    return PyBool_FromLong(self->cancelled);
+}
+
+static PyMethodDef call_methods[] = {
+    {"cancel", (PyCFunction)call_cancel, METH_NOARGS, call_cancel_doc},
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject LockType = {
+static PyGetSetDef call_getset[] = {
+    {"when", (getter)call_get_when, NULL, NULL, NULL},
+    {"interval", (getter)call_get_interval, NULL, NULL, NULL},
+    {"cancelled", (getter)call_get_cancelled, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ScheduledCallType = {
     PyObject_HEAD_INIT(NULL)
     0,                          /* ob_size */
-    "_cthreading.Lock",         /* tp_name */
-    sizeof(lockobj),            /* tp_basicsize */
+    "_cthreading.ScheduledCall",    /* tp_name */
+    sizeof(callobj),            /* tp_basicsize */
     0,                          /* tp_itemsize */
-    (destructor)lock_dealloc,   /* tp_dealloc */
+    (destructor)call_dealloc,   /* tp_dealloc */
     0,                          /* tp_print */
     0,                          /* tp_getattr */
     0,                          /* tp_setattr */
@@ -362,22 +6583,22 @@ static PyTypeObject LockType = {
     0,                          /* tp_as_sequence */
     0,                          /* tp_as_mapping */
     0,                          /* tp_hash */
-    0,                          /* tp_call */
+    (ternaryfunc)call_call,     /* tp_call */
     0,                          /* tp_str */
     0,                          /* tp_getattro */
     0,                          /* tp_setattro */
     0,                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,         /* tp_flags */
-    lock_doc,                   /* tp_doc */
-    0,                          /* tp_traverse */
-    0,                          /* tp_clear */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                          /* tp_doc */
+    (traverseproc)call_traverse,    /* tp_traverse */
+    (inquiry)call_clear,        /* tp_clear */
     0,                          /* tp_richcompare */
-    offsetof(lockobj, weakrefs),   /* tp_weaklistoffset */
+    0,                          /* tp_weaklistoffset */
     0,                          /* tp_iter */
     0,                          /* tp_iternext */
-    lock_methods,               /* tp_methods */
+    call_methods,               /* tp_methods */
     0,                          /* tp_members */
-    0,                          /* tp_getset */
+    call_getset,                /* tp_getset */
     0,                          /* tp_base */
     0,                          /* tp_dict */
     0,                          /* tp_descr_get */
@@ -385,200 +6606,409 @@ static PyTypeObject LockType = {
     0,                          /* tp_dictoffset */
     0,                          /* tp_init */
     0,                          /* tp_alloc */
-    lock_new,                   /* tp_new */
+    0,                          /* tp_new */
 };
 
-/* RLock object */
-
-typedef struct {
-    PyObject_HEAD
-    sem_t sem;
-    long owner;
-    unsigned long count;
-    PyObject *weakrefs;
-} rlockobj;
-
-PyDoc_STRVAR(rlock_doc,
-"RLock()");
+PyDoc_STRVAR(sched_doc,
+"Scheduler(dispatch=None)\n\
+\n\
+Call functions at a later time from a single dispatch thread. If dispatch\n\
+is None, functions are called in the dispatch thread, and must not block.\n\
+Otherwise due calls are passed to dispatch(call), for example the send()\n\
+method of a Channel read by worker threads, which should invoke call().\n\
+Invoking a cancelled call, or a one-shot call again, does nothing. Call\n\
+shutdown() when the scheduler is not needed.");
 
 static PyObject *
-rlock_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+sched_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    rlockobj *self;
-    int err;
+    schedobj *self;
+    PyObject *dispatch = Py_None;
+    static char *kwlist[] = {"dispatch", NULL};
 
-    self = (rlockobj *)type->tp_alloc(type, 0);
-    if (self == NULL)
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:Scheduler", kwlist,
+                                     &dispatch))
         return NULL;
 
-    /* First initialize all fields so rlock_dealloc does the right thing if
-     * initializing the semaphore fails. */
-    self->owner = 0;
-    self->count = 0;
-    self->weakrefs = NULL;
+    if (dispatch != Py_None && !PyCallable_Check(dispatch)) {
+        PyErr_SetString(PyExc_TypeError, "dispatch must be callable");
+        return NULL;
+    }
 
-    err = sem_init(&self->sem, 0, 1);
-    if (err) {
+    self = (schedobj *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    if (sem_init(&self->wakeup, 0, 0) != 0) {
         int saved_errno = errno;
-        Py_CLEAR(self);
+        PyObject_Del(self);
         set_error(saved_errno, "sem_init");
         return NULL;
     }
 
+    if (dispatch == Py_None)
+        dispatch = NULL;
+
+    Py_XINCREF(dispatch);
+    self->dispatch = dispatch;
+    self->heap = NULL;
+    self->len = 0;
+    self->allocated = 0;
+    self->sleeping = 0;
+    self->started = 0;
+    self->stopped = 0;
+    self->weakrefs = NULL;
+
     return (PyObject *)self;
 }
 
 static void
-rlock_dealloc(rlockobj *self)
+sched_dealloc(schedobj *self)
 {
+    /* Scheduled calls and the dispatch thread keep a reference. */
+    assert(self->len == 0);
+
     if (self->weakrefs)
         PyObject_ClearWeakRefs((PyObject *) self);
 
-    /* This must not be called when other threads are waiting on the semaphore
-     * in sem_wait(). We rely on the reference counting machanisim to call this
-     * only when no object has a reference to the lockobj object. */
-    sem_destroy(&self->sem);
+    sem_destroy(&self->wakeup);
+    PyMem_Free(self->heap);
+    Py_CLEAR(self->dispatch);
 
     PyObject_Del(self);
 }
 
-static PyObject *
-rlock_acquire(rlockobj *self, PyObject *args, PyObject *kwds)
+/* Wake the dispatch thread if it is sleeping. */
+static int
+sched_wake(schedobj *self)
+{
+    if (!self->sleeping)
+        return 0;
+
+    self->sleeping = 0;
+
+    return release_lock(NULL, &self->wakeup);
+}
+
+/* Remove and invoke the first call, rescheduling periodic calls first, so
+ * the callback can cancel them. */
+static void
+sched_fire(schedobj *self, double now)
+{
+    callobj *call = heap_remove(self, 0);
+    PyObject *r;
+
+    if (call->interval > 0) {
+        /* Skip missed runs instead of running them in a burst. */
+        call->when += call->interval;
+        if (call->when <= now)
+            call->when = now + call->interval;
+
+        if (heap_push(self, call) != 0) {
+            PyErr_WriteUnraisable((PyObject *)call);
+            call_unschedule(call);
+        }
+    } else {
+        call_unschedule(call);
+    }
+
+    if (self->dispatch)
+        r = PyObject_CallFunctionObjArgs(self->dispatch, call, NULL);
+    else
+        r = call_invoke(call);
+
+    if (r == NULL)
+        PyErr_WriteUnraisable((PyObject *)call);
+
+    Py_XDECREF(r);
+    Py_DECREF(call);
+}
+
+static void
+sched_run(schedobj *self)
 {
-    double timeout;
-    long tid;
     acquire_result res;
+    double timeout;
+    double now;
+
+    while (!self->stopped) {
+        if (self->len > 0) {
+            now = monotonic_time();
+            if (self->heap[0]->when <= now) {
+                sched_fire(self, now);
+                continue;
+            }
+            timeout = self->heap[0]->when - now;
+        } else {
+            timeout = UNLIMITED;
+        }
 
-    if (acquire_parse_args(args, kwds, &timeout))
-        return NULL;
+        /* A wakeup posted after we timed out is consumed by the next wait,
+         * causing one extra loop. */
+        self->sleeping = 1;
+        res = acquire_lock(NULL, &self->wakeup, NULL, timeout);
+        self->sleeping = 0;
 
-    tid = PyThread_get_thread_ident();
-    if (self->count > 0 && self->owner == tid) {
-        unsigned long count = self->count + 1;
-        if (count <= self->count) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "Internal lock count overflowed");
-            return NULL;
+        if (res == ACQUIRE_ERROR) {
+            PyErr_WriteUnraisable((PyObject *)self);
+            break;
+        }
+    }
+}
+
+static void
+sched_bootstrap(void *arg)
+{
+    schedobj *self = arg;
+    PyGILState_STATE state;
+
+    state = PyGILState_Ensure();
+
+    sched_run(self);
+    Py_DECREF(self);
+
+    PyGILState_Release(state);
+}
+
+/* Add call to the heap, starting the dispatch thread on the first call. */
+static int
+sched_add(schedobj *self, callobj *call)
+{
+    if (self->stopped) {
+        PyErr_SetString(PyExc_RuntimeError, "scheduler is shut down");
+        return -1;
+    }
+
+    if (!self->started) {
+        PyEval_InitThreads();
+
+        Py_INCREF(self);
+        if (PyThread_start_new_thread(sched_bootstrap, self) == -1) {
+            Py_DECREF(self);
+            PyErr_SetString(ThreadError, "can't start new thread");
+            return -1;
         }
 
-        self->count = count;
-        Py_RETURN_TRUE;
+        self->started = 1;
     }
 
-    res = acquire_lock(&self->sem, timeout);
-    if (res == ACQUIRE_ERROR)
+    if (heap_push(self, call) != 0)
+        return -1;
+
+    Py_INCREF(self);
+    call->sched = self;
+
+    return call->index == 0 ? sched_wake(self) : 0;
+}
+
+/* Create a call from (number, func, *args) and **kwargs, storing the number
+ * in number. */
+static callobj *
+sched_parse_call(PyObject *args, PyObject *kwds, const char *name,
+                 double *number)
+{
+    Py_ssize_t size = PyTuple_GET_SIZE(args);
+    PyObject *func;
+    callobj *call;
+
+    if (size < 2) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes at least 2 arguments (%zd given)",
+                     name, size);
         return NULL;
+    }
 
-    if (res == ACQUIRE_OK) {
-        assert(self->count == 0);
-        self->owner = tid;
-        self->count = 1;
+    *number = PyFloat_AsDouble(PyTuple_GET_ITEM(args, 0));
+    if (*number == -1 && PyErr_Occurred())
+        return NULL;
+
+    if (Py_IS_NAN(*number)) {
+        PyErr_Format(PyExc_ValueError, "%s() time is NaN", name);
+        return NULL;
     }
 
-    return PyBool_FromLong(res == ACQUIRE_OK);
+    func = PyTuple_GET_ITEM(args, 1);
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "func must be callable");
+        return NULL;
+    }
+
+    call = PyObject_GC_New(callobj, &ScheduledCallType);
+    if (call == NULL)
+        return NULL;
+
+    call->sched = NULL;
+    call->index = -1;
+    call->when = 0;
+    call->interval = 0;
+    call->cancelled = 0;
+    Py_INCREF(func);
+    call->func = func;
+    call->args = PyTuple_GetSlice(args, 2, size);
+    call->kwargs = kwds ? PyDict_Copy(kwds) : NULL;
+
+    if (call->args == NULL || (kwds && call->kwargs == NULL)) {
+        Py_DECREF(call);
+        return NULL;
+    }
+
+    PyObject_GC_Track(call);
+
+    return call;
 }
 
 static PyObject *
-rlock_release(rlockobj *self, PyObject *args)
+sched_call_at(schedobj *self, PyObject *args, PyObject *kwds)
 {
-    long tid = PyThread_get_thread_ident();
+    callobj *call;
+    double when;
 
-    if (self->count == 0 || self->owner != tid) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "cannot release un-acquired lock");
+    call = sched_parse_call(args, kwds, "call_at", &when);
+    if (call == NULL)
         return NULL;
-    }
 
-    if (self->count > 1) {
-        --self->count;
-        Py_RETURN_NONE;
+    call->when = when;
+
+    if (sched_add(self, call) != 0) {
+        Py_DECREF(call);
+        return NULL;
     }
 
-    assert(self->count == 1);
-    if (release_lock(&self->sem) != 0)
+    return (PyObject *)call;
+}
+
+PyDoc_STRVAR(sched_call_at_doc,
+"call_at(when, func, *args, **kwargs) -> ScheduledCall\n\
+\n\
+Call func(*args, **kwargs) at time when, using the time() clock.");
+
+static PyObject *
+sched_call_later(schedobj *self, PyObject *args, PyObject *kwds)
+{
+    callobj *call;
+    double delay;
+
+    call = sched_parse_call(args, kwds, "call_later", &delay);
+    if (call == NULL)
         return NULL;
 
-    self->count = 0;
-    self->owner = 0;
+    call->when = monotonic_time() + delay;
 
-    Py_RETURN_NONE;
-}
+    if (sched_add(self, call) != 0) {
+        Py_DECREF(call);
+        return NULL;
+    }
 
-static PyObject *
-rlock_is_owned(rlockobj *self)
-{
-    long tid = PyThread_get_thread_ident();
-    return PyBool_FromLong(self->count > 0 && self->owner == tid);
+    return (PyObject *)call;
 }
 
+PyDoc_STRVAR(sched_call_later_doc,
+"call_later(delay, func, *args, **kwargs) -> ScheduledCall\n\
+\n\
+Call func(*args, **kwargs) after delay seconds.");
+
 static PyObject *
-rlock_release_save(rlockobj *self)
+sched_call_every(schedobj *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *saved_state;
+    callobj *call;
+    double interval;
 
-    if (self->count == 0) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "cannot release un-acquired lock");
+    call = sched_parse_call(args, kwds, "call_every", &interval);
+    if (call == NULL)
         return NULL;
-    }
 
-    saved_state = Py_BuildValue("kl", self->count, self->owner);
-    if (saved_state == NULL)
+    if (interval <= 0) {
+        PyErr_SetString(PyExc_ValueError, "interval must be positive");
+        Py_DECREF(call);
         return NULL;
+    }
 
-    if (release_lock(&self->sem) != 0)
+    call->interval = interval;
+    call->when = monotonic_time() + interval;
+
+    if (sched_add(self, call) != 0) {
+        Py_DECREF(call);
         return NULL;
+    }
 
-    self->count = 0;
-    self->owner = 0;
+    return (PyObject *)call;
+}
 
-    return saved_state;
+PyDoc_STRVAR(sched_call_every_doc,
+"call_every(interval, func, *args, **kwargs) -> ScheduledCall\n\
+\n\
+Call func(*args, **kwargs) every interval seconds until cancelled. If a\n\
+call is late by more than interval, missed calls are skipped.");
+
+static PyObject *
+sched_time(schedobj *self)
+{
+    return PyFloat_FromDouble(monotonic_time());
 }
 
+PyDoc_STRVAR(sched_time_doc,
+"time() -> float\n\
+\n\
+Return the current time of the scheduler monotonic clock.");
+
 static PyObject *
-rlock_acquire_restore(rlockobj *self, PyObject *args)
+sched_shutdown(schedobj *self)
 {
-    unsigned long count;
-    long owner;
-    acquire_result res;
+    if (self->stopped)
+        Py_RETURN_NONE;
 
-    if (!PyArg_ParseTuple(args, "(kl):_acquire_restore", &count, &owner))
-        return NULL;
+    self->stopped = 1;
 
-    /* May block forever but cannot fail unless the underlying sem_wait call
-     * fails (unlikely). */
-    res = acquire_lock(&self->sem, -1);
-    if (res == ACQUIRE_ERROR)
+    while (self->len > 0) {
+        callobj *call = self->heap[self->len - 1];
+        call->cancelled = 1;
+        call_clear(call);
+        call_unschedule(call);
+    }
+
+    if (sched_wake(self) != 0)
         return NULL;
 
-    assert(res == ACQUIRE_OK);
-    assert(self->owner == 0);
-    assert(self->count == 0);
+    Py_RETURN_NONE;
+}
 
-    self->owner = owner;
-    self->count = count;
+PyDoc_STRVAR(sched_shutdown_doc,
+"shutdown()\n\
+\n\
+Cancel all scheduled calls and stop the dispatch thread. A running call\n\
+is completed.");
 
-    Py_RETURN_NONE;
+static PyObject *
+sched_get_pending(schedobj *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->len);
 }
 
-static PyMethodDef rlock_methods[] = {
-    {"acquire", (PyCFunction)rlock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"__enter__", (PyCFunction)rlock_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"release", (PyCFunction)rlock_release, METH_VARARGS, NULL},
-    {"__exit__", (PyCFunction)rlock_release, METH_VARARGS, NULL},
-    {"_is_owned", (PyCFunction)rlock_is_owned, METH_NOARGS, NULL},
-    {"_release_save", (PyCFunction)rlock_release_save, METH_NOARGS, NULL},
-    {"_acquire_restore", (PyCFunction)rlock_acquire_restore, METH_VARARGS, NULL},
+static PyMethodDef sched_methods[] = {
+    {"call_at", (PyCFunction)sched_call_at, METH_VARARGS | METH_KEYWORDS,
+     sched_call_at_doc},
+    {"call_later", (PyCFunction)sched_call_later,
+     METH_VARARGS | METH_KEYWORDS, sched_call_later_doc},
+    {"call_every", (PyCFunction)sched_call_every,
+     METH_VARARGS | METH_KEYWORDS, sched_call_every_doc},
+    {"time", (PyCFunction)sched_time, METH_NOARGS, sched_time_doc},
+    {"shutdown", (PyCFunction)sched_shutdown, METH_NOARGS,
+     sched_shutdown_doc},
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject RLockType = {
+static PyGetSetDef sched_getset[] = {
+    {"pending", (getter)sched_get_pending, NULL, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject SchedulerType = {
     PyObject_HEAD_INIT(NULL)
     0,                          /* ob_size */
-    "_cthreading.RLock",        /* tp_name */
-    sizeof(rlockobj),           /* tp_basicsize */
+    "_cthreading.Scheduler",    /* tp_name */
+    sizeof(schedobj),           /* tp_basicsize */
     0,                          /* tp_itemsize */
-    (destructor)rlock_dealloc,  /* tp_dealloc */
+    (destructor)sched_dealloc,  /* tp_dealloc */
     0,                          /* tp_print */
     0,                          /* tp_getattr */
     0,                          /* tp_setattr */
@@ -594,16 +7024,16 @@ static PyTypeObject RLockType = {
     0,                          /* tp_setattro */
     0,                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT,         /* tp_flags */
-    rlock_doc,                  /* tp_doc */
+    sched_doc,                  /* tp_doc */
     0,                          /* tp_traverse */
     0,                          /* tp_clear */
     0,                          /* tp_richcompare */
-    offsetof(rlockobj, weakrefs),  /* tp_weaklistoffset */
+    offsetof(schedobj, weakrefs),   /* tp_weaklistoffset */
     0,                          /* tp_iter */
     0,                          /* tp_iternext */
-    rlock_methods,              /* tp_methods */
+    sched_methods,              /* tp_methods */
     0,                          /* tp_members */
-    0,                          /* tp_getset */
+    sched_getset,               /* tp_getset */
     0,                          /* tp_base */
     0,                          /* tp_dict */
     0,                          /* tp_descr_get */
@@ -611,414 +7041,441 @@ static PyTypeObject RLockType = {
     0,                          /* tp_dictoffset */
     0,                          /* tp_init */
     0,                          /* tp_alloc */
-    rlock_new,                  /* tp_new */
+    sched_new,                  /* tp_new */
 };
 
-/* waitq */
-
-#define WAITER_UNUSED ((struct waiter *) -1)
-
-struct waiter {
-    sem_t sem;
-    struct waiter *next;
-    struct waiter *prev;
-};
+/* C API
+ *
+ * Other extension modules can use Lock, RLock and Condition objects without
+ * calling Python methods; see cthreading_capi.h. */
 
 static int
-waiter_init(struct waiter *waiter)
+capi_check_type(PyObject *obj, PyTypeObject *type)
 {
-    waiter->next = waiter->prev = WAITER_UNUSED;
-
-    /* Initialize in blocked state */
-    if (sem_init(&waiter->sem, 0, 0) != 0) {
-        set_error(errno, "sem_init");
+    if (!PyObject_TypeCheck(obj, type)) {
+        PyErr_Format(PyExc_TypeError, "expected %s, got %s",
+                     type->tp_name, Py_TYPE(obj)->tp_name);
         return -1;
     }
 
     return 0;
 }
 
-static void
-waiter_destroy(struct waiter *waiter)
+static int
+capi_result(acquire_result res)
 {
-    assert(waiter->next == WAITER_UNUSED && waiter->prev == WAITER_UNUSED);
-    sem_destroy(&waiter->sem);
-}
-
-struct waitq {
-    struct waiter *first;
-    struct waiter *last;
-    int count;
-};
+    if (res == ACQUIRE_ERROR)
+        return -1;
 
-static void
-waitq_init(struct waitq *waitq)
-{
-    waitq->first = waitq->last = NULL;
-    waitq->count = 0;
+    return res == ACQUIRE_OK;
 }
 
-static void
-waitq_append(struct waitq *waitq, struct waiter *waiter)
+static int
+capi_lock_acquire(PyObject *lock, double timeout)
 {
-    assert(waiter->next == WAITER_UNUSED && waiter->prev == WAITER_UNUSED);
-
-    waiter->next = NULL;
-    waiter->prev = waitq->last;
-
-    if (waitq->last)
-        waitq->last->next = waiter;
-    else
-        waitq->first = waiter;
+    if (capi_check_type(lock, &LockType) != 0)
+        return -1;
 
-    waitq->last = waiter;
+    if (timeout < 0)
+        timeout = UNLIMITED;
 
-    waitq->count++;
+    return capi_result(lock_acquire_internal((lockobj *)lock, timeout, NULL));
 }
 
-static void
-waitq_remove(struct waitq *waitq, struct waiter *waiter)
+static int
+capi_lock_release(PyObject *lock)
 {
-    if (waiter->next == WAITER_UNUSED)
-        return;
-
-    if (waiter->prev)
-        waiter->prev->next = waiter->next;
-    else
-        waitq->first = waiter->next;
-
-    if (waiter->next)
-        waiter->next->prev = waiter->prev;
-    else
-        waitq->last = waiter->prev;
-
-    waiter->prev = waiter->next = WAITER_UNUSED;
+    if (capi_check_type(lock, &LockType) != 0)
+        return -1;
 
-    waitq->count--;
-    assert(waitq->count >= 0);
+    return lock_release_internal((lockobj *)lock);
 }
 
-/* Condition object */
+static int
+capi_rlock_acquire(PyObject *rlock, double timeout)
+{
+    if (capi_check_type(rlock, &RLockType) != 0)
+        return -1;
 
-typedef struct {
-    PyObject_HEAD
-    PyObject *lock;
-    PyObject *acquire;
-    PyObject *release;
-    PyObject *is_owned;
-    PyObject *release_save;
-    PyObject *acquire_restore;
-    struct waitq waiters;
-    PyObject *weakrefs;
-} condobj;
+    if (timeout < 0)
+        timeout = UNLIMITED;
 
-PyDoc_STRVAR(cond_doc,
-"Condition(lock=None)");
+    return capi_result(rlock_acquire_internal((rlockobj *)rlock, timeout,
+                                              NULL));
+}
 
 static int
-cond_init(condobj *self, PyObject *args, PyObject *kwds)
+capi_rlock_release(PyObject *rlock)
 {
-    PyObject *lock = Py_None;
-    PyObject *acquire = NULL;
-    PyObject *release = NULL;
-    PyObject *is_owned = NULL;
-    PyObject *release_save = NULL;
-    PyObject *acquire_restore = NULL;
-    PyObject *tmp = NULL;
-    static char *kwlist[] = {"lock", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &lock))
+    if (capi_check_type(rlock, &RLockType) != 0)
         return -1;
 
-    if (lock == Py_None) {
-        lock = PyObject_CallObject((PyObject *)&RLockType, NULL);
-        if (lock == NULL)
-            return -1;
-    } else {
-        Py_INCREF(lock);
-    }
-
-    tmp = self->lock;
-    self->lock = lock;
-    Py_CLEAR(tmp);
+    return rlock_release_internal((rlockobj *)rlock);
+}
 
-    acquire = PyObject_GetAttrString(self->lock, "acquire");
-    if (acquire == NULL)
+static int
+capi_cond_wait(PyObject *cond, double timeout)
+{
+    if (capi_check_type(cond, &ConditionType) != 0)
         return -1;
 
-    tmp = self->acquire;
-    self->acquire = acquire;
-    Py_CLEAR(tmp);
+    if (timeout < 0)
+        timeout = UNLIMITED;
 
-    release = PyObject_GetAttrString(self->lock, "release");
-    if (release == NULL)
-        return -1;
+    return capi_result(cond_wait_key((condobj *)cond, Py_None, timeout,
+                                     NULL));
+}
 
-    tmp = self->release;
-    self->release = release;
-    Py_CLEAR(tmp);
+static int
+capi_cond_notify(PyObject *cond, int n)
+{
+    PyObject *r;
 
-    is_owned = PyObject_GetAttrString(self->lock, "_is_owned");
-    if (is_owned == NULL)
+    if (capi_check_type(cond, &ConditionType) != 0)
         return -1;
 
-    tmp = self->is_owned;
-    self->is_owned = is_owned;
-    Py_CLEAR(tmp);
-
-    release_save = PyObject_GetAttrString(self->lock, "_release_save");
-    if (release_save == NULL)
+    r = cond_notify_waiters((condobj *)cond, Py_None, n);
+    if (r == NULL)
         return -1;
 
-    tmp = self->release_save;
-    self->release_save = release_save;
-    Py_CLEAR(tmp);
+    Py_DECREF(r);
+    return 0;
+}
 
-    acquire_restore = PyObject_GetAttrString(self->lock, "_acquire_restore");
-    if (acquire_restore == NULL)
-        return -1;
+static int
+capi_cond_notify_all(PyObject *cond)
+{
+    PyObject *r;
 
-    tmp = self->acquire_restore;
-    self->acquire_restore = acquire_restore;
-    Py_CLEAR(tmp);
+    if (capi_check_type(cond, &ConditionType) != 0)
+        return -1;
 
-    waitq_init(&self->waiters);
+    r = cond_notify_all_waiters((condobj *)cond);
+    if (r == NULL)
+        return -1;
 
+    Py_DECREF(r);
     return 0;
 }
 
-static void
-cond_dealloc(condobj *self)
+/* Acquire sem without the GIL. Returns 1 if acquired, 0 if timed out, or -1
+ * with errno set. */
+static int
+sem_acquire_nogil(sem_t *sem, double timeout)
 {
-    assert(self->waiters.first == NULL && self->waiters.last == NULL);
+    struct timespec deadline;
+    int err;
 
-    if (self->weakrefs)
-        PyObject_ClearWeakRefs((PyObject *) self);
+    if (timeout > 0)
+        deadline_from_timeout(timeout, &deadline);
 
-    Py_CLEAR(self->lock);
-    Py_CLEAR(self->acquire);
-    Py_CLEAR(self->release);
-    Py_CLEAR(self->is_owned);
-    Py_CLEAR(self->release_save);
-    Py_CLEAR(self->acquire_restore);
+    do {
+        if (timeout == 0)
+            err = sem_trywait(sem);
+        else if (timeout > 0)
+            err = sem_timedwait(sem, &deadline);
+        else
+            err = sem_wait(sem);
+    } while (err != 0 && errno == EINTR);
 
-    PyObject_Del(self);
-}
+    if (err == 0)
+        return 1;
 
-static PyObject *
-cond_release_save(condobj *self)
-{
-    return PyObject_CallObject(self->release_save, NULL);
-}
+    if ((timeout == 0 && errno == EAGAIN) ||
+        (timeout > 0 && errno == ETIMEDOUT))
+        return 0;
 
-static PyObject *
-cond_acquire_restore(condobj *self, PyObject *args)
-{
-    return PyObject_CallObject(self->acquire_restore, args);
+    return -1;
 }
 
-static acquire_result
-cond_wait_released(condobj *self, struct waiter *waiter, double timeout)
+/* Like wake_token_waiter(), for releasing without the GIL. The queue is
+ * checked without the GIL after posting; waiters try to acquire again after
+ * parking, so a waiter parked concurrently is not lost. */
+static int
+wake_token_waiter_nogil(struct waitq *waiters)
 {
-    PyObject *saved_state = NULL;
-    PyObject *r = NULL;
-    acquire_result res;
+    PyGILState_STATE state;
+    int r = 0;
 
-    saved_state = PyObject_CallObject(self->release_save, NULL);
-    if (saved_state == NULL)
-        return ACQUIRE_ERROR;
+    if (waiters->first == NULL)
+        return 0;
 
-    res = acquire_lock(&waiter->sem, timeout);
+    state = PyGILState_Ensure();
 
-    r = PyObject_CallFunctionObjArgs(self->acquire_restore, saved_state, NULL);
-    if (r == NULL)
-        res = ACQUIRE_ERROR;
+    if (wake_token_waiter(waiters) != 0) {
+        PyErr_Clear();
+        errno = EINVAL;
+        r = -1;
+    }
 
-    Py_CLEAR(saved_state);
-    Py_CLEAR(r);
+    PyGILState_Release(state);
 
-    return res;
+    return r;
 }
 
+/* Locks acquired without the GIL are not tracked by the watchdog, since
+ * tracking requires the GIL. Clearing the acquire time is enough to stop
+ * tracking; a stack kept from an earlier acquire is dropped by the next
+ * tracked acquire. */
+
 static int
-cond_is_owned_internal(condobj *self)
+capi_lock_acquire_nogil(PyObject *lock, double timeout)
 {
-    PyObject *r;
-    int is_owned;
+    lockobj *self = (lockobj *)lock;
+    int r;
 
-    r = PyObject_CallObject(self->is_owned, NULL);
-    is_owned = r == Py_True;
-    Py_CLEAR(r);
+    r = sem_acquire_nogil(&self->sem, timeout);
+    if (r == 1) {
+        self->owner = PyThread_get_thread_ident();
+        self->watch.acquired = 0;
+    }
 
-    return is_owned;
+    return r;
 }
 
-static PyObject *
-cond_notify_waiters(condobj *self, int count)
+static int
+capi_lock_release_nogil(PyObject *lock)
 {
-    int i;
+    lockobj *self = (lockobj *)lock;
+    long owner = self->owner;
 
-    if (!cond_is_owned_internal(self)) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "cannot notify un-acquired condition");
-        return NULL;
+    if (owner == 0) {
+        errno = EPERM;
+        return -1;
     }
 
-    for (i = 0; i < count && self->waiters.first != NULL; i++) {
-        struct waiter *waiter = self->waiters.first;
-        if (release_lock(&waiter->sem) != 0)
-            return NULL;
-        waitq_remove(&self->waiters, waiter);
+    self->owner = 0;
+
+    if (sem_post(&self->sem) != 0) {
+        self->owner = owner;
+        return -1;
     }
 
-    Py_RETURN_NONE;
+    return wake_token_waiter_nogil(&self->token_waiters);
 }
 
-static PyObject *
-cond_acquire(condobj *self, PyObject *args, PyObject *kwds)
+/* Biased locks are taken over from their reservation under the GIL, so the
+ * _nogil functions take the GIL for them, unless the caller already owns the
+ * lock. */
+
+static int
+capi_rlock_acquire_biased(rlockobj *self, double timeout)
 {
-    assert(args != NULL);
-    return PyObject_Call(self->acquire, args, kwds);
+    PyGILState_STATE state;
+    acquire_result res;
+
+    state = PyGILState_Ensure();
+
+    res = rlock_acquire_internal(self, timeout < 0 ? UNLIMITED : timeout,
+                                 NULL);
+    if (res == ACQUIRE_ERROR) {
+        errno = PyErr_ExceptionMatches(PyExc_OverflowError) ?
+            EOVERFLOW : EINVAL;
+        PyErr_Clear();
+    }
+
+    PyGILState_Release(state);
+
+    return capi_result(res);
 }
 
-static PyObject *
-cond_release(condobj *self, PyObject *args)
+static int
+capi_rlock_release_biased(rlockobj *self)
 {
-    return PyObject_CallObject(self->release, args);
+    PyGILState_STATE state;
+    int r;
+
+    state = PyGILState_Ensure();
+
+    r = rlock_release_internal(self);
+    if (r != 0) {
+        errno = EINVAL;
+        PyErr_Clear();
+    }
+
+    PyGILState_Release(state);
+
+    return r;
 }
 
 static int
-cond_wait_parse_args(PyObject *args, PyObject *kwds, double *timeout)
+capi_rlock_acquire_nogil(PyObject *rlock, double timeout)
 {
-    char *kwlist[] = {"timeout", "balancing", NULL};
-    PyObject *obj = Py_None;
-    PyObject *balancing = NULL; /* Unused */
+    rlockobj *self = (rlockobj *)rlock;
+    long tid = PyThread_get_thread_ident();
+    int r;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:wait", kwlist,
-                                     &obj, &balancing))
-        return -1;
+    /* Only the owner modifies the lock while it is owned. */
+    if (self->count > 0 && self->owner == tid) {
+        if (self->count + 1 == 0) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        self->count++;
+        return 1;
+    }
 
-    if (parse_timeout(obj, timeout) != 0)
-        return -1;
+    if (self->biased)
+        return capi_rlock_acquire_biased(self, timeout);
 
-    return 0;
+    r = sem_acquire_nogil(&self->sem, timeout);
+    if (r == 1) {
+        self->owner = tid;
+        self->count = 1;
+        self->watch.acquired = 0;
+    }
+
+    return r;
 }
 
-static PyObject *
-cond_wait(condobj *self, PyObject *args, PyObject *kwds)
+static int
+capi_rlock_release_nogil(PyObject *rlock)
 {
-    struct waiter waiter;
-    double timeout;
-    acquire_result res;
+    rlockobj *self = (rlockobj *)rlock;
+    long tid = PyThread_get_thread_ident();
 
-    if (cond_wait_parse_args(args, kwds, &timeout) != 0)
-        return NULL;
+    if (self->count == 0 || self->owner != tid) {
+        errno = EPERM;
+        return -1;
+    }
 
-    if (!cond_is_owned_internal(self)) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "cannot wait on un-acquired condition");
-        return NULL;
+    if (self->count > 1) {
+        self->count--;
+        return 0;
     }
 
-    if (waiter_init(&waiter) != 0)
-        return NULL;
+    if (self->biased)
+        return capi_rlock_release_biased(self);
 
-    waitq_append(&self->waiters, &waiter);
+    self->count = 0;
+    self->owner = 0;
 
-    res = cond_wait_released(self, &waiter, timeout);
+    if (sem_post(&self->sem) != 0) {
+        self->count = 1;
+        self->owner = tid;
+        return -1;
+    }
 
-    if (res != ACQUIRE_OK)
-        waitq_remove(&self->waiters, &waiter);
+    return wake_token_waiter_nogil(&self->token_waiters);
+}
 
-    waiter_destroy(&waiter);
+static CThreading_CAPI capi = {
+    CTHREADING_CAPI_VERSION,
+    &LockType,
+    &RLockType,
+    &ConditionType,
+    capi_lock_acquire,
+    capi_lock_release,
+    capi_rlock_acquire,
+    capi_rlock_release,
+    capi_cond_wait,
+    capi_cond_notify,
+    capi_cond_notify_all,
+    capi_lock_acquire_nogil,
+    capi_lock_release_nogil,
+    capi_rlock_acquire_nogil,
+    capi_rlock_release_nogil,
+};
 
-    if (res == ACQUIRE_ERROR)
-        return NULL;
+/* Module */
 
-    return PyBool_FromLong(res == ACQUIRE_OK);
-}
+PyDoc_STRVAR(blocked_doc,
+"blocked() -> list\n\
+\n\
+Return a list of (thread, obj, kind, start, timeout) tuples, one for each\n\
+thread blocked on a cthreading object, where kind is 'acquire', 'wait',\n\
+'send', 'recv', 'read' or 'write', start is the time the thread started to\n\
+wait in seconds since the epoch, and timeout is None if the thread waits\n\
+without a limit. A thread blocked in select() has an entry for every\n\
+channel.");
 
 static PyObject *
-cond_notify(condobj *self, PyObject *args)
+module_blocked(PyObject *module)
 {
-    int count = 1;
+    struct blocked *entry;
+    PyObject *list;
 
-    if (!PyArg_ParseTuple(args, "|i", &count))
+    list = PyList_New(0);
+    if (list == NULL)
         return NULL;
 
-    return cond_notify_waiters(self, count);
-}
+    for (entry = blocked_first; entry != NULL; entry = entry->next) {
+        PyObject *item;
+        int err;
 
-static PyObject *
-cond_notify_all(condobj *self)
-{
-    return cond_notify_waiters(self, self->waiters.count);
+        if (entry->timeout < 0)
+            item = Py_BuildValue("(lOsdO)", entry->thread, entry->obj,
+                                 entry->kind, entry->start, Py_None);
+        else
+            item = Py_BuildValue("(lOsdd)", entry->thread, entry->obj,
+                                 entry->kind, entry->start, entry->timeout);
+        if (item == NULL)
+            goto error;
+
+        err = PyList_Append(list, item);
+        Py_CLEAR(item);
+        if (err != 0)
+            goto error;
+    }
+
+    return list;
+
+error:
+    Py_CLEAR(list);
+    return NULL;
 }
 
+PyDoc_STRVAR(set_watchdog_doc,
+"set_watchdog(threshold=None, callback=None)\n\
+\n\
+Report Lock and RLock objects held or waited on longer than threshold\n\
+seconds by calling callback(kind, lock, duration, holder, stack, waiters),\n\
+where kind is 'hold' or 'wait', holder is the thread id of the thread\n\
+holding the lock, and stack is the holder acquire stack, as returned by\n\
+traceback.extract_stack(). Use threshold=None to disable the watchdog.");
+
 static PyObject *
-cond_is_owned(condobj *self)
+module_set_watchdog(PyObject *module, PyObject *args, PyObject *kwds)
 {
-    return PyObject_CallObject(self->is_owned, NULL);
-}
+    static char *kwlist[] = {"threshold", "callback", NULL};
+    PyObject *obj = Py_None;
+    PyObject *callback = Py_None;
+    PyObject *tmp;
+    double threshold;
 
-static PyMethodDef cond_methods[] = {
-    {"acquire", (PyCFunction)cond_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"__enter__", (PyCFunction)cond_acquire, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"release", (PyCFunction)cond_release, METH_VARARGS, NULL},
-    {"__exit__", (PyCFunction)cond_release, METH_VARARGS, NULL},
-    {"wait", (PyCFunction)cond_wait, METH_VARARGS | METH_KEYWORDS, NULL},
-    {"notify", (PyCFunction)cond_notify, METH_VARARGS, NULL},
-    {"notify_all", (PyCFunction)cond_notify_all, METH_VARARGS, NULL},
-    {"notifyAll", (PyCFunction)cond_notify_all, METH_VARARGS, NULL},
-    {"_is_owned", (PyCFunction)cond_is_owned, METH_NOARGS, NULL},
-    {"_release_save", (PyCFunction)cond_release_save, METH_NOARGS, NULL},
-    {"_acquire_restore", (PyCFunction)cond_acquire_restore, METH_VARARGS, NULL},
-    {NULL}  /* Sentinel */
-};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:set_watchdog", kwlist,
+                                     &obj, &callback))
+        return NULL;
 
-static PyTypeObject ConditionType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                          /* ob_size */
-    "_cthreading.Condition",    /* tp_name */
-    sizeof(condobj),            /* tp_basicsize */
-    0,                          /* tp_itemsize */
-    (destructor)cond_dealloc,   /* tp_dealloc */
-    0,                          /* tp_print */
-    0,                          /* tp_getattr */
-    0,                          /* tp_setattr */
-    0,                          /* tp_compare */
-    0,                          /* tp_repr */
-    0,                          /* tp_as_number */
-    0,                          /* tp_as_sequence */
-    0,                          /* tp_as_mapping */
-    0,                          /* tp_hash */
-    0,                          /* tp_call */
-    0,                          /* tp_str */
-    0,                          /* tp_getattro */
-    0,                          /* tp_setattro */
-    0,                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,         /* tp_flags */
-    cond_doc,                   /* tp_doc */
-    0,                          /* tp_traverse */
-    0,                          /* tp_clear */
-    0,                          /* tp_richcompare */
-    offsetof(condobj, weakrefs),  /* tp_weaklistoffset */
-    0,                          /* tp_iter */
-    0,                          /* tp_iternext */
-    cond_methods,               /* tp_methods */
-    0,                          /* tp_members */
-    0,                          /* tp_getset */
-    0,                          /* tp_base */
-    0,                          /* tp_dict */
-    0,                          /* tp_descr_get */
-    0,                          /* tp_descr_set */
-    0,                          /* tp_dictoffset */
-    (initproc)cond_init,        /* tp_init */
-    0,                          /* tp_alloc */
-    0,                          /* tp_new */
-};
+    if (obj == Py_None) {
+        watchdog_threshold = 0;
+        Py_CLEAR(watchdog_callback);
+        Py_RETURN_NONE;
+    }
 
-/* Module */
+    threshold = PyFloat_AsDouble(obj);
+    if (threshold == -1 && PyErr_Occurred())
+        return NULL;
+
+    if (threshold <= 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be positive");
+        return NULL;
+    }
+
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+
+    Py_INCREF(callback);
+    tmp = watchdog_callback;
+    watchdog_callback = callback;
+    Py_CLEAR(tmp);
+
+    watchdog_threshold = threshold;
+
+    Py_RETURN_NONE;
+}
 
 static int
 import_thread_error(void)
@@ -1052,6 +7509,11 @@ modify, copy, or redistribute it subject to the terms and conditions\n\
 of the GNU General Public License v2 or (at your option) any later version.");
 
 static PyMethodDef module_methods[] = {
+    {"set_watchdog", (PyCFunction)module_set_watchdog,
+     METH_VARARGS | METH_KEYWORDS, set_watchdog_doc},
+    {"select", (PyCFunction)module_select, METH_VARARGS | METH_KEYWORDS,
+     select_doc},
+    {"blocked", (PyCFunction)module_blocked, METH_NOARGS, blocked_doc},
     {NULL}  /* Sentinel */
 };
 
@@ -1059,10 +7521,14 @@ PyMODINIT_FUNC
 init_cthreading(void)
 {
     PyObject* module;
+    PyObject* c_api;
 
     if (import_thread_error())
         return;
 
+    if (PyType_Ready(&CancelTokenType) < 0)
+        return;
+
     if (PyType_Ready(&LockType) < 0)
         return;
 
@@ -1074,6 +7540,64 @@ init_cthreading(void)
     if (PyType_Ready(&ConditionType) < 0)
         return;
 
+    if (PyType_Ready(&ChannelType) < 0)
+        return;
+
+    if (PyType_Ready(&WaitGroupType) < 0)
+        return;
+
+    if (PyType_Ready(&RateLimiterType) < 0)
+        return;
+
+    if (PyType_Ready(&LockTableType) < 0)
+        return;
+
+    if (PyType_Ready(&LockGuardType) < 0)
+        return;
+
+    if (PyType_Ready(&SeqLockType) < 0)
+        return;
+
+    if (PyType_Ready(&SeqLockWriterType) < 0)
+        return;
+
+    if (PyType_Ready(&ObjectPoolType) < 0)
+        return;
+
+    if (PyType_Ready(&PoolItemType) < 0)
+        return;
+
+    if (PyType_Ready(&AtomicIntType) < 0)
+        return;
+
+    if (PyType_Ready(&CounterType) < 0)
+        return;
+
+    if (PyType_Ready(&ByteRingType) < 0)
+        return;
+
+    if (PyType_Ready(&RingRegionType) < 0)
+        return;
+
+    if (PyType_Ready(&SchedulerType) < 0)
+        return;
+
+    if (PyType_Ready(&ScheduledCallType) < 0)
+        return;
+
+    ChannelClosed = PyErr_NewException("_cthreading.ChannelClosed", NULL,
+                                       NULL);
+    if (ChannelClosed == NULL)
+        return;
+
+    Timeout = PyErr_NewException("_cthreading.Timeout", NULL, NULL);
+    if (Timeout == NULL)
+        return;
+
+    Cancelled = PyErr_NewException("_cthreading.Cancelled", NULL, NULL);
+    if (Cancelled == NULL)
+        return;
+
     module = Py_InitModule3("_cthreading", module_methods, module_doc);
 
     Py_INCREF(&LockType);
@@ -1084,4 +7608,54 @@ init_cthreading(void)
 
     Py_INCREF(&ConditionType);
     PyModule_AddObject(module, "Condition", (PyObject *)&ConditionType);
+
+    Py_INCREF(&ChannelType);
+    PyModule_AddObject(module, "Channel", (PyObject *)&ChannelType);
+
+    Py_INCREF(&WaitGroupType);
+    PyModule_AddObject(module, "WaitGroup", (PyObject *)&WaitGroupType);
+
+    Py_INCREF(&RateLimiterType);
+    PyModule_AddObject(module, "RateLimiter", (PyObject *)&RateLimiterType);
+
+    Py_INCREF(&LockTableType);
+    PyModule_AddObject(module, "LockTable", (PyObject *)&LockTableType);
+
+    Py_INCREF(&SeqLockType);
+    PyModule_AddObject(module, "SeqLock", (PyObject *)&SeqLockType);
+
+    Py_INCREF(&ObjectPoolType);
+    PyModule_AddObject(module, "ObjectPool", (PyObject *)&ObjectPoolType);
+
+    Py_INCREF(&AtomicIntType);
+    PyModule_AddObject(module, "AtomicInt", (PyObject *)&AtomicIntType);
+
+    Py_INCREF(&CounterType);
+    PyModule_AddObject(module, "Counter", (PyObject *)&CounterType);
+
+    Py_INCREF(&ByteRingType);
+    PyModule_AddObject(module, "ByteRing", (PyObject *)&ByteRingType);
+
+    Py_INCREF(&SchedulerType);
+    PyModule_AddObject(module, "Scheduler", (PyObject *)&SchedulerType);
+
+    Py_INCREF(&CancelTokenType);
+    PyModule_AddObject(module, "CancelToken", (PyObject *)&CancelTokenType);
+
+    Py_INCREF(ChannelClosed);
+    PyModule_AddObject(module, "ChannelClosed", ChannelClosed);
+
+    Py_INCREF(Timeout);
+    PyModule_AddObject(module, "Timeout", Timeout);
+
+    Py_INCREF(Cancelled);
+    PyModule_AddObject(module, "Cancelled", Cancelled);
+
+#if PY_VERSION_HEX >= 0x02070000
+    c_api = PyCapsule_New(&capi, CTHREADING_CAPSULE_NAME, NULL);
+#else
+    c_api = PyCObject_FromVoidPtr(&capi, NULL);
+#endif
+    if (c_api != NULL)
+        PyModule_AddObject(module, "_C_API", c_api);
 }
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2015 Nir Soffer <nsoffer@redhat.com>
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/* C API for cthreading Lock, RLock and Condition objects.
+ *
+ * Extension modules sharing locks with Python code can use these functions
+ * instead of calling the Python methods:
+ *
+ *     #include <cthreading/cthreading_capi.h>
+ *
+ *     if (CThreading_Import() < 0)
+ *         return;
+ *
+ *     if (CThreading_API->lock_acquire(lock, -1) < 0)
+ *         return NULL;
+ *
+ * Timeouts are in seconds; a negative timeout blocks without limit, and zero
+ * timeout does not block. Acquire and wait functions return 1 if the lock was
+ * acquired or the condition notified, and 0 if the timeout expired.
+ *
+ * Unless noted otherwise, functions must be called with the GIL held. They
+ * check the type of the object, and return -1 with a Python exception set on
+ * errors.
+ *
+ * Functions ending with _nogil may be called without the GIL; blocking
+ * without the GIL lets other threads run Python code meanwhile. They do not
+ * check the type of the object, and return -1 with errno set on errors
+ * (EPERM when releasing a lock not acquired by the caller). Locks acquired by
+ * these functions are not tracked by the watchdog. */
+
+#ifndef CTHREADING_CAPI_H
+#define CTHREADING_CAPI_H
+
+#include <Python.h>
+
+#define CTHREADING_CAPI_VERSION 1
+#define CTHREADING_CAPSULE_NAME "cthreading._cthreading._C_API"
+
+typedef struct {
+    int version;
+
+    PyTypeObject *LockType;
+    PyTypeObject *RLockType;
+    PyTypeObject *ConditionType;
+
+    int (*lock_acquire)(PyObject *lock, double timeout);
+    int (*lock_release)(PyObject *lock);
+    int (*rlock_acquire)(PyObject *rlock, double timeout);
+    int (*rlock_release)(PyObject *rlock);
+
+    /* The calling thread must own the condition lock. */
+    int (*cond_wait)(PyObject *cond, double timeout);
+    int (*cond_notify)(PyObject *cond, int n);
+    int (*cond_notify_all)(PyObject *cond);
+
+    int (*lock_acquire_nogil)(PyObject *lock, double timeout);
+    int (*lock_release_nogil)(PyObject *lock);
+    int (*rlock_acquire_nogil)(PyObject *rlock, double timeout);
+    int (*rlock_release_nogil)(PyObject *rlock);
+} CThreading_CAPI;
+
+#ifndef CTHREADING_MODULE
+
+static CThreading_CAPI *CThreading_API;
+
+/* Import the C API, setting CThreading_API. Must be called with the GIL held,
+ * typically from the module init function. Returns 0 on success, or -1 with
+ * a Python exception set. */
+static int
+CThreading_Import(void)
+{
+#if PY_VERSION_HEX >= 0x02070000
+    CThreading_API = (CThreading_CAPI *)PyCapsule_Import(
+        CTHREADING_CAPSULE_NAME, 0);
+#else
+    CThreading_API = (CThreading_CAPI *)PyCObject_Import(
+        "cthreading._cthreading", "_C_API");
+#endif
+    if (CThreading_API == NULL)
+        return -1;
+
+    if (CThreading_API->version != CTHREADING_CAPI_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "cthreading C API version %d, expected %d",
+                     CThreading_API->version, CTHREADING_CAPI_VERSION);
+        CThreading_API = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif /* CTHREADING_MODULE */
+
+#endif /* CTHREADING_CAPI_H */
@@ -5,16 +5,23 @@
 # of the GNU General Public License v2 or (at your option) any later version.
 
 import contextlib
+import ctypes
+import errno
+import gc
+import io
 import os
 import logging
 import signal
+import subprocess
 import sys
+import thread
 import threading
 import time
 import weakref
 
 import pytest
 import cthreading
+from cthreading import _cthreading
 
 logging.basicConfig(level=logging.DEBUG,
                     format="%(asctime)s %(message)s")
@@ -25,12 +32,18 @@ def Lock():
 def RLock():
     return cthreading.RLock()
 
+def BiasedRLock():
+    return cthreading.RLock(biased=True)
+
 def Condition():
     return cthreading.Condition(Lock())
 
 def RCondition():
     return cthreading.Condition(RLock())
 
+def BiasedRCondition():
+    return cthreading.Condition(BiasedRLock())
+
 # Lock tests
 
 @pytest.mark.timeout(2, method='thread')
@@ -119,14 +132,14 @@ def test_lock_acquire_restore_bad_call(locktype, state):
 
 # RLock tests
 
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_delete_locked_recursive(locktype):
     lock = locktype()
     lock.acquire()
     lock.acquire()
     del lock
 
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_recursive(locktype):
     lock = locktype()
     for i in range(100):
@@ -134,7 +147,7 @@ def test_rlock_acquire_recursive(locktype):
     assert locked(lock)
 
 @pytest.mark.parametrize("timeout", [None, -1.0, -1, 0.0, 1.0, 1000])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_timeout_free(locktype, timeout):
     lock = locktype()
     assert lock.acquire(blocking=True, timeout=timeout)
@@ -142,7 +155,7 @@ def test_rlock_acquire_timeout_free(locktype, timeout):
 
 @pytest.mark.timeout(2, method='thread')
 @pytest.mark.parametrize("timeout", [0, 0.1, 1])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_timeout_timedout(locktype, timeout):
     lock = locktype()
     lock_taken = [False]
@@ -155,7 +168,7 @@ def test_rlock_acquire_timeout_timedout(locktype, timeout):
     assert not lock_taken[0]
 
 @pytest.mark.parametrize("timeout", [0.9, 1.0])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_timeout_block(locktype, timeout):
     lock = locktype()
     ready = threading.Event()
@@ -176,7 +189,7 @@ def test_rlock_acquire_timeout_block(locktype, timeout):
 
     assert lock_taken[0]
 
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_release_owned_by_other_thread(locktype):
     lock = locktype()
     ready = threading.Event()
@@ -198,7 +211,7 @@ def test_rlock_release_owned_by_other_thread(locktype):
         t.join()
 
 @pytest.mark.parametrize("depth", [1, 2, 100])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_release_save(locktype, depth):
     lock = locktype()
     for i in range(depth):
@@ -208,13 +221,13 @@ def test_rlock_release_save(locktype, depth):
     assert owner == threading.current_thread().ident
     assert not locked(lock)
 
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_release_save_unacquired(locktype):
     lock = locktype()
     pytest.raises(RuntimeError, lock._release_save)
 
 @pytest.mark.parametrize("depth", [1, 2, 100])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_restore(locktype, depth):
     lock = locktype()
     me = threading.current_thread().ident
@@ -231,90 +244,197 @@ def test_rlock_acquire_restore(locktype, depth):
     ("invalid", 0),
     (1, "invalid"),
 ])
-@pytest.mark.parametrize("locktype", [RLock, RCondition])
+@pytest.mark.parametrize("locktype", [RLock, RCondition, BiasedRLock])
 def test_rlock_acquire_restore_bad_state(locktype, state):
     lock = locktype()
     pytest.raises(TypeError, lock._acquire_restore, state)
 
+# Biased RLock tests
+
+def test_rlock_biased():
+    assert BiasedRLock().biased
+    assert not RLock().biased
+
+def test_rlock_biased_reacquire():
+    lock = BiasedRLock()
+    for i in range(3):
+        with lock:
+            assert lock._is_owned()
+            assert locked(lock)
+        assert not lock._is_owned()
+        assert not locked(lock)
+
+def test_rlock_biased_revoke():
+    lock = BiasedRLock()
+    with lock:
+        pass
+    result = []
+
+    def take():
+        result.append(lock.acquire(False))
+        lock.release()
+
+    # The lock is reserved for this thread, but another thread can take it
+    # without blocking.
+    start_thread(take).join()
+    assert result == [True]
+    assert lock.acquire(False)
+    lock.release()
+
+@pytest.mark.timeout(2, method='thread')
+def test_rlock_biased_waiter():
+    lock = BiasedRLock()
+    results = []
+
+    def take():
+        results.append(lock.acquire(timeout=1.0))
+        lock.release()
+
+    with lock:
+        t = start_thread(take)
+        wait_blocked(1)
+
+    # The waiter must be woken instead of reserving the lock.
+    t.join()
+    assert results == [True]
+    assert not locked(lock)
+
+@pytest.mark.timeout(2, method='thread')
+def test_rlock_biased_token_waiter():
+    lock = BiasedRLock()
+    token = cthreading.CancelToken()
+    results = []
+
+    def take():
+        results.append(lock.acquire(timeout=1.0, token=token))
+        lock.release()
+
+    with lock:
+        t = start_thread(take)
+        wait_blocked(1)
+
+    t.join()
+    assert results == [True]
+
+def test_rlock_biased_acquire_restore_reserved():
+    lock = BiasedRLock()
+    with lock:
+        pass
+    me = threading.current_thread().ident
+    lock._acquire_restore((2, me))
+    assert locked(lock)
+    assert lock._release_save() == (2, me)
+    assert not locked(lock)
+
+def test_rlock_biased_threads():
+    lock = BiasedRLock()
+    count = [0]
+
+    def run():
+        for i in range(1000):
+            with lock:
+                count[0] += 1
+
+    threads = [start_thread(run) for i in range(4)]
+    for t in threads:
+        t.join()
+
+    assert count[0] == 4000
+    assert not locked(lock)
+
 # Common tests
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_init(locktype):
     lock = locktype()
     assert not locked(lock)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_delete_unlocked(locktype):
     lock = locktype()
     del lock
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_delete_locked(locktype):
     lock = locktype()
     lock.acquire()
     del lock
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire(locktype):
     lock = locktype()
     lock.acquire()
     assert locked(lock)
 
 @pytest.mark.parametrize("blocking", [0, False, 1, True])
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_blocking(locktype, blocking):
     lock = locktype()
     assert lock.acquire(blocking)
 
 @pytest.mark.parametrize("blocking", [0, False, 1, True])
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_blocking_kwarg(locktype, blocking):
     lock = locktype()
     assert lock.acquire(blocking=blocking)
 
 @pytest.mark.parametrize("timeout", ["1", "1.0"])
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_timeout_bad_type(locktype, timeout):
     lock = locktype()
     pytest.raises(TypeError, lock.acquire, blocking=True, timeout=timeout)
 
 @pytest.mark.parametrize("timeout", [-1.1, -2])
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_timeout_negative(locktype, timeout):
     lock = locktype()
     pytest.raises(ValueError, lock.acquire, blocking=True, timeout=timeout)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_timeout_noblocking(locktype):
     lock = locktype()
     pytest.raises(ValueError, lock.acquire, blocking=False, timeout=2)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_release_unlocked(locktype):
     lock = locktype()
     pytest.raises(RuntimeError, lock.release)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_release(locktype):
     lock = locktype()
     lock.acquire()
     lock.release()
     assert not locked(lock)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_with_acquire(locktype):
     lock = locktype()
     with lock:
         assert locked(lock)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_with_release(locktype):
     lock = locktype()
     with lock:
         pass
     assert not locked(lock)
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_multiple_threads(locktype):
     lock = locktype()
     ready = threading.Event()
@@ -341,20 +461,23 @@ def test_common_multiple_threads(locktype):
 
     assert counter[0] == concurrency
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_weakref_exists(locktype):
     lock = locktype()
     ref = weakref.ref(lock)
     assert ref() is not None
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_weakref_deleted(locktype):
     lock = locktype()
     ref = weakref.ref(lock)
     del lock
     assert ref() is None
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_acquire_interrupt(locktype):
     lock = locktype()
     holder_ready = threading.Event()
@@ -404,18 +527,21 @@ def test_common_acquire_interrupt(locktype):
 
         assert signal_received[0] == 1
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_is_not_owned(locktype):
     lock = locktype()
     assert not lock._is_owned()
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_is_owned_by_caller(locktype):
     lock = locktype()
     lock.acquire()
     assert lock._is_owned()
 
-@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition])
+@pytest.mark.parametrize("locktype", [Lock, RLock, Condition, RCondition,
+                                      BiasedRLock, BiasedRCondition])
 def test_common_is_owned_by_other(locktype):
     lock = locktype()
     ready = threading.Event()
@@ -581,6 +707,249 @@ def test_cond_notify_no_waiters(condtype):
         notified = cond.wait(0.0)
     assert not notified
 
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_true(condtype):
+    cond = condtype()
+    with cond:
+        assert cond.wait_for(lambda: "ready") == "ready"
+        assert locked(cond)
+
+@pytest.mark.parametrize("timeout", [0, 0.1])
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_timeout(condtype, timeout):
+    cond = condtype()
+    with cond:
+        start = time.time()
+        assert cond.wait_for(lambda: 0, timeout) == 0
+        assert time.time() - start >= timeout
+        assert locked(cond)
+
+@pytest.mark.timeout(2, method='thread')
+@pytest.mark.parametrize("timeout", [None, 1.0])
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_notify(condtype, timeout):
+    cond = condtype()
+    ready = threading.Event()
+    state = [0]
+
+    def notify():
+        ready.wait()
+        # Notifications before the predicate is true must not end the wait.
+        for i in range(1, 4):
+            time.sleep(0.05)
+            with cond:
+                state[0] = i
+                cond.notify()
+
+    t = start_thread(notify)
+    try:
+        with cond:
+            ready.set()
+            assert cond.wait_for(lambda: state[0] == 3, timeout)
+            assert locked(cond)
+    finally:
+        t.join()
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_deadline(condtype):
+    cond = condtype()
+    done = threading.Event()
+
+    def notify():
+        while not done.is_set():
+            with cond:
+                cond.notify()
+            time.sleep(0.02)
+
+    t = start_thread(notify)
+    try:
+        with cond:
+            start = time.time()
+            assert not cond.wait_for(lambda: False, 0.2)
+            assert time.time() - start < 0.5
+    finally:
+        done.set()
+        t.join()
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_predicate_error(condtype):
+    cond = condtype()
+
+    def predicate():
+        raise ZeroDivisionError
+
+    with cond:
+        pytest.raises(ZeroDivisionError, cond.wait_for, predicate)
+        assert locked(cond)
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_wait_for_unlocked(condtype):
+    cond = condtype()
+    pytest.raises(RuntimeError, cond.wait_for, lambda: True)
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_notify(condtype):
+    cond = condtype()
+    ready = threading.Event()
+    results = {}
+
+    def wait(key):
+        with cond:
+            ready.set()
+            results[key] = cond.wait(0.5, key=key)
+
+    threads = []
+    try:
+        for key in ("a", "b", None):
+            ready.clear()
+            threads.append(start_thread(wait, args=(key,)))
+            ready.wait()
+        with cond:
+            cond.notify(key="b")
+    finally:
+        for t in threads:
+            t.join()
+
+    assert results == {"a": False, "b": True, None: False}
+
+@pytest.mark.parametrize("notify", [1, 2, 10, 11])
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_notify_many(condtype, notify):
+    cond = condtype()
+    ready = threading.Event()
+    results = []
+
+    def wait(key):
+        with cond:
+            ready.set()
+            res = cond.wait(0.5, key=key)
+            results.append((key, res))
+
+    threads = []
+    try:
+        for i in range(10):
+            for key in (1, 2):
+                ready.clear()
+                threads.append(start_thread(wait, args=(key,)))
+                ready.wait()
+        with cond:
+            cond.notify(notify, key=2)
+    finally:
+        for t in threads:
+            t.join()
+
+    assert len(results) == 20
+    assert [r for r in results if r[0] == 1 and r[1]] == []
+    assert len([r for r in results if r[0] == 2 and r[1]]) == min(notify, 10)
+
+@pytest.mark.parametrize("key", [None, "a"])
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_notify_all(condtype, key):
+    cond = condtype()
+    ready = threading.Event()
+    results = []
+
+    def wait(wait_key):
+        with cond:
+            ready.set()
+            res = cond.wait(0.5, key=wait_key)
+            results.append((wait_key, res))
+
+    threads = []
+    try:
+        for i in range(5):
+            for wait_key in ("a", "b", None):
+                ready.clear()
+                threads.append(start_thread(wait, args=(wait_key,)))
+                ready.wait()
+        with cond:
+            cond.notify_all(key=key)
+    finally:
+        for t in threads:
+            t.join()
+
+    notified = sorted(r[0] for r in results if r[1])
+    if key is None:
+        # Notifying without a key wakes all waiters.
+        assert len(notified) == 15
+    else:
+        assert notified == ["a"] * 5
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_notify_no_waiters(condtype):
+    cond = condtype()
+    with cond:
+        cond.notify(key="a")
+        cond.notify_all(key="a")
+        assert not cond.wait(0.0, key="a")
+        # Waiting again reuses the key after the last waiter was removed.
+        assert not cond.wait(0.0, key="a")
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_wait_for(condtype):
+    cond = condtype()
+    ready = threading.Event()
+    state = [False]
+
+    def notify():
+        ready.wait()
+        time.sleep(0.05)
+        with cond:
+            state[0] = True
+            cond.notify(key="job")
+
+    t = start_thread(notify)
+    try:
+        with cond:
+            ready.set()
+            assert cond.wait_for(lambda: state[0], 1.0, key="job")
+    finally:
+        t.join()
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_cond_keyed_unhashable(condtype):
+    cond = condtype()
+    with cond:
+        pytest.raises(TypeError, cond.wait, 0.1, key=[])
+        pytest.raises(TypeError, cond.notify, key=[])
+
+@pytest.mark.parametrize("policy,expected", [
+    ("fifo", [0, 1, 2]),
+    ("lifo", [2, 1, 0]),
+])
+def test_cond_wake_policy(policy, expected):
+    cond = cthreading.Condition(Lock(), policy=policy)
+    assert cond.policy == policy
+    woken = []
+
+    def wait(i):
+        with cond:
+            cond.wait(2)
+            woken.append(i)
+
+    threads = []
+    try:
+        for i in range(3):
+            threads.append(start_thread(wait, args=(i,)))
+            # Make sure threads wait in order.
+            time.sleep(0.05)
+        for i in range(3):
+            with cond:
+                cond.notify()
+            time.sleep(0.05)
+    finally:
+        for t in threads:
+            t.join()
+
+    assert woken == expected
+
+def test_cond_wake_policy_default():
+    cond = cthreading.Condition()
+    assert cond.policy == "fifo"
+
+def test_cond_wake_policy_invalid():
+    pytest.raises(ValueError, cthreading.Condition, policy="random")
+
 @pytest.mark.parametrize("condtype", [Condition, RCondition])
 def test_cond_notify_unlocked(condtype):
     cond = condtype()
@@ -654,19 +1023,2258 @@ def test_cond_init_after_fork(locktype):
     finally:
         t.join()
 
-# Monkeypatching
+# Channel
 
-def test_monkeypatch_patch(monkeypatch):
-    monkeypatch.delitem(sys.modules, "threading")
-    monkeypatch.setattr(cthreading, "_patched", False)
-    cthreading.monkeypatch()
-    import thread
-    import threading
-    assert thread.allocate_lock is cthreading.Lock
-    assert threading._allocate_lock is cthreading.Lock
-    assert threading.Lock is cthreading.Lock
-    assert threading.RLock is cthreading.RLock
-    assert threading.Condition is cthreading.Condition
+@pytest.mark.parametrize("capacity", [0, 1, 10])
+def test_chan_send_recv(capacity):
+    chan = cthreading.Channel(capacity)
+    received = []
+
+    def recv():
+        for i in range(20):
+            received.append(chan.recv())
+
+    t = start_thread(recv)
+    try:
+        for i in range(20):
+            chan.send(i)
+    finally:
+        t.join()
+
+    assert received == list(range(20))
+
+def test_chan_buffered_nonblocking():
+    chan = cthreading.Channel(2)
+    chan.send(1, 0)
+    chan.send(2, 0)
+    pytest.raises(cthreading.Timeout, chan.send, 3, 0)
+    assert chan.recv(0) == 1
+    assert chan.recv(0) == 2
+    pytest.raises(cthreading.Timeout, chan.recv, 0)
+
+@pytest.mark.parametrize("timeout", [0, 0.1])
+def test_chan_unbuffered_timeout(timeout):
+    chan = cthreading.Channel()
+    pytest.raises(cthreading.Timeout, chan.send, 1, timeout)
+    pytest.raises(cthreading.Timeout, chan.recv, timeout)
+
+def test_chan_unbuffered_blocks_sender():
+    chan = cthreading.Channel()
+    sent = threading.Event()
+
+    def send():
+        chan.send(1)
+        sent.set()
+
+    t = start_thread(send)
+    try:
+        assert not sent.wait(0.1)
+        assert chan.recv() == 1
+    finally:
+        t.join()
+    assert sent.is_set()
+
+def test_chan_invalid_capacity():
+    pytest.raises(ValueError, cthreading.Channel, -1)
+
+def test_chan_close_wakes_receiver():
+    chan = cthreading.Channel()
+    errors = []
+
+    def recv():
+        try:
+            chan.recv()
+        except cthreading.ChannelClosed as e:
+            errors.append(e)
+
+    t = start_thread(recv)
+    try:
+        time.sleep(0.1)
+        chan.close()
+    finally:
+        t.join()
+
+    assert len(errors) == 1
+
+def test_chan_close_wakes_sender():
+    chan = cthreading.Channel(1)
+    chan.send(1)
+    errors = []
+
+    def send():
+        try:
+            chan.send(2)
+        except cthreading.ChannelClosed as e:
+            errors.append(e)
+
+    t = start_thread(send)
+    try:
+        time.sleep(0.1)
+        chan.close()
+    finally:
+        t.join()
+
+    assert len(errors) == 1
+
+def test_chan_send_closed():
+    chan = cthreading.Channel(1)
+    chan.close()
+    pytest.raises(cthreading.ChannelClosed, chan.send, 1)
+
+def test_chan_recv_closed_drains_buffer():
+    chan = cthreading.Channel(2)
+    chan.send(1)
+    chan.send(2)
+    chan.close()
+    assert list(chan) == [1, 2]
+    pytest.raises(cthreading.ChannelClosed, chan.recv)
+
+def test_chan_iterate():
+    chan = cthreading.Channel()
+
+    def send():
+        for i in range(10):
+            chan.send(i)
+        chan.close()
+
+    t = start_thread(send)
+    try:
+        assert list(chan) == list(range(10))
+    finally:
+        t.join()
+
+def test_select_recv_ready():
+    a = cthreading.Channel(1)
+    b = cthreading.Channel(1)
+    b.send("b")
+    assert cthreading.select([(a, "recv"), (b, "recv")]) == (1, "b")
+
+def test_select_send_ready():
+    a = cthreading.Channel()
+    b = cthreading.Channel(1)
+    assert cthreading.select([(a, "send", 1), (b, "send", 2)]) == (1, None)
+    assert b.recv(0) == 2
+
+@pytest.mark.parametrize("timeout", [0, 0.1])
+def test_select_timeout(timeout):
+    a = cthreading.Channel()
+    b = cthreading.Channel()
+    assert cthreading.select([(a, "recv"), (b, "send", 1)], timeout) is None
+    # Timed out cases must not stay parked on the channels.
+    pytest.raises(cthreading.Timeout, a.send, 1, 0)
+    pytest.raises(cthreading.Timeout, b.recv, 0)
+
+def test_select_blocking():
+    a = cthreading.Channel()
+    b = cthreading.Channel()
+    c = cthreading.Channel()
+    result = []
+
+    def select():
+        result.append(cthreading.select([(a, "recv"), (b, "recv"),
+                                         (c, "send", "c")]))
+
+    t = start_thread(select)
+    try:
+        time.sleep(0.1)
+        b.send("b")
+    finally:
+        t.join()
+
+    assert result == [(1, "b")]
+    # Other cases were unparked when b was received.
+    pytest.raises(cthreading.Timeout, a.send, 1, 0)
+    pytest.raises(cthreading.Timeout, c.recv, 0)
+
+def test_select_closed():
+    a = cthreading.Channel()
+    a.close()
+    pytest.raises(cthreading.ChannelClosed, cthreading.select, [(a, "recv")])
+
+@pytest.mark.parametrize("cases", [
+    [],
+    [(None, "recv")],
+    [(cthreading.Channel(), "invalid")],
+    [(cthreading.Channel(), "send")],
+    [(cthreading.Channel(), "recv", 1)],
+    ["not a tuple"],
+])
+def test_select_bad_cases(cases):
+    pytest.raises((TypeError, ValueError), cthreading.select, cases)
+
+# WaitGroup
+
+def test_waitgroup_wait_zero():
+    wg = cthreading.WaitGroup()
+    assert wg.wait(0)
+    assert wg.count == 0
+
+@pytest.mark.parametrize("timeout", [0, 0.1])
+def test_waitgroup_wait_timeout(timeout):
+    wg = cthreading.WaitGroup()
+    wg.add()
+    assert not wg.wait(timeout)
+
+@pytest.mark.parametrize("timeout", [None, 1.0])
+def test_waitgroup_wait_done(timeout):
+    wg = cthreading.WaitGroup()
+    concurrency = 10
+    wg.add(concurrency)
+
+    def work():
+        time.sleep(0.05)
+        wg.done()
+
+    threads = [start_thread(work) for i in range(concurrency)]
+    try:
+        assert wg.wait(timeout)
+        assert wg.count == 0
+    finally:
+        for t in threads:
+            t.join()
+
+def test_waitgroup_many_waiters():
+    wg = cthreading.WaitGroup()
+    wg.add()
+    results = []
+
+    def wait():
+        results.append(wg.wait(1.0))
+
+    threads = [start_thread(wait) for i in range(10)]
+    try:
+        time.sleep(0.1)
+        wg.done()
+    finally:
+        for t in threads:
+            t.join()
+
+    assert results == [True] * 10
+
+def test_waitgroup_negative():
+    wg = cthreading.WaitGroup()
+    pytest.raises(ValueError, wg.done)
+    wg.add(2)
+    pytest.raises(ValueError, wg.add, -3)
+    assert wg.count == 2
+
+def test_waitgroup_overflow():
+    wg = cthreading.WaitGroup()
+    wg.add(sys.maxint)
+    pytest.raises(OverflowError, wg.add)
+    assert wg.count == sys.maxint
+
+# RateLimiter
+
+def test_ratelimiter_burst():
+    limiter = cthreading.RateLimiter(0.1, 3)
+    assert limiter.rate == 0.1
+    assert limiter.burst == 3
+    assert limiter.try_acquire(2)
+    assert limiter.try_acquire()
+    assert not limiter.try_acquire()
+    assert not limiter.acquire(timeout=0)
+
+def test_ratelimiter_acquire_blocks():
+    limiter = cthreading.RateLimiter(10, 1)
+    assert limiter.acquire()
+    start = time.time()
+    assert limiter.acquire()
+    elapsed = time.time() - start
+    assert 0.08 < elapsed < 0.3
+
+def test_ratelimiter_acquire_timeout():
+    limiter = cthreading.RateLimiter(1, 1)
+    assert limiter.acquire()
+    start = time.time()
+    # Tokens are not available before the timeout, so fail without waiting.
+    assert not limiter.acquire(timeout=0.5)
+    assert time.time() - start < 0.1
+
+def test_ratelimiter_acquire_within_timeout():
+    limiter = cthreading.RateLimiter(10, 1)
+    assert limiter.acquire()
+    assert limiter.acquire(timeout=0.5)
+
+def test_ratelimiter_fifo():
+    limiter = cthreading.RateLimiter(20, 1)
+    assert limiter.acquire()
+    order = []
+
+    def acquire(i):
+        assert limiter.acquire(timeout=1.0)
+        order.append(i)
+
+    threads = []
+    try:
+        for i in range(5):
+            threads.append(start_thread(acquire, args=(i,)))
+            time.sleep(0.01)
+    finally:
+        for t in threads:
+            t.join()
+
+    assert order == list(range(5))
+
+def test_ratelimiter_waiter_timeout_wakes_next():
+    limiter = cthreading.RateLimiter(5, 2)
+    assert limiter.acquire(2)
+    results = {}
+
+    def acquire(name, tokens, timeout):
+        results[name] = limiter.acquire(tokens, timeout)
+
+    # First waiter gives up, second waiter must take its place.
+    first = start_thread(acquire, args=("first", 2, 0.1))
+    time.sleep(0.01)
+    second = start_thread(acquire, args=("second", 1, 1.0))
+    first.join()
+    second.join()
+
+    assert results == {"first": False, "second": True}
+
+@pytest.mark.parametrize("rate,burst", [(0, 1), (1, 0), (-1, 1)])
+def test_ratelimiter_invalid(rate, burst):
+    pytest.raises(ValueError, cthreading.RateLimiter, rate, burst)
+
+@pytest.mark.parametrize("tokens", [0, -1, 3])
+def test_ratelimiter_invalid_tokens(tokens):
+    limiter = cthreading.RateLimiter(1, 2)
+    pytest.raises(ValueError, limiter.acquire, tokens)
+    pytest.raises(ValueError, limiter.try_acquire, tokens)
+
+# LockTable
+
+def test_locktable_acquire_release():
+    table = cthreading.LockTable(8)
+    assert table.acquire("key")
+    table.release("key")
+
+def test_locktable_reentrant():
+    # Keys in the same stripe must not deadlock.
+    table = cthreading.LockTable(1)
+    assert table.acquire("a")
+    assert table.acquire("b")
+    table.release("b")
+    table.release("a")
+    pytest.raises(RuntimeError, table.release, "a")
+
+def test_locktable_contention():
+    table = cthreading.LockTable(8)
+    assert table.acquire(1)
+    results = []
+
+    def acquire(key):
+        acquired = table.acquire(key, timeout=0.05)
+        if acquired:
+            table.release(key)
+        results.append(acquired)
+
+    t = start_thread(acquire, args=(1,))
+    t.join()
+    t = start_thread(acquire, args=(2,))
+    t.join()
+    table.release(1)
+
+    assert results == [False, True]
+
+def test_locktable_release_unacquired():
+    table = cthreading.LockTable(8)
+    pytest.raises(RuntimeError, table.release, "key")
+
+def test_locktable_release_other_thread():
+    table = cthreading.LockTable(8)
+    assert table.acquire("key")
+    errors = []
+
+    def release():
+        try:
+            table.release("key")
+        except RuntimeError as e:
+            errors.append(e)
+
+    t = start_thread(release)
+    t.join()
+    table.release("key")
+
+    assert len(errors) == 1
+
+def test_locktable_unhashable():
+    table = cthreading.LockTable(8)
+    pytest.raises(TypeError, table.acquire, [])
+    pytest.raises(TypeError, table.acquire_many, [1, []])
+
+def test_locktable_acquire_many():
+    table = cthreading.LockTable(4)
+    # Duplicate keys and keys in the same stripe are locked once.
+    keys = [1, 5, 1, 2]
+    assert table.acquire_many(keys)
+    table.release_many(keys)
+    pytest.raises(RuntimeError, table.release, 1)
+
+def test_locktable_acquire_many_timeout_releases():
+    table = cthreading.LockTable(8)
+    assert table.acquire(3)
+    results = []
+
+    def acquire_many():
+        results.append(table.acquire_many([1, 2, 3], timeout=0.05))
+        # Stripes acquired before the timeout must be released.
+        results.append(table.acquire(1, timeout=0))
+        table.release(1)
+
+    t = start_thread(acquire_many)
+    t.join()
+    table.release(3)
+
+    assert results == [False, True]
+
+def test_locktable_acquire_many_no_deadlock():
+    table = cthreading.LockTable(16)
+    count = [0]
+
+    def run(keys):
+        for i in range(1000):
+            with table.locked(*keys):
+                count[0] += 1
+
+    threads = [start_thread(run, args=(keys,))
+               for keys in ([1, 2, 3], [3, 2, 1], [2, 3, 1])]
+    for t in threads:
+        t.join()
+
+    assert count[0] == 3000
+
+def test_locktable_locked():
+    table = cthreading.LockTable(8)
+    with table.locked("key"):
+        table.release("key")
+        assert table.acquire("key")
+    pytest.raises(RuntimeError, table.release, "key")
+
+@pytest.mark.parametrize("stripes", [0, -1])
+def test_locktable_invalid(stripes):
+    pytest.raises(ValueError, cthreading.LockTable, stripes)
+
+# SeqLock
+
+def test_seqlock_read():
+    seqlock = cthreading.SeqLock()
+    data = {"a": 1}
+    assert seqlock.read(data.get, "a") == 1
+    assert seqlock.sequence == 0
+
+def test_seqlock_write():
+    seqlock = cthreading.SeqLock()
+    data = {"a": 1}
+    with seqlock.write():
+        assert seqlock.sequence == 1
+        data["a"] = 2
+        # The writer reads its own writes.
+        assert seqlock.read(data.get, "a") == 2
+    assert seqlock.sequence == 2
+    assert seqlock.read(data.get, "a") == 2
+
+def test_seqlock_write_not_reentrant():
+    seqlock = cthreading.SeqLock()
+    with seqlock.write():
+        with pytest.raises(RuntimeError):
+            with seqlock.write():
+                pass
+
+def test_seqlock_read_retry():
+    seqlock = cthreading.SeqLock()
+    calls = []
+
+    def read():
+        calls.append(1)
+        if len(calls) == 1:
+            # Simulate a writer modifying the data during the read.
+            t = start_thread(write)
+            t.join()
+        return len(calls)
+
+    def write():
+        with seqlock.write():
+            pass
+
+    assert seqlock.read(read) == 2
+
+def test_seqlock_read_retry_error():
+    seqlock = cthreading.SeqLock()
+    calls = []
+
+    def read():
+        calls.append(1)
+        if len(calls) == 1:
+            t = start_thread(write)
+            t.join()
+            # Error caused by inconsistent data.
+            raise KeyError
+        return len(calls)
+
+    def write():
+        with seqlock.write():
+            pass
+
+    assert seqlock.read(read) == 2
+
+def test_seqlock_read_error():
+    seqlock = cthreading.SeqLock()
+
+    def read():
+        raise KeyError
+
+    pytest.raises(KeyError, seqlock.read, read)
+
+def test_seqlock_read_waits_for_writer():
+    seqlock = cthreading.SeqLock()
+    data = [0, 0]
+    writing = threading.Event()
+    results = []
+
+    def read():
+        writing.wait()
+        results.append(seqlock.read(tuple, data))
+
+    t = start_thread(read)
+    try:
+        with seqlock.write():
+            data[0] = 1
+            writing.set()
+            wait_blocked(1)
+            # Readers park until the write ends, without taking the writers
+            # semaphore.
+            assert seqlock.waiters == 1
+            [(thread, obj, kind, _, _)] = _cthreading.blocked()
+            assert (thread, obj, kind) == (t.ident, seqlock, "read")
+            data[1] = 1
+    finally:
+        t.join()
+
+    assert results == [(1, 1)]
+    assert seqlock.waiters == 0
+
+def test_seqlock_write_wakes_all_readers():
+    seqlock = cthreading.SeqLock()
+    results = []
+
+    def read():
+        results.append(seqlock.read(lambda: "data"))
+
+    with seqlock.write():
+        threads = [start_thread(read) for i in range(4)]
+        wait_blocked(4)
+        assert seqlock.waiters == 4
+    for t in threads:
+        t.join()
+
+    assert results == ["data"] * 4
+
+def test_seqlock_consistent():
+    seqlock = cthreading.SeqLock()
+    data = [0, 0]
+    done = []
+    errors = []
+
+    def write():
+        for i in range(1000):
+            with seqlock.write():
+                data[0] = i
+                time.sleep(0)
+                data[1] = i
+        done.append(True)
+
+    def read():
+        while not done:
+            a, b = seqlock.read(tuple, data)
+            if a != b:
+                errors.append((a, b))
+
+    threads = [start_thread(write), start_thread(read), start_thread(read)]
+    for t in threads:
+        t.join()
+
+    assert errors == []
+
+# ObjectPool
+
+class Resource(object):
+    pass
+
+def test_pool_lazy_create():
+    pool = cthreading.ObjectPool(Resource, 2)
+    assert pool.size == 0
+    a = pool.acquire()
+    assert pool.size == 1
+    b = pool.acquire()
+    assert pool.size == 2
+    assert a is not b
+    pool.release(a)
+    pool.release(b)
+    assert pool.available == 2
+
+def test_pool_lifo():
+    pool = cthreading.ObjectPool(Resource, 3)
+    a, b, c = pool.acquire(), pool.acquire(), pool.acquire()
+    pool.release(a)
+    pool.release(b)
+    pool.release(c)
+    # Most recently released first.
+    assert pool.acquire() is c
+    assert pool.acquire() is b
+
+def test_pool_release_any_order():
+    pool = cthreading.ObjectPool(Resource, 4)
+    a, b, c, d = [pool.acquire() for i in range(4)]
+    pool.release(b)
+    pool.discard(d)
+    pool.release(a)
+    assert pool.available == 2
+    assert pool.size == 3
+    pool.release(c)
+    assert pool.acquire() is c
+    assert pool.acquire() is a
+    assert pool.acquire() is b
+    assert pool.acquire() is not d
+
+def test_pool_timeout():
+    pool = cthreading.ObjectPool(Resource, 1)
+    pool.acquire()
+    pytest.raises(cthreading.Timeout, pool.acquire, timeout=0)
+    start = time.time()
+    pytest.raises(cthreading.Timeout, pool.acquire, timeout=0.1)
+    assert time.time() - start >= 0.1
+
+def test_pool_acquire_blocks():
+    pool = cthreading.ObjectPool(Resource, 1)
+    obj = pool.acquire()
+    results = []
+
+    def acquire():
+        results.append(pool.acquire(timeout=1.0))
+
+    t = start_thread(acquire)
+    try:
+        time.sleep(0.05)
+        assert results == []
+        pool.release(obj)
+    finally:
+        t.join()
+
+    assert results == [obj]
+
+def test_pool_release_too_many():
+    pool = cthreading.ObjectPool(Resource, 1)
+    obj = pool.acquire()
+    pool.release(obj)
+    pytest.raises(ValueError, pool.release, obj)
+
+def test_pool_release_twice():
+    pool = cthreading.ObjectPool(Resource, 2)
+    a = pool.acquire()
+    b = pool.acquire()
+    pool.release(a)
+    pytest.raises(ValueError, pool.release, a)
+    assert pool.available == 1
+    pool.release(b)
+    assert set([pool.acquire(), pool.acquire()]) == set([a, b])
+
+@pytest.mark.parametrize("method", ["release", "discard"])
+def test_pool_release_foreign(method):
+    pool = cthreading.ObjectPool(Resource, 1)
+    obj = pool.acquire()
+    pytest.raises(ValueError, getattr(pool, method), Resource())
+    assert pool.size == 1
+    assert pool.available == 0
+    getattr(pool, method)(obj)
+    pytest.raises(ValueError, getattr(pool, method), obj)
+
+def test_pool_discard():
+    pool = cthreading.ObjectPool(Resource, 1)
+    obj = pool.acquire()
+    results = []
+
+    def acquire():
+        results.append(pool.acquire(timeout=1.0))
+
+    t = start_thread(acquire)
+    try:
+        time.sleep(0.05)
+        pool.discard(obj)
+    finally:
+        t.join()
+
+    # The waiter gets a new object.
+    assert len(results) == 1
+    assert results[0] is not obj
+    assert pool.size == 1
+
+def test_pool_factory_error():
+    def factory():
+        raise RuntimeError
+
+    pool = cthreading.ObjectPool(factory, 1)
+    pytest.raises(RuntimeError, pool.acquire)
+    assert pool.size == 0
+
+def test_pool_item():
+    pool = cthreading.ObjectPool(Resource, 1)
+    with pool.item() as obj:
+        assert isinstance(obj, Resource)
+        assert pool.available == 0
+    assert pool.available == 1
+    with pool.item() as other:
+        assert other is obj
+
+def test_pool_item_timeout():
+    pool = cthreading.ObjectPool(Resource, 1)
+    pool.acquire()
+    with pytest.raises(cthreading.Timeout):
+        with pool.item(timeout=0.05):
+            pass
+
+def test_pool_contention():
+    pool = cthreading.ObjectPool(Resource, 2)
+    in_use = set()
+    errors = []
+
+    def run():
+        for i in range(200):
+            with pool.item(timeout=5) as obj:
+                if obj in in_use:
+                    errors.append(obj)
+                in_use.add(obj)
+                time.sleep(0)
+                in_use.discard(obj)
+
+    threads = [start_thread(run) for i in range(5)]
+    for t in threads:
+        t.join()
+
+    assert errors == []
+    assert 1 <= pool.size <= 2
+    assert pool.available == pool.size
+
+@pytest.mark.parametrize("maxsize", [0, -1])
+def test_pool_invalid_maxsize(maxsize):
+    pytest.raises(ValueError, cthreading.ObjectPool, Resource, maxsize)
+
+def test_pool_invalid_factory():
+    pytest.raises(TypeError, cthreading.ObjectPool, "not callable", 1)
+
+# AtomicInt
+
+def test_atomic_default():
+    value = cthreading.AtomicInt()
+    assert value.get() == 0
+    assert value.value == 0
+
+def test_atomic_add():
+    value = cthreading.AtomicInt(10)
+    assert value.add() == 11
+    assert value.add(5) == 16
+    assert value.add(-20) == -4
+    assert value.get() == -4
+
+def test_atomic_add_overflow():
+    value = cthreading.AtomicInt(sys.maxint)
+    pytest.raises(OverflowError, value.add)
+    assert value.get() == sys.maxint
+
+def test_atomic_set():
+    value = cthreading.AtomicInt()
+    value.set(42)
+    assert value.get() == 42
+
+def test_atomic_compare_and_swap():
+    value = cthreading.AtomicInt(1)
+    assert value.compare_and_swap(1, 2)
+    assert value.get() == 2
+    assert not value.compare_and_swap(1, 3)
+    assert value.get() == 2
+
+def test_atomic_exchange():
+    value = cthreading.AtomicInt(1)
+    assert value.exchange(2) == 1
+    assert value.get() == 2
+
+def test_atomic_threads():
+    value = cthreading.AtomicInt()
+
+    def run():
+        for i in range(10000):
+            value.add()
+
+    threads = [start_thread(run) for i in range(4)]
+    for t in threads:
+        t.join()
+
+    assert value.get() == 40000
+
+# Counter
+
+def test_counter():
+    counter = cthreading.Counter()
+    assert counter.get() == 0
+    counter.add()
+    counter.add(10)
+    counter.add(-3)
+    assert counter.get() == 8
+    assert counter.value == 8
+
+@pytest.mark.parametrize("shards", [1, 3, 64])
+def test_counter_threads(shards):
+    counter = cthreading.Counter(shards)
+
+    def run():
+        for i in range(10000):
+            counter.add()
+
+    threads = [start_thread(run) for i in range(4)]
+    for t in threads:
+        t.join()
+
+    assert counter.get() == 40000
+
+@pytest.mark.parametrize("shards", [0, -1])
+def test_counter_invalid_shards(shards):
+    pytest.raises(ValueError, cthreading.Counter, shards)
+
+# ByteRing
+
+def test_ring_write_read():
+    ring = cthreading.ByteRing(8)
+    ring.write("abc")
+    ring.write(bytearray("de"))
+    assert ring.available == 5
+    assert ring.free == 3
+    buf = bytearray(8)
+    assert ring.read_into(buf) == 5
+    assert buf[:5] == "abcde"
+    assert ring.available == 0
+
+def test_ring_read_partial():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcdef")
+    buf = bytearray(4)
+    assert ring.read_into(buf) == 4
+    assert buf == "abcd"
+    assert ring.read_into(buf) == 2
+    assert buf[:2] == "ef"
+
+def test_ring_wrap_around():
+    ring = cthreading.ByteRing(8)
+    buf = bytearray(8)
+    ring.write("abcdef")
+    assert ring.read_into(memoryview(buf)[:4]) == 4
+    ring.write("ghijk")
+    assert ring.available == 7
+    assert ring.read_into(buf) == 7
+    assert buf[:7] == "efghijk"
+
+def test_ring_write_too_large():
+    ring = cthreading.ByteRing(4)
+    pytest.raises(ValueError, ring.write, "abcde")
+
+@pytest.mark.parametrize("capacity", [0, -1])
+def test_ring_invalid_capacity(capacity):
+    pytest.raises(ValueError, cthreading.ByteRing, capacity)
+
+def test_ring_timeout():
+    ring = cthreading.ByteRing(4)
+    buf = bytearray(4)
+    pytest.raises(cthreading.Timeout, ring.read_into, buf, timeout=0)
+    ring.write("abc")
+    pytest.raises(cthreading.Timeout, ring.write, "de", timeout=0)
+    start = time.time()
+    pytest.raises(cthreading.Timeout, ring.write, "de", timeout=0.1)
+    assert time.time() - start >= 0.1
+
+def test_ring_write_blocks():
+    ring = cthreading.ByteRing(4)
+    ring.write("abc")
+    done = threading.Event()
+
+    def write():
+        ring.write("de", timeout=1.0)
+        done.set()
+
+    t = start_thread(write)
+    try:
+        time.sleep(0.05)
+        assert not done.is_set()
+        assert ring.read_into(bytearray(2)) == 2
+    finally:
+        t.join()
+
+    assert done.is_set()
+    buf = bytearray(4)
+    assert ring.read_into(buf) == 3
+    assert buf[:3] == "cde"
+
+def test_ring_read_blocks():
+    ring = cthreading.ByteRing(4)
+    buf = bytearray(4)
+    results = []
+
+    def read():
+        results.append(ring.read_into(buf, timeout=1.0))
+
+    t = start_thread(read)
+    try:
+        time.sleep(0.05)
+        assert results == []
+        ring.write("ab")
+    finally:
+        t.join()
+
+    assert results == [2]
+    assert buf[:2] == "ab"
+
+def test_ring_reserve_commit():
+    ring = cthreading.ByteRing(8)
+    region = ring.reserve(5)
+    assert isinstance(region, memoryview)
+    assert len(region) == 5
+    assert not region.readonly
+    region[:3] = "abc"
+    ring.commit(3)
+    assert ring.available == 3
+    buf = bytearray(8)
+    assert ring.read_into(buf) == 3
+    assert buf[:3] == "abc"
+
+def test_ring_reserve_contiguous():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcdef")
+    ring.read_into(bytearray(4))
+    # Free space wraps around the end of the buffer.
+    assert len(ring.reserve()) == 2
+    ring.commit(0)
+    assert len(ring.reserve(10)) == 2
+    ring.commit(0)
+
+def test_ring_reserve_empty_uses_whole_buffer():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcdef")
+    ring.read_into(bytearray(6))
+    assert len(ring.reserve()) == 8
+    ring.commit(0)
+
+def test_ring_reserve_blocks_writers():
+    ring = cthreading.ByteRing(8)
+    region = ring.reserve(2)
+    pytest.raises(cthreading.Timeout, ring.write, "x", timeout=0)
+    pytest.raises(cthreading.Timeout, ring.reserve, timeout=0)
+    region[:] = "ab"
+    ring.commit(2)
+    ring.write("c")
+    buf = bytearray(8)
+    assert ring.read_into(buf) == 3
+    assert buf[:3] == "abc"
+
+def test_ring_commit_invalid():
+    ring = cthreading.ByteRing(8)
+    pytest.raises(RuntimeError, ring.commit, 1)
+    ring.reserve(4)
+    pytest.raises(ValueError, ring.commit, 5)
+    pytest.raises(ValueError, ring.commit, -1)
+
+def test_ring_peek_consume():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcdef")
+    region = ring.peek(4)
+    assert region.readonly
+    assert region.tobytes() == "abcd"
+    pytest.raises(cthreading.Timeout, ring.read_into, bytearray(1), timeout=0)
+    ring.consume(2)
+    assert ring.available == 4
+    assert ring.peek().tobytes() == "cdef"
+    ring.consume(0)
+    assert ring.available == 4
+
+def test_ring_peek_contiguous():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcdef")
+    ring.read_into(bytearray(4))
+    ring.write("ghij")
+    # Data wraps around the end of the buffer.
+    assert ring.peek().tobytes() == "efgh"
+    ring.consume(4)
+    assert ring.peek().tobytes() == "ij"
+    ring.consume(2)
+
+def test_ring_consume_invalid():
+    ring = cthreading.ByteRing(8)
+    ring.write("ab")
+    pytest.raises(ValueError, ring.consume, 1)
+    ring.peek()
+    pytest.raises(ValueError, ring.consume, 3)
+
+def test_ring_peek_region_not_writable():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcd")
+    region = ring.peek()
+    pytest.raises(TypeError, io.BytesIO("ZZ").readinto, region)
+    assert region.tobytes() == "abcd"
+
+def test_ring_region_exports_region_only():
+    ring = cthreading.ByteRing(8)
+    ring.write("abcd")
+    region = ring.peek(2)
+    assert memoryview(region).tobytes() == "ab"
+    assert io.BytesIO(region).read() == "ab"
+
+def test_ring_not_exported():
+    ring = cthreading.ByteRing(8)
+    pytest.raises(TypeError, memoryview, ring)
+
+def test_ring_size_none():
+    ring = cthreading.ByteRing(8)
+    assert len(ring.reserve(None)) == 8
+    ring.commit(4)
+    assert len(ring.peek(size=None)) == 4
+    ring.consume(4)
+
+@pytest.mark.parametrize("size", [0, -2])
+def test_ring_size_invalid(size):
+    ring = cthreading.ByteRing(8)
+    pytest.raises(ValueError, ring.reserve, size)
+    ring.write("a")
+    pytest.raises(ValueError, ring.peek, size)
+
+def test_ring_region_keeps_ring():
+    ring = cthreading.ByteRing(8)
+    ring.write("abc")
+    region = ring.peek()
+    ref = weakref.ref(ring)
+    del ring
+    assert ref() is not None
+    assert region.tobytes() == "abc"
+    del region
+    assert ref() is None
+
+def test_ring_close():
+    ring = cthreading.ByteRing(8)
+    ring.write("abc")
+    ring.close()
+    assert ring.closed
+    pytest.raises(cthreading.ChannelClosed, ring.write, "d")
+    pytest.raises(cthreading.ChannelClosed, ring.reserve)
+    buf = bytearray(8)
+    assert ring.read_into(buf) == 3
+    assert ring.read_into(buf) == 0
+    assert ring.peek().tobytes() == ""
+
+def test_ring_close_wakes_readers():
+    ring = cthreading.ByteRing(8)
+    results = []
+
+    def read():
+        results.append(ring.read_into(bytearray(8), timeout=1.0))
+
+    threads = [start_thread(read) for i in range(3)]
+    try:
+        time.sleep(0.05)
+        ring.close()
+    finally:
+        for t in threads:
+            t.join()
+
+    assert results == [0, 0, 0]
+
+def test_ring_cancel():
+    ring = cthreading.ByteRing(8)
+    token = cthreading.CancelToken()
+    errors = []
+
+    def read():
+        try:
+            ring.read_into(bytearray(8), timeout=1.0, token=token)
+        except cthreading.Cancelled:
+            errors.append("cancelled")
+
+    t = start_thread(read)
+    try:
+        time.sleep(0.05)
+        token.cancel()
+    finally:
+        t.join()
+
+    assert errors == ["cancelled"]
+
+def test_ring_stream():
+    ring = cthreading.ByteRing(1024)
+    data = "".join(chr(i % 256) for i in range(100000))
+    received = []
+
+    def produce():
+        for i in range(0, len(data), 1000):
+            chunk = data[i:i + 1000]
+            while chunk:
+                region = ring.reserve(len(chunk), timeout=2.0)
+                n = len(region)
+                region[:] = chunk[:n]
+                ring.commit(n)
+                chunk = chunk[n:]
+        ring.close()
+
+    def consume():
+        buf = bytearray(700)
+        while True:
+            n = ring.read_into(buf, timeout=2.0)
+            if n == 0:
+                break
+            received.append(str(buf[:n]))
+
+    threads = [start_thread(produce), start_thread(consume)]
+    for t in threads:
+        t.join()
+
+    assert "".join(received) == data
+
+# Scheduler
+
+@contextlib.contextmanager
+def scheduler(dispatch=None):
+    sched = cthreading.Scheduler(dispatch)
+    try:
+        yield sched
+    finally:
+        sched.shutdown()
+
+def wait_for(predicate, timeout=1.0):
+    deadline = time.time() + timeout
+    while not predicate():
+        if time.time() > deadline:
+            raise RuntimeError("Timeout waiting for %s" % predicate)
+        time.sleep(0.01)
+
+def test_sched_call_later():
+    calls = []
+    with scheduler() as sched:
+        start = sched.time()
+        call = sched.call_later(0.05, calls.append, "a")
+        assert start + 0.05 <= call.when <= sched.time() + 0.05
+        assert call.interval is None
+        assert sched.pending == 1
+        wait_for(lambda: calls)
+        assert sched.time() >= call.when
+    assert calls == ["a"]
+    assert sched.pending == 0
+
+def test_sched_call_kwargs():
+    calls = []
+    done = threading.Event()
+
+    def func(*args, **kwargs):
+        calls.append((args, kwargs))
+        done.set()
+
+    with scheduler() as sched:
+        sched.call_later(0, func, 1, 2, a=3)
+        done.wait(1)
+    assert calls == [((1, 2), {"a": 3})]
+
+def test_sched_call_at():
+    calls = []
+    with scheduler() as sched:
+        sched.call_at(sched.time() + 0.05, calls.append, "a")
+        wait_for(lambda: calls)
+    assert calls == ["a"]
+
+def test_sched_order():
+    calls = []
+    with scheduler() as sched:
+        now = sched.time()
+        for i in reversed(range(5)):
+            sched.call_at(now + 0.05 + i * 0.01, calls.append, i)
+        wait_for(lambda: len(calls) == 5)
+    assert calls == list(range(5))
+
+def test_sched_earlier_call_wakes_dispatcher():
+    calls = []
+    with scheduler() as sched:
+        sched.call_later(10, calls.append, "late")
+        time.sleep(0.05)
+        sched.call_later(0.05, calls.append, "early")
+        wait_for(lambda: calls)
+        assert calls == ["early"]
+        assert sched.pending == 1
+
+def test_sched_cancel():
+    calls = []
+    with scheduler() as sched:
+        call = sched.call_later(0.05, calls.append, "a")
+        call.cancel()
+        assert call.cancelled
+        assert sched.pending == 0
+        call.cancel()
+        time.sleep(0.1)
+    assert calls == []
+
+def test_sched_cancel_many():
+    import random
+    calls = []
+    with scheduler() as sched:
+        now = sched.time()
+        scheduled = [sched.call_at(now + 0.1 + random.random() * 0.1,
+                                   calls.append, i)
+                     for i in range(200)]
+        cancelled = set(random.sample(range(200), 100))
+        for i in cancelled:
+            scheduled[i].cancel()
+        assert sched.pending == 100
+        wait_for(lambda: len(calls) == 100)
+    assert set(calls) == set(range(200)) - cancelled
+    expected = sorted(calls, key=lambda i: scheduled[i].when)
+    assert calls == expected
+
+def test_sched_call_every():
+    calls = []
+    with scheduler() as sched:
+        call = sched.call_every(0.02, calls.append, "tick")
+        assert call.interval == 0.02
+        wait_for(lambda: len(calls) >= 3)
+        call.cancel()
+        count = len(calls)
+        time.sleep(0.1)
+        assert len(calls) == count
+        assert sched.pending == 0
+
+def test_sched_call_every_cancel_in_callback():
+    calls = []
+
+    def tick():
+        calls.append("tick")
+        if len(calls) == 3:
+            call.cancel()
+
+    with scheduler() as sched:
+        call = sched.call_every(0.01, tick)
+        wait_for(lambda: len(calls) == 3)
+        time.sleep(0.05)
+    assert len(calls) == 3
+
+def test_sched_dispatch():
+    chan = cthreading.Channel()
+    results = []
+
+    def worker():
+        call = chan.recv(timeout=1.0)
+        results.append((call(), threading.current_thread().ident))
+
+    t = start_thread(worker)
+    with scheduler(chan.send) as sched:
+        sched.call_later(0, lambda: "result")
+        t.join()
+    assert results == [("result", t.ident)]
+
+def test_sched_callback_error():
+    calls = []
+
+    def fail():
+        raise RuntimeError("callback failed")
+
+    with scheduler() as sched:
+        sched.call_later(0, fail)
+        sched.call_later(0.01, calls.append, "a")
+        wait_for(lambda: calls)
+    assert calls == ["a"]
+
+def test_sched_shutdown():
+    calls = []
+    sched = cthreading.Scheduler()
+    call = sched.call_later(0.05, calls.append, "a")
+    sched.shutdown()
+    assert sched.pending == 0
+    pytest.raises(RuntimeError, sched.call_later, 0, calls.append, "b")
+    sched.shutdown()
+    time.sleep(0.1)
+    assert calls == []
+    assert call.cancelled
+
+def test_sched_shutdown_releases_calls():
+    sched = cthreading.Scheduler()
+    ref = weakref.ref(sched)
+    sched.call_later(10, lambda: None)
+    sched.shutdown()
+    del sched
+    wait_for(lambda: ref() is None)
+
+class Holder(object):
+
+    def callback(self):
+        pass
+
+@pytest.mark.parametrize("cancel", [False, True])
+def test_sched_releases_callback(cancel):
+    holder = Holder()
+    ref = weakref.ref(holder)
+    with scheduler() as sched:
+        holder.call = sched.call_later(0, holder.callback)
+        if cancel:
+            holder.call.cancel()
+        else:
+            wait_for(lambda: sched.pending == 0)
+        del holder
+        wait_for(lambda: ref() is None)
+
+def test_sched_collects_dispatched_calls():
+    dispatched = []
+    holder = Holder()
+    ref = weakref.ref(holder)
+    with scheduler(dispatched.append) as sched:
+        holder.call = sched.call_later(0, holder.callback)
+        wait_for(lambda: dispatched)
+    del dispatched[:]
+    del holder
+    gc.collect()
+    assert ref() is None
+
+def test_sched_dispatch_invoke_once():
+    calls = []
+    dispatched = []
+    with scheduler(dispatched.append) as sched:
+        sched.call_later(0, calls.append, "a")
+        wait_for(lambda: dispatched)
+    dispatched[0]()
+    dispatched[0]()
+    assert calls == ["a"]
+
+def test_sched_dispatch_cancelled():
+    calls = []
+    dispatched = []
+    with scheduler(dispatched.append) as sched:
+        sched.call_every(0.01, calls.append, "a")
+        wait_for(lambda: dispatched)
+    dispatched[0].cancel()
+    dispatched[0]()
+    assert calls == []
+
+@pytest.mark.parametrize("args,error", [
+    ((), TypeError),
+    ((1,), TypeError),
+    (("invalid", lambda: None), TypeError),
+    ((1, "not callable"), TypeError),
+    ((float("nan"), lambda: None), ValueError),
+])
+def test_sched_invalid_args(args, error):
+    with scheduler() as sched:
+        pytest.raises(error, sched.call_later, *args)
+
+@pytest.mark.parametrize("interval", [0, -1])
+def test_sched_call_every_invalid_interval(interval):
+    with scheduler() as sched:
+        pytest.raises(ValueError, sched.call_every, interval, lambda: None)
+
+def test_sched_invalid_dispatch():
+    pytest.raises(TypeError, cthreading.Scheduler, "not callable")
+
+def test_timer():
+    calls = []
+    timer = cthreading.Timer(0.05, calls.append, args=("a",))
+    assert not timer.is_alive()
+    timer.start()
+    assert timer.is_alive()
+    timer.join(1.0)
+    assert not timer.is_alive()
+    assert calls == ["a"]
+    pytest.raises(RuntimeError, timer.start)
+
+def test_timer_cancel():
+    calls = []
+    timer = cthreading.Timer(0.05, calls.append, kwargs={"x": 1})
+    timer.start()
+    timer.cancel()
+    timer.join()
+    time.sleep(0.1)
+    assert calls == []
+
+def test_timer_exit():
+    script = """if True:
+        import sys
+        import cthreading
+        cthreading.monkeypatch(timer=True)
+        import threading
+        def report(msg):
+            sys.stdout.write(msg + "\\n")
+        daemon = threading.Timer(10, report, ["daemon"])
+        daemon.daemon = True
+        daemon.start()
+        threading.Timer(0.1, report, ["non-daemon"]).start()
+    """
+    assert run_script(script) == "non-daemon\n"
+
+def test_timer_fork():
+    script = """if True:
+        import os
+        import sys
+        import cthreading
+        cthreading.monkeypatch(timer=True)
+        import threading
+        def report(msg):
+            sys.stdout.write(msg + "\\n")
+        parent = threading.Timer(60, report, ["parent"])
+        parent.start()
+        pid = os.fork()
+        if pid == 0:
+            # The child exits normally, without waiting for parent timers.
+            timer = threading.Timer(0, report, ["child"])
+            timer.start()
+            timer.join()
+            parent.join()
+            sys.exit(0)
+        os.waitpid(pid, 0)
+        parent.cancel()
+    """
+    assert run_script(script) == "child\n"
+
+def run_script(script, timeout=10):
+    env = dict(os.environ, PYTHONPATH=os.path.dirname(cthreading.__path__[0]))
+    # Run in a new process group, to kill forked children on timeout.
+    p = subprocess.Popen([sys.executable, "-c", script], env=env,
+                         stdout=subprocess.PIPE, preexec_fn=os.setsid)
+    deadline = time.time() + timeout
+    while p.poll() is None:
+        if time.time() > deadline:
+            os.killpg(p.pid, signal.SIGKILL)
+            p.wait()
+            raise RuntimeError("Timeout waiting for script")
+        time.sleep(0.05)
+    assert p.returncode == 0
+    return p.stdout.read()
+
+def test_timer_thread_api():
+    calls = []
+    timer = cthreading.Timer(0, lambda: calls.append(thread.get_ident()))
+    assert timer.getName().startswith("Timer-")
+    timer.setName("name")
+    assert timer.name == "name"
+    assert not timer.isDaemon()
+    timer.setDaemon(True)
+    assert timer.daemon
+    assert timer.ident is None
+    timer.start()
+    pytest.raises(RuntimeError, timer.setDaemon, False)
+    timer.join(1.0)
+    assert calls == [timer.ident]
+
+def test_timer_run_override():
+    calls = []
+
+    class MyTimer(cthreading.Timer):
+        def run(self):
+            calls.append("run")
+
+    timer = MyTimer(0, calls.append, ["function"])
+    timer.start()
+    timer.join(1.0)
+    assert not timer.is_alive()
+    assert calls == ["run"]
+
+def test_timer_run():
+    calls = []
+    timer = cthreading.Timer(10, calls.append, ["a"])
+    timer.run()
+    assert calls == ["a"]
+    timer.run()
+    assert calls == ["a"]
+
+def test_timer_blocking_function():
+    calls = []
+    release = threading.Event()
+    blocking = cthreading.Timer(0, release.wait, [2.0])
+    blocking.start()
+    try:
+        timer = cthreading.Timer(0.01, calls.append, ["a"])
+        timer.start()
+        timer.join(1.0)
+        assert calls == ["a"]
+        assert blocking.is_alive()
+    finally:
+        release.set()
+        blocking.join(1.0)
+
+def test_timer_worker_reused():
+    first = cthreading.Timer(0, lambda: None)
+    first.start()
+    first.join(1.0)
+    # Wait until the worker is idle.
+    wait_for(lambda: first.ident in idle_workers())
+    idle = idle_workers()
+    second = cthreading.Timer(0, lambda: None)
+    second.start()
+    second.join(1.0)
+    assert second.ident in idle
+
+def test_timer_worker_start_error(monkeypatch):
+    import threading
+
+    def start(self):
+        raise thread.error("can't start new thread")
+
+    calls = []
+    monkeypatch.setattr(threading.Thread, "start", start)
+    with scheduler(cthreading._Dispatcher()) as sched:
+        sched.call_later(0, calls.append, "a")
+        wait_for(lambda: calls)
+    assert calls == ["a"]
+
+def idle_workers():
+    return set(thread for thread, _, kind, _, _ in _cthreading.blocked()
+               if kind == "recv")
+
+def test_timer_join_current():
+    errors = []
+
+    def join():
+        try:
+            timer.join()
+        except RuntimeError as e:
+            errors.append(e)
+
+    timer = cthreading.Timer(0, join)
+    timer.start()
+    timer.join(1.0)
+    assert len(errors) == 1
+
+def test_timer_join_before_start():
+    timer = cthreading.Timer(0, lambda: None)
+    pytest.raises(RuntimeError, timer.join)
+
+# CancelToken
+
+def cancel_later(token, delay=0.05):
+    def cancel():
+        time.sleep(delay)
+        token.cancel()
+    return start_thread(cancel)
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_token_lock_acquire_cancel(locktype):
+    lock = locktype()
+    token = cthreading.CancelToken()
+    errors = []
+
+    def acquire():
+        try:
+            lock.acquire(token=token)
+        except cthreading.Cancelled as e:
+            errors.append(e)
+
+    with lock:
+        t = start_thread(acquire)
+        cancel_later(token).join()
+        t.join()
+
+    assert len(errors) == 1
+    assert token.cancelled
+    assert not locked(lock)
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_token_lock_acquire_released(locktype):
+    lock = locktype()
+    token = cthreading.CancelToken()
+    result = []
+
+    def acquire():
+        result.append(lock.acquire(token=token))
+        lock.release()
+
+    lock.acquire()
+    t = start_thread(acquire)
+    try:
+        time.sleep(0.05)
+    finally:
+        lock.release()
+        t.join()
+
+    assert result == [True]
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+@pytest.mark.parametrize("timeout", [0, 0.05])
+def test_token_lock_acquire_timeout(locktype, timeout):
+    lock = locktype()
+    token = cthreading.CancelToken()
+    result = []
+
+    def acquire():
+        result.append(lock.acquire(timeout=timeout, token=token))
+
+    with lock:
+        start_thread(acquire).join()
+
+    assert result == [False]
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_token_lock_contention(locktype):
+    lock = locktype()
+    token = cthreading.CancelToken()
+    count = [0]
+
+    def run():
+        for i in range(500):
+            with lock:
+                count[0] += 1
+
+    def run_token():
+        for i in range(500):
+            assert lock.acquire(token=token)
+            try:
+                count[0] += 1
+            finally:
+                lock.release()
+
+    threads = [start_thread(run), start_thread(run_token),
+               start_thread(run_token)]
+    for t in threads:
+        t.join()
+
+    assert count[0] == 1500
+
+def test_token_cancelled():
+    lock = Lock()
+    token = cthreading.CancelToken()
+    token.cancel()
+    pytest.raises(cthreading.Cancelled, lock.acquire, token=token)
+    assert not locked(lock)
+
+def test_token_invalid():
+    lock = Lock()
+    pytest.raises(TypeError, lock.acquire, token="token")
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_token_cond_wait_cancel(condtype):
+    cond = condtype()
+    token = cthreading.CancelToken()
+    with cond:
+        t = cancel_later(token)
+        pytest.raises(cthreading.Cancelled, cond.wait, token=token)
+        # The lock is acquired again before raising.
+        assert cond._is_owned()
+    t.join()
+
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_token_cond_wait_for_cancel(condtype):
+    cond = condtype()
+    token = cthreading.CancelToken()
+    with cond:
+        t = cancel_later(token)
+        pytest.raises(cthreading.Cancelled, cond.wait_for, lambda: False,
+                      token=token)
+    t.join()
+
+def test_token_cancel_many():
+    cond = Condition()
+    token = cthreading.CancelToken()
+    errors = []
+
+    def wait():
+        with cond:
+            try:
+                cond.wait(token=token)
+            except cthreading.Cancelled as e:
+                errors.append(e)
+
+    threads = [start_thread(wait) for i in range(10)]
+    time.sleep(0.1)
+    token.cancel()
+    for t in threads:
+        t.join()
+
+    assert len(errors) == 10
+
+@pytest.mark.parametrize("capacity", [0, 1])
+def test_token_channel_recv_cancel(capacity):
+    chan = cthreading.Channel(capacity)
+    token = cthreading.CancelToken()
+    t = cancel_later(token)
+    pytest.raises(cthreading.Cancelled, chan.recv, token=token)
+    t.join()
+
+def test_token_channel_send_cancel():
+    chan = cthreading.Channel()
+    token = cthreading.CancelToken()
+    t = cancel_later(token)
+    pytest.raises(cthreading.Cancelled, chan.send, 1, token=token)
+    t.join()
+    # The value was not sent.
+    pytest.raises(cthreading.Timeout, chan.recv, timeout=0)
+
+def test_token_select_cancel():
+    a = cthreading.Channel()
+    b = cthreading.Channel()
+    token = cthreading.CancelToken()
+    t = cancel_later(token)
+    pytest.raises(cthreading.Cancelled, cthreading.select,
+                  [(a, "recv"), (b, "recv")], token=token)
+    t.join()
+
+def test_token_pool_acquire_cancel():
+    pool = cthreading.ObjectPool(object, 1)
+    pool.acquire()
+    token = cthreading.CancelToken()
+    t = cancel_later(token)
+    pytest.raises(cthreading.Cancelled, pool.acquire, token=token)
+    t.join()
+
+def test_token_waitgroup_wait_cancel():
+    wg = cthreading.WaitGroup()
+    wg.add()
+    token = cthreading.CancelToken()
+    t = cancel_later(token)
+    pytest.raises(cthreading.Cancelled, wg.wait, token=token)
+    t.join()
+
+# Blocked threads
+
+def scheduler_workers():
+    return set(t.ident for t in threading.enumerate()
+               if t.name == "cthreading-scheduler")
+
+def blocked():
+    # Timer workers stay blocked for a while after running timers.
+    workers = scheduler_workers()
+    return [e for e in _cthreading.blocked() if e[0] not in workers]
+
+def wait_blocked(count, timeout=1.0):
+    deadline = time.time() + timeout
+    while len(blocked()) < count:
+        if time.time() > deadline:
+            raise RuntimeError("Timeout waiting for blocked threads")
+        time.sleep(0.01)
+
+def test_blocked_empty():
+    assert blocked() == []
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_blocked_acquire(locktype):
+    lock = locktype()
+    start = time.time()
+
+    def acquire():
+        with lock:
+            pass
+
+    with lock:
+        t = start_thread(acquire)
+        wait_blocked(1)
+        assert lock.waiters == 1
+        workers = scheduler_workers()
+        [entry] = [e for e in cthreading.blocked()
+                   if e["thread"] not in workers]
+    t.join()
+
+    assert entry["thread"] == t.ident
+    assert entry["object"] is lock
+    assert entry["kind"] == "acquire"
+    assert start <= entry["start"] <= time.time()
+    assert entry["timeout"] is None
+    assert any(frame[2] == "acquire" for frame in entry["stack"])
+    assert lock.waiters == 0
+    assert blocked() == []
+
+def test_blocked_acquire_timeout():
+    lock = Lock()
+
+    def acquire():
+        lock.acquire(timeout=1.0)
+
+    with lock:
+        t = start_thread(acquire)
+        wait_blocked(1)
+        [(thread, obj, kind, start, timeout)] = blocked()
+    t.join()
+
+    assert timeout == 1.0
+
+def test_blocked_wait():
+    cond = Condition()
+    ready = threading.Event()
+
+    def wait():
+        with cond:
+            ready.set()
+            cond.wait(2.0)
+
+    t = start_thread(wait)
+    try:
+        ready.wait()
+        wait_blocked(1)
+        with cond:
+            assert cond.waiters == 1
+            [(thread, obj, kind, start, timeout)] = blocked()
+            cond.notify()
+    finally:
+        t.join()
+
+    assert thread == t.ident
+    assert obj is cond
+    assert kind == "wait"
+    assert timeout == 2.0
+    assert cond.waiters == 0
+
+def test_blocked_many():
+    lock = Lock()
+
+    def acquire():
+        with lock:
+            pass
+
+    with lock:
+        threads = [start_thread(acquire) for i in range(5)]
+        wait_blocked(5)
+        assert lock.waiters == 5
+        idents = set(thread for thread, _, _, _, _ in blocked())
+
+    for t in threads:
+        t.join()
+
+    assert idents == set(t.ident for t in threads)
+
+def check_blocked(obj, kind, block, unblock):
+    t = start_thread(block)
+    try:
+        wait_blocked(1)
+        assert obj.waiters == 1
+        [(thread, found, found_kind, start, timeout)] = blocked()
+    finally:
+        unblock()
+        t.join()
+
+    assert thread == t.ident
+    assert found is obj
+    assert found_kind == kind
+    assert obj.waiters == 0
+    assert blocked() == []
+
+def test_blocked_channel_recv():
+    chan = cthreading.Channel()
+    check_blocked(chan, "recv", chan.recv, lambda: chan.send(1))
+
+def test_blocked_channel_send():
+    chan = cthreading.Channel()
+    check_blocked(chan, "send", lambda: chan.send(1), chan.recv)
+
+def test_blocked_select():
+    a = cthreading.Channel()
+    b = cthreading.Channel()
+
+    def select():
+        cthreading.select([(a, "recv"), (b, "send", 1)])
+
+    t = start_thread(select)
+    try:
+        wait_blocked(2)
+        assert a.waiters == 1
+        assert b.waiters == 1
+        entries = blocked()
+    finally:
+        a.send(1)
+        t.join()
+
+    found = sorted((obj is a, kind) for thread, obj, kind, _, _ in entries)
+    assert found == [(False, "send"), (True, "recv")]
+    assert set(thread for thread, _, _, _, _ in entries) == set([t.ident])
+    assert a.waiters == 0
+    assert b.waiters == 0
+    assert blocked() == []
+
+def test_blocked_waitgroup():
+    wg = cthreading.WaitGroup()
+    wg.add(1)
+    check_blocked(wg, "wait", wg.wait, wg.done)
+
+def test_blocked_pool():
+    pool = cthreading.ObjectPool(Resource, 1)
+    obj = pool.acquire()
+    check_blocked(pool, "acquire", lambda: pool.release(pool.acquire()),
+                  lambda: pool.release(obj))
+
+def test_blocked_ratelimiter():
+    limiter = cthreading.RateLimiter(2, 1)
+    assert limiter.try_acquire()
+    check_blocked(limiter, "acquire", limiter.acquire, lambda: None)
+
+def test_blocked_ring_read():
+    ring = cthreading.ByteRing(4)
+    check_blocked(ring, "read", lambda: ring.read_into(bytearray(1)),
+                  lambda: ring.write("a"))
+
+def test_blocked_ring_write():
+    ring = cthreading.ByteRing(4)
+    ring.write("abcd")
+    check_blocked(ring, "write", lambda: ring.write("e"),
+                  lambda: ring.read_into(bytearray(4)))
+
+def test_cond_waiters_keyed():
+    cond = Condition()
+    ready = threading.Event()
+
+    def wait():
+        with cond:
+            ready.set()
+            cond.wait(2.0, key="a")
+
+    t = start_thread(wait)
+    try:
+        ready.wait()
+        wait_blocked(1)
+        with cond:
+            assert cond.waiters == 1
+            cond.notify(key="a")
+    finally:
+        t.join()
+
+# Watchdog
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_watchdog_hold(locktype):
+    lock = locktype()
+    reports = []
+
+    cthreading.watchdog(0.1, lambda *args: reports.append(args))
+    try:
+        with lock:
+            time.sleep(0.2)
+    finally:
+        cthreading.watchdog(None)
+
+    assert len(reports) == 1
+    kind, obj, duration, holder, stack, waiters = reports[0]
+    assert kind == "hold"
+    assert obj is lock
+    assert duration >= 0.2
+    assert holder == threading.current_thread().ident
+    assert stack[-1][2] == "test_watchdog_hold"
+    assert waiters == 0
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_watchdog_hold_acquire_site(locktype):
+    lock = locktype()
+    reports = []
+
+    class Local(object):
+        pass
+
+    def hold():
+        local = Local()
+        lock.acquire()  # acquire site
+        time.sleep(0.2)
+        return weakref.ref(local)
+
+    cthreading.watchdog(0.1, lambda *args: reports.append(args))
+    try:
+        local = hold()
+        # The acquiring frame and its locals are not kept alive.
+        assert local() is None
+        lock.release()
+    finally:
+        cthreading.watchdog(None)
+
+    kind, obj, duration, holder, stack, waiters = reports[0]
+    filename, lineno, name, line = stack[-1]
+    assert name == "hold"
+    assert line == "lock.acquire()  # acquire site"
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+def test_watchdog_hold_short(locktype):
+    lock = locktype()
+    reports = []
+
+    cthreading.watchdog(0.1, lambda *args: reports.append(args))
+    try:
+        with lock:
+            pass
+    finally:
+        cthreading.watchdog(None)
+
+    assert reports == []
+
+@pytest.mark.parametrize("locktype", [Lock, RLock])
+@pytest.mark.parametrize("token", [None, cthreading.CancelToken()])
+def test_watchdog_wait(locktype, token):
+    lock = locktype()
+    ready = threading.Event()
+    done = threading.Event()
+    reports = []
+
+    def hold():
+        with lock:
+            ready.set()
+            done.wait(1)
+
+    cthreading.watchdog(0.1, lambda *args: reports.append(args))
+    try:
+        t = start_thread(hold)
+        try:
+            ready.wait()
+            assert not lock.acquire(timeout=0.25, token=token)
+        finally:
+            done.set()
+            t.join()
+    finally:
+        cthreading.watchdog(None)
+
+    waits = [r for r in reports if r[0] == "wait"]
+    assert len(waits) > 0
+    kind, obj, duration, holder, stack, waiters = waits[0]
+    assert obj is lock
+    assert duration >= 0.1
+    assert holder == t.ident
+    assert stack[-1][2] == "hold"
+    assert waiters == 1
+
+def test_watchdog_disabled():
+    lock = Lock()
+    reports = []
+
+    cthreading.watchdog(0.1, lambda *args: reports.append(args))
+    cthreading.watchdog(None)
+    with lock:
+        time.sleep(0.2)
+
+    assert reports == []
+
+def test_watchdog_callback_error():
+    lock = Lock()
+
+    def callback(*args):
+        raise RuntimeError("callback failed")
+
+    cthreading.watchdog(0.1, callback)
+    try:
+        with lock:
+            time.sleep(0.2)
+    finally:
+        cthreading.watchdog(None)
+
+def test_watchdog_log():
+    lock = Lock()
+    records = []
+
+    class Handler(logging.Handler):
+        def emit(self, record):
+            records.append(record)
+
+    handler = Handler()
+    log = logging.getLogger("cthreading")
+    log.addHandler(handler)
+    cthreading.watchdog(0.1)
+    try:
+        with lock:
+            time.sleep(0.2)
+    finally:
+        cthreading.watchdog(None)
+        log.removeHandler(handler)
+
+    assert len(records) == 1
+    assert "test_watchdog_log" in records[0].getMessage()
+
+@pytest.mark.parametrize("threshold,callback,error", [
+    (0, lambda *a: None, ValueError),
+    (-1, lambda *a: None, ValueError),
+    ("1", lambda *a: None, TypeError),
+    (1, "not callable", TypeError),
+])
+def test_watchdog_bad_args(threshold, callback, error):
+    pytest.raises(error, cthreading.watchdog, threshold, callback)
+
+# C API
+
+class CAPI(ctypes.Structure):
+    _fields_ = [
+        ("version", ctypes.c_int),
+        ("LockType", ctypes.c_void_p),
+        ("RLockType", ctypes.c_void_p),
+        ("ConditionType", ctypes.c_void_p),
+        ("lock_acquire", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_double)),
+        ("lock_release", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object)),
+        ("rlock_acquire", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_double)),
+        ("rlock_release", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object)),
+        ("cond_wait", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_double)),
+        ("cond_notify", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_int)),
+        ("cond_notify_all", ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object)),
+        # Called without the GIL
+        ("lock_acquire_nogil", ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_double,
+            use_errno=True)),
+        ("lock_release_nogil", ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, use_errno=True)),
+        ("rlock_acquire_nogil", ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_double,
+            use_errno=True)),
+        ("rlock_release_nogil", ctypes.CFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, use_errno=True)),
+    ]
+
+def capi():
+    get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+    get_pointer.restype = ctypes.c_void_p
+    get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+    ptr = get_pointer(_cthreading._C_API, "cthreading._cthreading._C_API")
+    return ctypes.cast(ptr, ctypes.POINTER(CAPI)).contents
+
+def test_capi_version():
+    assert capi().version == 1
+
+@pytest.mark.parametrize("locktype,acquire,release", [
+    (Lock, "lock_acquire", "lock_release"),
+    (Lock, "lock_acquire_nogil", "lock_release_nogil"),
+    (RLock, "rlock_acquire", "rlock_release"),
+    (RLock, "rlock_acquire_nogil", "rlock_release_nogil"),
+    (BiasedRLock, "rlock_acquire_nogil", "rlock_release_nogil"),
+])
+def test_capi_acquire_release(locktype, acquire, release):
+    api = capi()
+    lock = locktype()
+    assert getattr(api, acquire)(lock, -1) == 1
+    assert locked(lock)
+    assert lock._is_owned()
+    assert getattr(api, release)(lock) == 0
+    assert not locked(lock)
+
+@pytest.mark.parametrize("locktype,acquire", [
+    (Lock, "lock_acquire"),
+    (Lock, "lock_acquire_nogil"),
+    (RLock, "rlock_acquire"),
+    (RLock, "rlock_acquire_nogil"),
+    (BiasedRLock, "rlock_acquire_nogil"),
+])
+@pytest.mark.parametrize("timeout", [0, 0.1])
+def test_capi_acquire_timeout(locktype, acquire, timeout):
+    api = capi()
+    lock = locktype()
+    result = []
+
+    def take():
+        result.append(getattr(api, acquire)(lock, timeout))
+
+    with lock:
+        start_thread(take).join()
+
+    assert result == [0]
+
+@pytest.mark.parametrize("acquire", ["rlock_acquire", "rlock_acquire_nogil"])
+@pytest.mark.parametrize("locktype", [RLock, BiasedRLock])
+def test_capi_rlock_recursive(locktype, acquire):
+    api = capi()
+    lock = locktype()
+    for i in range(3):
+        assert getattr(api, acquire)(lock, 0) == 1
+    for i in range(3):
+        assert locked(lock)
+        lock.release()
+    assert not locked(lock)
+
+@pytest.mark.parametrize("locktype,release", [
+    (Lock, "lock_release_nogil"),
+    (RLock, "rlock_release_nogil"),
+    (BiasedRLock, "rlock_release_nogil"),
+])
+def test_capi_release_nogil_unlocked(locktype, release):
+    lock = locktype()
+    assert getattr(capi(), release)(lock) == -1
+    assert ctypes.get_errno() == errno.EPERM
+
+@pytest.mark.parametrize("locktype,acquire", [
+    (RLock, "lock_acquire"),
+    (Lock, "rlock_acquire"),
+    (Lock, "cond_wait"),
+])
+def test_capi_bad_type(locktype, acquire):
+    pytest.raises(TypeError, getattr(capi(), acquire), locktype(), 0)
+
+def test_capi_release_unlocked():
+    pytest.raises(threading.ThreadError, capi().lock_release, Lock())
+
+@pytest.mark.timeout(2, method='thread')
+@pytest.mark.parametrize("notify", ["cond_notify", "cond_notify_all"])
+@pytest.mark.parametrize("condtype", [Condition, RCondition])
+def test_capi_cond_wait_notify(condtype, notify):
+    api = capi()
+    cond = condtype()
+    ready = threading.Event()
+
+    def wake():
+        ready.wait()
+        with cond:
+            if notify == "cond_notify":
+                assert api.cond_notify(cond, 1) == 0
+            else:
+                assert api.cond_notify_all(cond) == 0
+
+    t = start_thread(wake)
+    try:
+        with cond:
+            ready.set()
+            assert api.cond_wait(cond, 1.0) == 1
+            assert locked(cond)
+    finally:
+        t.join()
+
+def test_capi_cond_wait_unlocked():
+    pytest.raises(RuntimeError, capi().cond_wait, Condition(), 0)
+
+@pytest.mark.parametrize("locktype,release", [
+    (Lock, "lock_release_nogil"),
+    (RLock, "rlock_release_nogil"),
+    (BiasedRLock, "rlock_release_nogil"),
+])
+def test_capi_release_nogil_wakes_token_waiter(locktype, release):
+    api = capi()
+    lock = locktype()
+    token = cthreading.CancelToken()
+    result = []
+
+    def acquire():
+        result.append(lock.acquire(timeout=2, token=token))
+        lock.release()
+
+    lock.acquire()
+    t = start_thread(acquire)
+    try:
+        time.sleep(0.05)
+    finally:
+        assert getattr(api, release)(lock) == 0
+        t.join()
+
+    assert result == [True]
+
+# Monkeypatching
+
+def test_monkeypatch_patch(monkeypatch):
+    monkeypatch.delitem(sys.modules, "threading")
+    monkeypatch.setattr(cthreading, "_patched", False)
+    cthreading.monkeypatch()
+    import thread
+    import threading
+    assert thread.allocate_lock is cthreading.Lock
+    assert threading._allocate_lock is cthreading.Lock
+    assert threading.Lock is cthreading.Lock
+    assert threading.RLock is cthreading.RLock
+    assert threading.Condition is cthreading.Condition
+
+def test_monkeypatch_timer(monkeypatch):
+    monkeypatch.delitem(sys.modules, "threading")
+    monkeypatch.setattr(cthreading, "_patched", False)
+    cthreading.monkeypatch(timer=True)
+    import threading
+    assert threading.Timer is cthreading.Timer
+    calls = []
+    timer = threading.Timer(0, calls.append, ["a"])
+    timer.start()
+    timer.join(1.0)
+    assert calls == ["a"]
 
 def test_monkeypatch_twice(monkeypatch):
     monkeypatch.delitem(sys.modules, "threading")
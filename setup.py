@@ -4,17 +4,28 @@
 # modify, copy, or redistribute it subject to the terms and conditions
 # of the GNU General Public License v2 or (at your option) any later version.
 
+import os
 from distutils.core import setup, Extension
 
+define_macros = []
+
+# Enable static tracepoints if systemtap-sdt-devel is installed.
+if os.path.exists("/usr/include/sys/sdt.h"):
+    define_macros.append(("HAVE_SYS_SDT_H", "1"))
+
 setup(
     author="Nir Soffer",
     author_email="nsoffer@redhat.com",
     description=("C implementation of Python 2 threading syncronization "
                  "primitives"),
+    headers=["cthreading/cthreading_capi.h"],
     ext_modules=[
         Extension(
             name="cthreading._cthreading",
-            sources=["cthreading/_cthreading.c"]
+            sources=["cthreading/_cthreading.c"],
+            depends=["cthreading/cthreading_capi.h"],
+            define_macros=define_macros,
+            libraries=["rt"],  # clock_gettime on older glibc
         )
     ],
     license="GNU GPLv2+",
@@ -13,7 +13,9 @@ parser.add_option("-j", "--jobs", dest="jobs", type="int",
                   help="number of jobs to queue")
 parser.add_option("-r", "--rounds", dest="rounds", type="int",
                   help="number of rounds")
-parser.set_defaults(threads=20, jobs=3000, rounds=200)
+parser.add_option("-l", "--lifo", dest="lifo", action="store_true",
+                  help="wake most recent idle worker first (cthreading only)")
+parser.set_defaults(threads=20, jobs=3000, rounds=200, lifo=False)
 
 
 def threadpool(options):
@@ -27,6 +29,10 @@ def threadpool(options):
     src = queue.Queue()
     dst = queue.Queue()
 
+    if options.lifo:
+        import cthreading
+        src.not_empty = cthreading.Condition(src.mutex, policy="lifo")
+
     for i in benchlib.range(options.threads):
         t = threading.Thread(target=worker, args=(src, dst))
         t.daemon = True
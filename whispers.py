@@ -11,6 +11,9 @@ import benchlib
 parser = benchlib.option_parser("whispers [options]")
 parser.add_option("-j", "--jobs", dest="jobs", type="int",
                   help="number of jobs")
+parser.add_option("-c", "--channel", dest="channel", type="int",
+                  help="use cthreading.Channel with specified capacity "
+                       "instead of Queue")
 parser.set_defaults(threads=200, jobs=5000)
 
 
@@ -21,27 +24,52 @@ def whispers(options):
     except ImportError:
         import queue
 
-    leftmost = queue.Queue()
+    if options.channel is not None:
+        import cthreading
+
+        def pipe():
+            chan = cthreading.Channel(options.channel)
+            return chan.send, chan.recv
+    else:
+        def pipe():
+            q = queue.Queue()
+            return q.put, q.get
+
+    leftmost = pipe()
     left = leftmost
     for i in benchlib.range(options.threads):
-        right = queue.Queue()
+        right = pipe()
         t = threading.Thread(target=whisper, args=(left, right))
         t.daemon = True
         t.start()
         left = right
 
-    for i in benchlib.range(options.jobs):
-        right.put(1)
+    if options.channel is not None:
+        # Sending to a full channel blocks until a value is received.
+        feeder = threading.Thread(target=feed, args=(right, options.jobs))
+        feeder.daemon = True
+        feeder.start()
+    else:
+        feed(right, options.jobs)
 
+    get = leftmost[1]
     for i in benchlib.range(options.jobs):
-        n = leftmost.get()
+        n = get()
         assert n == options.threads + 1
 
 
+def feed(right, jobs):
+    put = right[0]
+    for i in benchlib.range(jobs):
+        put(1)
+
+
 def whisper(left, right):
+    put = left[0]
+    get = right[1]
     while True:
-        n = right.get()
-        left.put(n + 1)
+        n = get()
+        put(n + 1)
 
 
 if __name__ == "__main__":